@@ -0,0 +1,83 @@
+#pragma once
+// Copyright (c) Shaun O'Kane, 2010, 2018
+
+// The compiler as a library. A Hello_context compiles source held in memory straight to script bytes, with a map
+// back to the source and any diagnostics. It keeps its compiler and buffers from one compilation to the next, so
+// after the first few it compiles without allocating. Contexts share nothing, so any number of threads can compile
+// at once, each with a context of its own. A context must not be used by two threads at once.
+//
+// Options are the Hello_compiler_options in Internals.h. The output formats and OUTPUT_STREAMING are ignored.
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef _WINDOWS
+#define HELLO_API __declspec(dllexport)
+#else
+#define HELLO_API
+#endif
+
+// The statement that generated script bytes [script_start, script_end). Code that no statement generated, e.g. the
+// final clean up of the stack, isn't in the map. The source span starts at the statement's first token, past any
+// whitespace and comments before it, and line is that token's line, one based as in diagnostics.
+typedef struct
+{
+	uint32_t script_start, script_end;
+	uint32_t source_start, source_end;	// byte offsets into the source.
+	uint32_t line;
+} Hello_source_span;
+
+#ifdef __cplusplus
+
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "Internals.h"
+
+struct HELLO_API Hello_context
+{
+	struct result
+	{
+		bool ok = false;
+		CScript script;
+		std::vector<Hello_source_span> source_map;	// in script order.
+		std::string diagnostics;	// the error of a failed compilation.
+	};
+
+	Hello_context();
+	~Hello_context();
+	Hello_context(const Hello_context&) = delete;
+	Hello_context& operator=(const Hello_context&) = delete;
+
+	// The result is valid until the next compile() or reset().
+	const result& compile(std::string_view source, uint32_t options);
+	const result& last_result() const { return last; }
+	void reset();	// forgets the last compilation, and e.g. the INCREMENTAL_COMPILE cache, but not the buffers.
+	// Imports in the source are relative to directory. Default is the current directory.
+	void set_source_directory(std::string_view directory);
+	std::string statistics() const;		// about the last compilation.
+
+private:
+	std::unique_ptr<class Hello_compiler> compiler;
+	result last;
+};
+
+extern "C" {
+#else
+typedef struct Hello_context Hello_context;
+#endif
+
+HELLO_API Hello_context* Hello_create_context(void);
+HELLO_API void Hello_destroy_context(Hello_context* context);
+HELLO_API void Hello_reset_context(Hello_context* context);
+HELLO_API void Hello_set_source_directory(Hello_context* context, const char* directory);
+// Returns 1 if the source compiled, else 0. The results below are valid until the next compile or reset.
+HELLO_API int Hello_compile(Hello_context* context, const char* source, size_t size, uint32_t options);
+HELLO_API const uint8_t* Hello_script(const Hello_context* context, size_t* size);
+HELLO_API const Hello_source_span* Hello_source_map(const Hello_context* context, size_t* no_of_spans);
+HELLO_API const char* Hello_diagnostics(const Hello_context* context);	// "" if there are none.
+
+#ifdef __cplusplus
+}
+#endif
@@ -3,9 +3,13 @@
 
 #include <map>
 #include <tuple>
+#include <string_view>
 #include <istream>
 #include <ostream>
 #include <algorithm>
+#include <memory>
+#include <new>
+#include <type_traits>
 #include "script/script.h"
 #include "script/standard.h"
 
@@ -17,10 +21,65 @@
 
 
 typedef std::vector<uint8_t> valtype; 
-typedef std::tuple<std::streampos, size_t, size_t> streampoint;
+typedef uint32_t streampoint;	// byte offset into the source.
 typedef struct { streampoint start, end; } stmt;  // stmts are specified by offset into source stream.
 typedef std::vector<stmt> stmt_table;
 
+// Maps byte offsets to line and column. The table of line starts is only built the first time
+// it is needed, i.e. when an error or annotation needs a line number.
+class WINDOW_EXPORT line_table
+{
+	std::string_view source;
+	mutable std::vector<streampoint> line_starts;
+public:
+	line_table(std::string_view _source = std::string_view()) : source(_source) {}
+	void reset(std::string_view _source) { source = _source; line_starts.clear(); }
+	std::pair<size_t, size_t> locate(streampoint pos) const;	// zero based (line, column)
+	size_t line(streampoint pos) const { return locate(pos).first; }
+};
+
+// Bump allocator. Everything allocated from an arena is released in one go by reset(), which keeps the
+// blocks for reuse by the next compilation. Destructors are only recorded for non-trivially destructible types.
+class WINDOW_EXPORT arena
+{
+	std::vector<std::unique_ptr<uint8_t[]>> blocks;
+	std::vector<size_t> block_sizes;
+	size_t current_block = 0;
+	uint8_t* next = nullptr;
+	size_t remaining = 0;
+	std::vector<std::pair<void*, void (*)(void*)>> destructors;
+	const size_t min_block_size;
+
+	void new_block(size_t size);
+public:
+	arena(size_t min_block_size = 64 * 1024) : min_block_size(min_block_size) {}
+	arena(const arena&) = delete;
+	arena& operator=(const arena&) = delete;
+	~arena() { reset(); }
+
+	void* allocate(size_t size, size_t align);
+	void reset();
+
+	template<typename T, typename... Args> T* make(Args&&... args)
+	{
+		T* p = new(allocate(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+		if(!std::is_trivially_destructible<T>::value)
+			destructors.emplace_back(p, [](void* q) { static_cast<T*>(q)->~T(); });
+		return p;
+	}
+
+	// Copies n trivially copyable items into the arena.
+	template<typename T> T* copy(const T* first, size_t n)
+	{
+		static_assert(std::is_trivially_copyable<T>::value, "arena::copy() needs trivially copyable items");
+		if(n == 0)
+			return nullptr;
+		T* p = static_cast<T*>(allocate(sizeof(T) * n, alignof(T)));
+		std::copy(first, first + n, p);
+		return p;
+	}
+};
+
 // This needs a lot of work.
 class WINDOW_EXPORT symbol_table : private std::map<std::string, size_t>  // variable name -> index in alt-stack
 {
@@ -29,7 +88,7 @@ public:
 	using std::map<std::string, size_t>::size;
 	using std::map<std::string, size_t>::find;
 	using std::map<std::string, size_t>::end;
-	using std::map<std::string, size_t>::clear;
+	void clear() { std::map<std::string, size_t>::clear(); variable_names.clear(); }
 	const std::string& at(size_t) const;
 	size_t insert(const std::string& variable_name);
 
@@ -38,36 +97,100 @@ public:
 	void declare_new_variable(class instruction_pipeline& pipe, const std::string& variable_name);
 };
 
-struct WINDOW_EXPORT instruction
-{
-	instruction(opcodetype op);
-	instruction(const valtype& v);
-	instruction(const instruction& instr);
-	enum class instruction_type : unsigned char { opcode, data } type;
-	union  // TODO: replace with std::variant.
-	{
-		valtype v;
-		enum opcodetype opcode;
-	};
-	size_t generating_stmt; // Need map instruction -> statment (index into stmt_table)
-	~instruction();
-	instruction& operator=(const instruction&);
-	bool operator==(enum opcodetype opcode) const;
-	// Needed for dllexport
-	instruction() {}
-};
-
-class WINDOW_EXPORT instruction_pipeline : public std::vector<instruction>
+// The instructions generated so far, held in script encoding as a structure of arrays. ops has one byte per 
+// instruction, which is the opcode, or for a data push its push opcode (1-75 or OP_PUSHDATA1/2/4). Push data lives 
+// in pool, already encoded as it will appear in the script, so serialisation is a byte copy. An empty push is OP_0.
+class WINDOW_EXPORT instruction_pipeline
 {
+	std::vector<uint8_t> ops;
+	std::vector<uint32_t> stmt_ids;		// generating statement of each instruction. Index into stmts.
+	std::vector<uint32_t> data_refs;	// offset into pool of each data push. Unused for other instructions.
+	std::vector<uint8_t> pool;
+	std::vector<std::pair<uint32_t, uint32_t>> placeholders;	// (data_ref, parameter) of each placeholder push.
 	uint32_t& options;
 	stmt_table& stmts;
+	uint32_t current_stmt = std::numeric_limits<uint32_t>::max();	// attributed to the instructions pushed.
+
+	void push(uint8_t op, uint32_t data_ref)
+	{
+		ops.push_back(op);
+		stmt_ids.push_back(current_stmt);
+		data_refs.push_back(data_ref);
+	}
 public:
 	instruction_pipeline(stmt_table& stmts, uint32_t& options);
 	instruction_pipeline& operator<<(enum opcodetype opcode);
 	instruction_pipeline& operator<<(const valtype& v);
 	instruction_pipeline& operator<<(const CScriptNum& v);
 	instruction_pipeline& operator<<(int n);
+	// A push of template parameter p, which a script_template fills in. A one byte push until then.
+	void placeholder(uint32_t p);
 	void declare_stmt(const stmt&);
+	void set_stmt(uint32_t stmt_id) { current_stmt = stmt_id; }	// for code generated after its statement.
+	void attribute(size_t first, size_t last, uint32_t stmt_id)	// [first, last) to stmt_id.
+	{
+		std::fill(stmt_ids.begin() + first, stmt_ids.begin() + last, stmt_id);
+	}
+
+	size_t size() const { return ops.size(); }
+	bool empty() const { return ops.empty(); }
+	static bool is_push(uint8_t op) { return op != OP_0 && op <= OP_PUSHDATA4; }
+	bool is_data(size_t k) const { return is_push(ops[k]); }
+	opcodetype opcode(size_t k) const { return opcodetype(ops[k]); }
+	opcodetype back() const { return opcodetype(ops.back()); }
+	uint32_t generating_stmt(size_t k) const { return stmt_ids[k]; }
+	std::pair<const uint8_t*, size_t> data(size_t k) const;		// the pushed bytes of a data push.
+	size_t encoded_size(size_t k) const;	// no. of script bytes for instruction k.
+	static constexpr uint32_t no_parameter = std::numeric_limits<uint32_t>::max();
+	uint32_t placeholder_at(size_t k) const;	// the template parameter that instruction k pushes, or no_parameter.
+
+	void erase_front(size_t n);		// drops [0, n) and its push data.
+
+	// Appends a copy of [first, last), which was generated for stmts[first_stmt, last_stmt). The copy is attributed
+	// to copies of those statements, which are appended to stmts, and any code in it from before the first of them
+	// to the current statement. e.g. an unrolled loop iteration.
+	void repeat(size_t first, size_t last, uint32_t first_stmt, uint32_t last_stmt);
+	// As repeat(), but copies from another pipeline, whose statements are shifted by shift bytes. e.g. a
+	// statement generated by an earlier compilation of the same source.
+	void append(const instruction_pipeline& from, size_t first, size_t last, uint32_t first_stmt, uint32_t last_stmt,
+		streampoint shift = 0);
+
+	// For passes that rewrite the pipeline in place. to <= from.
+	void move(size_t from, size_t to) { ops[to] = ops[from]; stmt_ids[to] = stmt_ids[from]; data_refs[to] = data_refs[from]; }
+	void replace(size_t k, opcodetype op) { ops[k] = uint8_t(op); }	// op must not be a data push.
+	void truncate(size_t n) { ops.resize(n); stmt_ids.resize(n); data_refs.resize(n); }
+	void clear()
+	{
+		ops.clear(); stmt_ids.clear(); data_refs.clear(); pool.clear(); placeholders.clear();
+		current_stmt = std::numeric_limits<uint32_t>::max();
+	}
+	void append_to(CScript& script, size_t first, size_t last) const;	// serialises [first, last) as script bytes.
+};
+
+// A script compiled with its $externs left as placeholders. instantiate() fills them in, so the same source can give
+// any number of scripts without being compiled again.
+class WINDOW_EXPORT script_template
+{
+public:
+	struct parameter
+	{
+		std::string name;	// without the $.
+		size_t size;		// the value must be exactly size bytes, and is patched in place. 0 for any size.
+	};
+	struct slot
+	{
+		size_t offset;		// into script.
+		size_t size;		// of the placeholder in script. 0 if the parameter's size isn't fixed.
+		uint32_t parameter;
+	};
+
+	CScript script;						// with size zero bytes pushed for each fixed size parameter.
+	std::vector<parameter> parameters;	// in order of first use, after the declared ones.
+	std::vector<slot> slots;			// in script order.
+
+	// values are in parameters order. A value of any size is pushed with the smallest encoding, e.g. OP_1..OP_16.
+	// Only reads the template, so any number of threads can instantiate the same template at once.
+	std::pair<bool, std::string> instantiate(const std::vector<valtype>& values, CScript& result) const;
 };
 
 std::tuple<CScript, bool, std::string> try_parse_script(std::string text)  noexcept;
@@ -82,6 +205,14 @@ public:
 
 	virtual std::pair<bool, std::string> step_over() = 0;
 	virtual std::pair<bool, std::string> compile(std::istream& in_filename, std::ostream& out_filename) = 0;
+	virtual std::pair<bool, std::string> compile(std::istream& in, CScript& script) = 0;	// no text formatting.
+	// $externs are left as placeholders, see declare_extern().
+	virtual std::pair<bool, std::string> compile(std::istream& in, script_template& t) = 0;
+	// Fixes the size of a template parameter, e.g. 33 for a compressed public key. Others can be any size.
+	virtual void declare_extern(const std::string& name, size_t size) = 0;
+	// Where import "path" looks for a relative path, e.g. the directory of the source file. Default is the current
+	// directory. A module's own imports are relative to the module.
+	virtual void set_source_directory(const std::string& directory) = 0;
 	virtual std::pair<bool, std::string> execute(std::string script_txt) = 0;
 	virtual std::pair<bool, std::string> go() = 0;
 	virtual std::pair<bool, std::string> step_into() = 0;
@@ -89,17 +220,20 @@ public:
 	virtual void reset()
 	{
 		symbol_table.clear(); stmts.clear(); pipe.clear(); stack.clear(); alt_stack.clear(); vfExec.clear();
+		ast_arena.reset();
 	}
 	virtual bool set_options(uint32_t options) = 0;
+	virtual std::string statistics() const = 0;		// about the last compilation, e.g. optimisations made.
 
 	// Compiler state
 	bool debugger_active = true;
 
 	// High-level language constructs
-	uint32_t options;
+	uint32_t options = 0;
 	symbol_table symbol_table;
 	stmt_table stmts; 
 	instruction_pipeline pipe;
+	arena ast_arena;	// owns the AST of the current compilation.
 
 	// Low-level Bitcoin constructs 
 	uint32_t flags = MANDATORY_SCRIPT_VERIFY_FLAGS | SCRIPT_VERIFY_DISCOURAGE_UPGRADABLE_NOPS;
@@ -113,7 +247,23 @@ typedef enum
 {
 	ASSERTS_ON=0x01,
 	OPTIMISER_ON=0x02,
-	OUTPUT_ANNOTATED_SCRIPT=0x04
+	OUTPUT_ANNOTATED_SCRIPT=0x04,
+	OUTPUT_STREAMING=0x08,	// with an output format, compile(istream&, ostream&) writes the script out a statement 
+							// at a time. Memory use is bounded by the largest statement, but pipe is left empty.
+							// With OPTIMISER_ON, code is generated a window of statements at a time. Variables that are
+							// live at the end of a window stay on the stack until they are overwritten or the script ends.
+	OUTPUT_BINARY_SCRIPT=0x10,	// raw script bytes.
+	OUTPUT_HEX_SCRIPT=0x20,		// the script bytes as a single line of hex.
+	EXTERN_PLACEHOLDERS=0x40,	// set while compiling a script_template. $externs are placeholders, not getenv().
+	OPTIMISE_FOR_SIZE=0x80,		// with OPTIMISER_ON, the smallest script (-Os) rather than a balance of size and
+	OPTIMISE_FOR_OPS=0x100,		// execution cost, or the cheapest to execute (-Oops). See cost_model. -Os is never
+							// bigger than the script without the optimiser, so the whole script is compiled before
+							// any of it is written out, even with OUTPUT_STREAMING.
+	INCREMENTAL_COMPILE=0x200,	// without OPTIMISER_ON, the code of each top-level statement is kept, and reused by later
+							// compilations while its text and the variables before it are unchanged. e.g. an editor.
+	MODULE_CACHE_ON_DISK=0x400,	// imported modules are also cached in .hll_cache next to each module, for later
+							// compilations, e.g. by other processes. Otherwise they are only cached in memory.
+	OUTPUT_FORMATS=OUTPUT_ANNOTATED_SCRIPT|OUTPUT_BINARY_SCRIPT|OUTPUT_HEX_SCRIPT
 } Hello_compiler_options;
 
 WINDOW_EXPORT bool EvalScript(std::vector<valtype>& stack,
@@ -1,5 +1,17 @@
 #include <fstream>
 #include <iostream>
+#include <sstream>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
+#include <filesystem>
+#ifdef _WINDOWS
+#include <io.h>
+#include <fcntl.h>
+#endif
 #include "../Common/Internals.h"
 
 using namespace std;
@@ -62,24 +74,369 @@ int args::getopt()
 
 void usage()
 {
-	cout << "Hello -t | [-o] -f <in-filename> [-o <out-filename>]\n"
+	cout << "Hello -t | [-O | -Os | -Oops] [-c] [-v] [-b | -H] -f <in-filename> [-o <out-filename>]\n"
+			"Hello [-O | -Os | -Oops] [-c] [-v] [-b | -H] [-j <threads>] -f <in-filename> -f <in-filename>... | -m <manifest>\n"
+			"Hello -S [-j <threads>]\n"
 		    "\n"
 			"\t-f <in-filename>  \tOptional. Compile <in-filename>.\n"
-			"\t                  \tDefault is std input if in-filename does not exists.\n";
+			"\t                  \tDefault is std input if in-filename does not exists.\n"
+			"\t                  \tWith more than one, each is compiled to <in-filename>.script, or .bin or .hex.\n"
+			"\t-m <manifest>     \tOptional. Compile each file named in <manifest>, one per line, as for -f.\n"
 			"\t-o <out-filename> \tOptional. Compile output to <out-filename>. \n"
 			"\t                  \tDefault is <in-filename>.script if out-filename does not exists.\n"
 			"\t                  \tIf both in-filename and out-filename do not exist, defaults to std output.\n"
-			"\t-O                \tOptional. Optimiser on. Default is optimiser off.\n";
+			"\t-O                \tOptional. Optimiser on. Default is optimiser off.\n"
+			"\t-Os               \tOptional. Optimiser on, for the smallest script.\n"
+			"\t-Oops             \tOptional. Optimiser on, for the cheapest script to execute.\n"
+			"\t-c                \tOptional. Cache compiled imports in .hll_cache, next to each module, for later\n"
+			"\t                  \tcompilations. Default is to compile them afresh each run.\n"
+			"\t-v                \tOptional. Write compilation statistics, e.g. optimisations made, to std error.\n"
+			"\t-b                \tOptional. Output the raw script bytes. Default is annotated script text.\n"
+			"\t-H                \tOptional. Output the script bytes as a single line of hex.\n"
+			"\t-S                \tCompile server. Answers compile requests from std input on std output, until\n"
+			"\t                  \tthe end of std input. See compile_server.\n"
+			"\t-j <threads>      \tOptional. No. of files or requests compiled at once. Default is one per core.\n";
+}
+
+// The options for -O<suffix>, or 0 if it isn't one.
+uint32_t optimiser_options(const char* suffix)
+{
+	if(strcmp(suffix, "") == 0)
+		return OPTIMISER_ON;
+	if(strcmp(suffix, "s") == 0)
+		return OPTIMISER_ON | OPTIMISE_FOR_SIZE;
+	if(strcmp(suffix, "ops") == 0)
+		return OPTIMISER_ON | OPTIMISE_FOR_OPS;
+	return 0;
+}
+
+// The file a script is compiled to. The compiler writes each statement out as soon as it is compiled, so the script
+// goes to a file of its own next to it, which only replaces it once the whole source has compiled. A compilation
+// that fails leaves it empty, rather than holding the start of a script. Anything but a regular file, e.g. a link
+// such as /dev/stdout, or a pipe, is written to directly, as replacing it would replace the link or device.
+class output_file
+{
+	string name, temp;
+public:
+	ofstream f;
+
+	bool open(const string& _name, uint32_t output_format)
+	{
+		name = _name;
+		error_code ec;
+		auto status = filesystem::symlink_status(name, ec);
+		bool replaceable = status.type() == filesystem::file_type::not_found || filesystem::is_regular_file(status);
+		temp = replaceable ? name + ".tmp" : string();
+		f.open(replaceable ? temp : name, output_format == OUTPUT_BINARY_SCRIPT ? ios::out | ios::binary : ios::out);
+		return f.is_open();
+	}
+	bool commit()
+	{
+		f.close();
+		error_code ec;
+		if(!temp.empty())
+			filesystem::rename(temp, name, ec);
+		return !f.fail() && !ec;
+	}
+	void discard()
+	{
+		f.close();
+		if(temp.empty())
+			return;
+		error_code ec;
+		filesystem::remove(temp, ec);
+		ofstream(name, ios::out | ios::trunc);
+	}
+};
+
+// Compiles requests read from in, and writes the responses to out, so that a build can compile any no. of scripts
+// without starting a process and creating a compiler for each. Each worker thread has a compiler of its own, which
+// is reused for every request it takes. A request is a header line followed by the source:
+//
+//     <id> <no. of source bytes> [-O | -Os | -Oops] [-b | -H] [-c] [-v]\n<source>
+//
+// and its response, which can come before those of earlier requests, is:
+//
+//     <id> ok | failed <no. of script bytes> <no. of diagnostic bytes>\n<script><diagnostics>
+//
+// The options are as on the command line. The diagnostics are the error of a failed compilation, and with -v the
+// statistics. id is any word, for the client to match responses to requests.
+class compile_server
+{
+	struct request
+	{
+		string id;
+		string source;
+		uint32_t options = OUTPUT_ANNOTATED_SCRIPT;
+		bool verbose = false;
+	};
+
+	istream& in;
+	ostream& out;
+	mutex queue_mutex;
+	condition_variable queue_changed;
+	deque<request> queue;
+	bool end_of_requests = false;
+	mutex out_mutex;
+
+	bool read(request& r, string& error);
+	void work();
+	void respond(const string& id, bool ok, const string& script, const string& diagnostics);
+public:
+	compile_server(istream& _in, ostream& _out) : in(_in), out(_out) {}
+	int run(size_t no_of_workers);
+};
+
+int compile_server::run(size_t no_of_workers)
+{
+	in.tie(nullptr);	// reading would flush out, outside out_mutex.
+	vector<thread> workers;
+	for(size_t k = 0; k < no_of_workers; k++)
+		workers.emplace_back(&compile_server::work, this);
+
+	request r;
+	string error;
+	bool ok;
+	while((ok = read(r, error)))
+	{
+		lock_guard<mutex> lock(queue_mutex);
+		queue.push_back(move(r));
+		queue_changed.notify_one();
+	}
+	{
+		lock_guard<mutex> lock(queue_mutex);
+		end_of_requests = true;
+		queue_changed.notify_all();
+	}
+	for(auto& worker : workers)
+		worker.join();
+	if(!error.empty())
+	{
+		cerr << error << flush;	// the rest of the input can't be split into requests.
+		return -1;
+	}
+	return 0;
+}
+
+// Returns false at the end of the input, or if the request is malformed, which error then says.
+bool compile_server::read(request& r, string& error)
+{
+	string header;
+	do
+	{
+		if(!getline(in, header))
+			return false;
+	} while(header.empty());
+
+	istringstream fields(header);
+	size_t size = 0;
+	r = request();
+	if(!(fields >> r.id >> size))
+	{
+		error = "Bad request header: '" + header + "'\n";
+		return false;
+	}
+	string option;
+	while(fields >> option)
+	{
+		if(option[0] == '-' && option[1] == 'O' && optimiser_options(option.c_str() + 2))
+			r.options |= optimiser_options(option.c_str() + 2);
+		else if(option == "-b" || option == "-H")
+			r.options = (r.options & ~OUTPUT_FORMATS) | (option == "-b" ? OUTPUT_BINARY_SCRIPT : OUTPUT_HEX_SCRIPT);
+		else if(option == "-c")
+			r.options |= MODULE_CACHE_ON_DISK;
+		else if(option == "-v")
+			r.verbose = true;
+		else
+		{
+			error = "Bad option in request '" + r.id + "': " + option + "\n";
+			return false;
+		}
+	}
+	r.source.resize(size);
+	if(!in.read(&r.source[0], streamsize(size)))
+	{
+		error = "Request '" + r.id + "' ends before its source does.\n";
+		return false;
+	}
+	return true;
+}
+
+void compile_server::work()
+{
+	unique_ptr<executable> compiler(create_Hello_compiler());
+	stringstream script;
+	for(;;)
+	{
+		request r;
+		{
+			unique_lock<mutex> lock(queue_mutex);
+			queue_changed.wait(lock, [this] { return !queue.empty() || end_of_requests; });
+			if(queue.empty())
+				return;
+			r = move(queue.front());
+			queue.pop_front();
+		}
+		compiler->set_options(r.options);
+		istringstream source(move(r.source));
+		script.str(string());
+		auto [ok, diagnostics] = compiler->compile(source, script);
+		if(r.verbose)
+			diagnostics += compiler->statistics();
+		respond(r.id, ok, ok ? script.str() : string(), diagnostics);
+	}
+}
+
+void compile_server::respond(const string& id, bool ok, const string& script, const string& diagnostics)
+{
+	lock_guard<mutex> lock(out_mutex);
+	out << id << (ok ? " ok " : " failed ") << script.size() << ' ' << diagnostics.size() << '\n' << script
+		<< diagnostics << flush;
+}
+
+// Compiles many files at once, each to the output file that -f alone would give it. Each worker thread has a
+// compiler of its own, and takes the next file that no other has, so nothing is shared but the index of that file.
+// The errors, and with -v the statistics, are kept by file and written out at the end, in the order given,
+// followed by the throughput.
+class batch_compiler
+{
+	struct result
+	{
+		bool ok = false;
+		string diagnostics;
+		size_t source_size = 0, script_size = 0;
+	};
+
+	const vector<string>& in_filenames;
+	uint32_t options;
+	bool verbose;
+	atomic<size_t> next_file {0};
+	vector<result> results;
+
+	void work();
+	void compile(executable& compiler, size_t k);
+public:
+	batch_compiler(const vector<string>& _in_filenames, uint32_t _options, bool _verbose)
+		: in_filenames(_in_filenames), options(_options), verbose(_verbose), results(_in_filenames.size()) {}
+	int run(size_t no_of_workers);
+};
+
+int batch_compiler::run(size_t no_of_workers)
+{
+	auto start = chrono::steady_clock::now();
+	vector<thread> workers;
+	for(size_t k = 0; k < min(no_of_workers, in_filenames.size()); k++)
+		workers.emplace_back(&batch_compiler::work, this);
+	for(auto& worker : workers)
+		worker.join();
+	double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+	size_t failed = 0, source_size = 0, script_size = 0;
+	for(size_t k = 0; k < results.size(); k++)
+	{
+		auto& r = results[k];
+		if(!r.ok)
+			cerr << "'" << in_filenames[k] << "' compilation failed. ";
+		else if(!r.diagnostics.empty())
+			cerr << "'" << in_filenames[k] << "':\n";
+		cerr << r.diagnostics;
+		failed += !r.ok;
+		source_size += r.source_size;
+		script_size += r.script_size;
+	}
+	cerr << "Batch:\n"
+		"\tfiles: " << results.size() << ", failed: " << failed << "\n"
+		"\tsource: " << source_size << " bytes\n"
+		"\tscript: " << script_size << " bytes\n"
+		"\tthreads: " << workers.size() << "\n"
+		"\ttime: " << seconds * 1000 << " ms\n"
+		"\tthroughput: " << results.size() / seconds << " files/s, " << source_size / seconds / 1024
+		<< " KB/s of source\n" << flush;
+	return failed ? -1 : 0;
+}
+
+// The compiler is reused from one file to the next, so after the first few it compiles into the buffers that it
+// has already grown.
+void batch_compiler::work()
+{
+	unique_ptr<executable> compiler(create_Hello_compiler());
+	compiler->set_options(options);
+	for(size_t k; (k = next_file++) < in_filenames.size(); )
+		compile(*compiler, k);
+}
+
+void batch_compiler::compile(executable& compiler, size_t k)
+{
+	auto& r = results[k];
+	const string& in_filename = in_filenames[k];
+	ifstream f_in(in_filename, ios::in | ios::ate);
+	if(!f_in.is_open())
+	{
+		r.diagnostics = "Unable to read input stream.\n";
+		return;
+	}
+	r.source_size = size_t(f_in.tellg());
+	f_in.seekg(0);
+
+	uint32_t output_format = options & OUTPUT_FORMATS;
+	string out_filename = in_filename + (output_format == OUTPUT_BINARY_SCRIPT ? ".bin" :
+		output_format == OUTPUT_HEX_SCRIPT ? ".hex" : ".script");
+	output_file f_out;
+	if(!f_out.open(out_filename, output_format))
+	{
+		r.diagnostics = "Unable to open output stream.\n";
+		return;
+	}
+
+	compiler.set_source_directory(filesystem::path(in_filename).parent_path().string());
+	tie(r.ok, r.diagnostics) = compiler.compile(f_in, f_out.f);
+	if(!r.ok)
+	{
+		f_out.discard();
+		return;
+	}
+	r.script_size = size_t(f_out.f.tellp());
+	if(!f_out.commit())
+	{
+		r.ok = false;
+		r.diagnostics = "Unable to write output stream.\n";
+		return;
+	}
+	if(verbose)
+		r.diagnostics += compiler.statistics();
+}
+
+// Appends the file names in the manifest, one per line. Blank lines are skipped.
+bool read_manifest(const string& manifest, vector<string>& in_filenames)
+{
+	ifstream f(manifest);
+	if(!f.is_open())
+		return false;
+	for(string line; getline(f, line); )
+	{
+		if(!line.empty() && line.back() == '\r')
+			line.pop_back();
+		if(!line.empty())
+			in_filenames.push_back(line);
+	}
+	return true;
 }
 
 int main(int argc, char** argv)
 {
-	args cmdline(argc, (const char**)argv, "f:o:O");
+	args cmdline(argc, (const char**)argv, "f:m:o:ObHcvSj:");
 	
 	// Command line options.
 	string in_filename, out_filename;
-	bool optimiser_on = false;
+	vector<string> in_filenames;	// all of them, in a batch.
+	bool batch = false;
+	uint32_t optimiser = 0;
+	uint32_t module_cache = 0;
+	bool verbose = false;
+	uint32_t output_format = OUTPUT_ANNOTATED_SCRIPT;
 	bool execute = false;
+	bool server = false;
+	size_t no_of_threads = max(thread::hardware_concurrency(), 1u);
 
 	// Update options from Command line.
 	int ch;
@@ -89,24 +446,70 @@ int main(int argc, char** argv)
 		{
 		case 'f':
 			in_filename = cmdline.optarg;
+			in_filenames.push_back(in_filename);
+			break;
+		case 'm':
+			if(!read_manifest(cmdline.optarg, in_filenames))
+			{
+				cerr << "Unable to read manifest '" << cmdline.optarg << "'.\n";
+				return -1;
+			}
+			batch = true;
 			break;
 		case 'o':
 			out_filename = cmdline.optarg;
 			break;
 		case 'O':
-			optimiser_on = true;
+			optimiser = optimiser_options(cmdline.arg + 1);
+			if(optimiser == 0)
+			{
+				usage();
+				return -1;
+			}
+			break;
+		case 'c':
+			module_cache = MODULE_CACHE_ON_DISK;
+			break;
+		case 'v':
+			verbose = true;
+			break;
+		case 'b':
+			output_format = OUTPUT_BINARY_SCRIPT;
+			break;
+		case 'H':
+			output_format = OUTPUT_HEX_SCRIPT;
 			break;
 		case 'x':
 			execute = true;
 			break;
+		case 'S':
+			server = true;
+			break;
+		case 'j':
+			no_of_threads = strtoul(cmdline.optarg, nullptr, 10);
+			break;
 		}
 	}
-	if(ch == '?')
+	batch = batch || in_filenames.size() > 1;
+	if(ch == '?' || no_of_threads == 0 || (batch && !out_filename.empty()))
 	{
 		usage();
 		return -1;
 	}
 
+	if(server)
+	{
+#ifdef _WINDOWS
+		_setmode(_fileno(stdin), _O_BINARY);	// sizes are in bytes.
+		_setmode(_fileno(stdout), _O_BINARY);
+#endif
+		ios::sync_with_stdio(false);
+		return compile_server(cin, cout).run(no_of_threads);
+	}
+
+	if(batch)
+		return batch_compiler(in_filenames, output_format | OUTPUT_STREAMING | optimiser | module_cache, verbose).run(no_of_threads);
+
 	// Open the input stream
 	istream* in_stream = nullptr;
 	ifstream f_in;
@@ -125,35 +528,44 @@ int main(int argc, char** argv)
 
 	// Open the output stream
 	ostream* out_stream = nullptr;
-	ofstream f_out;
+	output_file f_out;
 	if(!out_filename.empty() || !in_filename.empty())
 	{
 		if(out_filename.empty())
-			out_filename = in_filename + ".script";
-		f_out.open(out_filename);
-		if(!f_out.is_open())
+			out_filename = in_filename + (output_format == OUTPUT_BINARY_SCRIPT ? ".bin" : output_format == OUTPUT_HEX_SCRIPT ? ".hex" : ".script");
+		if(!f_out.open(out_filename, output_format))
 		{
 			cerr << "Unable to open output stream.\n";
 			return -1;
 		}
-		out_stream = &f_out;
+		out_stream = &f_out.f;
 	}
 	else
 		out_stream = &cout;
 
 	// Create the compiler.
 	shared_ptr<executable> compiler(create_Hello_compiler());
-	if(optimiser_on)
-		compiler->set_options(Hello_compiler_options::OPTIMISER_ON);
-	compiler->set_options(OUTPUT_ANNOTATED_SCRIPT);
+	uint32_t options = output_format | OUTPUT_STREAMING;
+	options |= optimiser | module_cache;
+	compiler->set_options(options);
+	compiler->set_source_directory(filesystem::path(in_filename).parent_path().string());	// for its imports.
 
 	// Compile the code.
 	auto [ok, err_str] = compiler->compile(*in_stream, *out_stream);
 	if(!ok)
 	{
+		if(out_stream == &f_out.f)
+			f_out.discard();
 		cerr << "'" << in_filename << "' compilation failed. " << err_str << flush;
 		return -1;
 	}
+	if(out_stream == &f_out.f && !f_out.commit())
+	{
+		cerr << "Unable to write output stream.\n";
+		return -1;
+	}
+	if(verbose)
+		cerr << compiler->statistics() << flush;
 	return 0;
 }
 
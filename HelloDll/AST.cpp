@@ -4,9 +4,84 @@
 #include <fstream>
 #include "utilstrencodings.h"
 #include "../Common/Internals.h"
+#include "intrinsics.h"
 
 using namespace std;
 
+///////////////////////////////////////////////////////////////////////////////
+//
+//  AST_node
+//
+///////////////////////////////////////////////////////////////////////////////
+
+// The width of a uintN, or of a byte array whose width is known, e.g. a hash. 0 for a number.
+static size_t width_of(const AST_node& node, const Hello_compiler& compiler)
+{
+	size_t size = node.big_size(compiler);
+	return size ? size : node.inferred.kind == _hex ? node.inferred.width : 0;
+}
+
+// A script number is converted with NUM2BIN, so should not be negative. A uintN, or byte array, of another size is
+// zero extended or truncated.
+bool AST_node::generate_as(class Hello_compiler& compiler, size_t size)
+{
+	auto& pipe = compiler.pipe;
+	size_t from = width_of(*this, compiler);
+	bool ok = generate(compiler);
+	if(from == 0)
+		pipe << int(size) << OP_NUM2BIN;
+	else if(from < size)
+		pipe << valtype(size - from, 0) << OP_CAT;
+	else if(from > size)
+		pipe << int(size) << OP_SPLIT << OP_DROP;
+	return ok;
+}
+
+void AST_node::lower_as(class Hello_compiler& compiler, size_t size)
+{
+	auto& ir = compiler.ir;
+	size_t from = width_of(*this, compiler);
+	lower(compiler);
+	if(from == 0)
+	{
+		ir.push_constant(CScriptNum(int64_t(size)).getvch(), _integer);
+		ir.apply(OP_NUM2BIN, 2, 1);
+	}
+	else if(from < size)
+	{
+		ir.push_constant(valtype(size - from, 0), _hex);
+		ir.apply(OP_CAT, 2, 1);
+	}
+	else if(from > size)
+	{
+		ir.push_constant(CScriptNum(int64_t(size)).getvch(), _integer);
+		ir.apply(OP_SPLIT, 2, 2);
+		ir.discard(1);
+	}
+}
+
+// Expands the body of a user intrinsic, or of a uintN operation, in place.
+static void generate_body(instruction_pipeline& pipe, const CScript& body)
+{
+	opcodetype opcode;
+	valtype data;
+	for(auto pc = body.begin(); body.GetOp(pc, opcode, data); )
+	{
+		if(opcode == OP_0 || opcode > OP_PUSHDATA4)
+			pipe << opcode;
+		else
+			pipe << data;
+	}
+}
+
+// The limb code for op on uintN operands of size bytes.
+static const intrinsic& big_operation(class Hello_compiler& compiler, token_kind op, size_t size)
+{
+	if(!big_integer_lowering::is_supported(op))
+		throw runtime_error("Operator '" + string(spelling(op)) + "' is not supported for uint" + to_string(size * 8) + ".");
+	return compiler.big_integers.operation(op, size, compiler.costs);
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 //
 //  const_node
@@ -19,7 +94,7 @@ const_node::const_node(string _value, value_type _type)
 {
 }
 
-bool const_node::generate(class Hello_compiler& compiler, istream& f) 
+bool const_node::generate(class Hello_compiler& compiler) 
 {
 	auto& pipe = compiler.pipe;
 	switch(type)
@@ -36,6 +111,63 @@ bool const_node::generate(class Hello_compiler& compiler, istream& f)
 	return true; 
 };
 
+void const_node::lower(class Hello_compiler& compiler)
+{
+	switch(type)
+	{
+	case _hex:
+		compiler.ir.push_constant(ParseHex(value.c_str()), _hex);
+		break;
+	case _integer:
+		compiler.ir.push_constant(CScriptNum(atoi(value.c_str())).getvch(), _integer);
+		break;
+	default:
+		throw runtime_error("Unsupported constant type.");
+	}
+}
+
+inferred_type const_node::infer(class type_checker&)
+{
+	switch(type)
+	{
+	case _hex:		inferred = {_hex, uint32_t(value.size() / 2)}; break;
+	case _integer:	inferred = {_integer, uint32_t(max<size_t>(CScriptNum(atoi(value.c_str())).getvch().size(), 1))}; break;
+	default:		inferred = {}; break;
+	}
+	return inferred;
+}
+
+bool const_node::is_zero() const
+{
+	return type == _integer && atoi(value.c_str()) == 0;
+}
+
+valtype const_node::big_value(size_t size) const
+{
+	valtype v;
+	if(type == _hex)
+		v = ParseHex(value.c_str());
+	else
+	{
+		int64_t n = atoi(value.c_str());
+		for(size_t k = 0; k < size; k++, n >>= 8)	// keeps the sign.
+			v.push_back(uint8_t(n));
+	}
+	v.resize(size, 0);
+	return v;
+}
+
+bool const_node::generate_as(class Hello_compiler& compiler, size_t size)
+{
+	compiler.pipe << big_value(size);
+	return true;
+}
+
+void const_node::lower_as(class Hello_compiler& compiler, size_t size)
+{
+	compiler.ir.push_constant(big_value(size), _hex);
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 //
 //  rvalue_node
@@ -48,10 +180,12 @@ rvalue_node::rvalue_node(string _variable_name, bool _is_extern)
 {
 }
 
-bool rvalue_node::generate(class Hello_compiler& compiler, istream& f)
+bool rvalue_node::generate(class Hello_compiler& compiler)
 {
 	instruction_pipeline& pipe = compiler.pipe;
-	if(is_extern)
+	if(is_extern && (compiler.options & EXTERN_PLACEHOLDERS))
+		pipe.placeholder(compiler.template_parameter(variable_name));
+	else if(is_extern)
 		pipe << compiler.get_extern_value(variable_name);
 	else if(variable_name != "tos")
 		compiler.copy_to_top_of_stack(variable_name);
@@ -60,6 +194,33 @@ bool rvalue_node::generate(class Hello_compiler& compiler, istream& f)
 	return true; 
 };
 
+size_t rvalue_node::big_size(const class Hello_compiler& compiler) const
+{
+	return is_extern ? 0 : compiler.big_size(variable_name);
+}
+
+void rvalue_node::lower(class Hello_compiler& compiler)
+{
+	if(is_extern && (compiler.options & EXTERN_PLACEHOLDERS))
+		compiler.ir.push_extern(compiler.template_parameter(variable_name));
+	else if(is_extern)
+		compiler.ir.push_constant(compiler.get_extern_value(variable_name), _hex);
+	else if(variable_name != "tos")
+		compiler.ir.push_variable(variable_name);
+	else
+		compiler.ir.push_tos();
+}
+
+// An input could be anything, but is pushed as a byte array.
+inferred_type rvalue_node::infer(class type_checker& checker)
+{
+	if(is_extern)
+		inferred = {_hex};
+	else
+		inferred = variable_name != "tos" ? checker.variable(variable_name) : inferred_type();
+	return inferred;
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 //
 //  assign_op
@@ -72,14 +233,17 @@ assign_op::assign_op(string _variable_name, AST_node_ptr _v, const streampoint&
 }
 
 // Should probably move this logic into lvalue_node...
-bool assign_op::generate(class Hello_compiler& compiler, istream& f)
+bool assign_op::generate(class Hello_compiler& compiler)
 {
 	auto& pipe = compiler.pipe;
 	pipe.declare_stmt({streampos1, streampos2});
 
-	// 1. Put the result of the RHS expression on top of the stack.
+	// 1. Put the result of the RHS expression on top of the stack. A uintN variable keeps its size.
 	assert(expr);
-	expr->generate(compiler, f);
+	if(size_t size = compiler.big_size(variable_name))
+		expr->generate_as(compiler, size);
+	else
+		expr->generate(compiler);
 
 	// 2. Move the value into the slot in the alt-stack reserved for the variable.
 	if(variable_name != "tos")
@@ -87,76 +251,271 @@ bool assign_op::generate(class Hello_compiler& compiler, istream& f)
 	return true; 
 };
 
+void assign_op::lower(class Hello_compiler& compiler)
+{
+	compiler.pipe.declare_stmt({streampos1, streampos2});
+	assert(expr);
+	if(size_t size = compiler.big_size(variable_name))
+		expr->lower_as(compiler, size);
+	else
+		expr->lower(compiler);
+	if(variable_name != "tos")
+		compiler.ir.assign(variable_name);	// otherwise the value stays on the stack.
+}
+
+// uintN declarations take effect here, before the statement is generated. A variable assigned a uintN without
+// being declared as one holds its bytes, which aren't a number.
+inferred_type assign_op::infer(class type_checker& checker)
+{
+	checker.begin_stmt(streampos1);
+	assert(expr);
+	if(declared_size)
+		checker.compiler.declare_big(variable_name, declared_size);
+	inferred_type type = expr->infer(checker);
+	if(size_t size = checker.compiler.big_size(variable_name))
+		type = {_hex, uint32_t(size), true};
+	else
+		type.is_uint = false;
+	if(variable_name != "tos")
+		checker.assign(variable_name, type);
+	return inferred = {};
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 //
 //  binary_op
 //
 ///////////////////////////////////////////////////////////////////////////////
 
-binary_op::binary_op(string _op, AST_node_ptr _a, AST_node_ptr _b) 
+binary_op::binary_op(token_kind _op, AST_node_ptr _a, AST_node_ptr _b) 
 	: op(_op), a(_a), b(_b)
 {
 }
 
-bool binary_op::generate(class Hello_compiler& compiler, istream& f)
+// token_kind -> opcode for the binary operators. OP_INVALIDOPCODE for anything else.
+struct binary_opcode_table
 {
-	auto& pipe = compiler.pipe;
-	bool is_ok = a->generate(compiler, f);
-	if(is_ok) is_ok = b->generate(compiler, f);
-	if(op == "+")
-	{
-		pipe << OP_ADD;
-	}
-	else if(op == "-")
-	{
-		pipe << OP_SUB;
-	}
-	else if(op == "*")
+	opcodetype opcodes[size_t(token_kind::_count)];
+
+	constexpr binary_opcode_table() : opcodes()
 	{
-		pipe << OP_MUL;
+		for(auto& opcode : opcodes)
+			opcode = OP_INVALIDOPCODE;
+		opcodes[size_t(token_kind::_plus)] = OP_ADD;
+		opcodes[size_t(token_kind::_minus)] = OP_SUB;
+		opcodes[size_t(token_kind::_star)] = OP_MUL;
+		opcodes[size_t(token_kind::_slash)] = OP_DIV;
+		opcodes[size_t(token_kind::_percent)] = OP_MOD;
+		opcodes[size_t(token_kind::_lt)] = OP_LESSTHAN;
+		opcodes[size_t(token_kind::_le)] = OP_LESSTHANOREQUAL;
+		opcodes[size_t(token_kind::_ge)] = OP_GREATERTHANOREQUAL;
+		opcodes[size_t(token_kind::_gt)] = OP_GREATERTHAN;
+		opcodes[size_t(token_kind::_concat)] = OP_CAT;   // follows Crypto conventions
+		opcodes[size_t(token_kind::_and)] = OP_BOOLAND;
+		opcodes[size_t(token_kind::_or)] = OP_BOOLOR;
 	}
-	else if(op == "/")
+
+	constexpr opcodetype operator[](token_kind op) const { return opcodes[size_t(op)]; }
+};
+
+static constexpr binary_opcode_table binary_opcodes;
+
+// The code for == and !=, from the operand types. Comparing a number with 0 tests the number on its own, and != on
+// two numbers is OP_NUMNOTEQUAL, but only if they are small numbers: the number opcodes fail on anything longer
+// than 4 bytes, and would treat e.g. 0x80 as 0. Otherwise the operands are compared as byte arrays.
+struct equality_code
+{
+	AST_node_ptr first, second;		// second is nullptr when comparing with 0.
+	opcodetype opcodes[2];			// the second can be OP_INVALIDOPCODE.
+};
+
+static equality_code equality(token_kind op, AST_node_ptr a, AST_node_ptr b)
+{
+	bool is_eq = op == token_kind::_eq;
+	if(a->is_zero() && b->inferred.is_small_number())
+		swap(a, b);
+	if(b->is_zero() && a->inferred.is_small_number())
+		return {a, nullptr, {is_eq ? OP_NOT : OP_0NOTEQUAL, OP_INVALIDOPCODE}};
+	if(is_eq)
+		return {a, b, {OP_EQUAL, OP_INVALIDOPCODE}};
+	if(a->inferred.is_small_number() && b->inferred.is_small_number())
+		return {a, b, {OP_NUMNOTEQUAL, OP_INVALIDOPCODE}};
+	return {a, b, {OP_EQUAL, OP_NOT}};
+}
+
+size_t binary_op::operand_size(const class Hello_compiler& compiler) const
+{
+	return op == token_kind::_concat ? 0 : max(a->big_size(compiler), b->big_size(compiler));	// || works on bytes.
+}
+
+size_t binary_op::big_size(const class Hello_compiler& compiler) const
+{
+	return (op == token_kind::_plus || op == token_kind::_minus || op == token_kind::_star) ? operand_size(compiler) : 0;
+}
+
+bool binary_op::generate(class Hello_compiler& compiler)
+{
+	auto& pipe = compiler.pipe;
+	if(size_t size = operand_size(compiler))
 	{
-		pipe << OP_DIV;
+		const intrinsic& info = big_operation(compiler, op, size);
+		bool is_ok = a->generate_as(compiler, size) && b->generate_as(compiler, size);
+		generate_body(pipe, *info.body);
+		return is_ok;
 	}
-	else if(op == "%")
+	if(op == token_kind::_eq || op == token_kind::_ne)
 	{
-		pipe << OP_MOD;
+		equality_code code = equality(op, a, b);
+		bool is_ok = code.first->generate(compiler) && (!code.second || code.second->generate(compiler));
+		for(opcodetype opcode : code.opcodes)
+		{
+			if(opcode != OP_INVALIDOPCODE)
+				pipe << opcode;
+		}
+		return is_ok;
 	}
-	else if(op == "<")
+	bool is_ok = a->generate(compiler);
+	if(is_ok) is_ok = b->generate(compiler);
+	opcodetype opcode = binary_opcodes[op];
+	if(opcode == OP_INVALIDOPCODE)
 	{
-		pipe << OP_LESSTHAN;
+		assert(false);
+		return false;
 	}
-	else if(op == "<=")
+	pipe << opcode;
+	return true;
+}
+
+void binary_op::lower(class Hello_compiler& compiler)
+{
+	if(size_t size = operand_size(compiler))
 	{
-		pipe << OP_LESSTHANOREQUAL;
+		const intrinsic& info = big_operation(compiler, op, size);
+		a->lower_as(compiler, size);
+		b->lower_as(compiler, size);
+		compiler.ir.apply(info.opcode, 2, 1, &info);
+		return;
 	}
-	else if(op == "==")
+	if(op == token_kind::_eq || op == token_kind::_ne)
 	{
-		pipe << OP_EQUAL;
+		equality_code code = equality(op, a, b);
+		code.first->lower(compiler);
+		if(code.second)
+			code.second->lower(compiler);
+		compiler.ir.apply(code.opcodes[0], code.second ? 2 : 1, 1);
+		if(code.opcodes[1] != OP_INVALIDOPCODE)
+			compiler.ir.apply(code.opcodes[1], 1, 1);
+		return;
 	}
-	else if(op == "!=")
+	a->lower(compiler);
+	b->lower(compiler);
+	opcodetype opcode = binary_opcodes[op];
+	if(opcode == OP_INVALIDOPCODE)
+		throw runtime_error("Unsupported binary operator.");
+	compiler.ir.apply(opcode, 2, 1);
+}
+
+// || works on byte arrays, and == and != on anything. The rest take numbers, unless an operand is a uintN.
+inferred_type binary_op::infer(class type_checker& checker)
+{
+	inferred_type ta = a->infer(checker), tb = b->infer(checker);
+	if(op == token_kind::_concat)
 	{
-		pipe << OP_0NOTEQUAL;
+		bool is_known = ta.kind == _hex && tb.kind == _hex && ta.width && tb.width;
+		return inferred = {_hex, is_known ? ta.width + tb.width : 0};
 	}
-	else if(op == ">=")
+	if(op == token_kind::_eq || op == token_kind::_ne)
+		return inferred = {_bool};
+	if(size_t size = operand_size(checker.compiler))
 	{
-		pipe << OP_GREATERTHANOREQUAL;
+		if(!big_integer_lowering::is_supported(op))
+			checker.expect_number(ta.is_uint ? ta : tb, op);	// reports it.
+		return inferred = is_comparison(op) ? inferred_type{_bool} : inferred_type{_hex, uint32_t(size), true};
 	}
-	else if(op == ">")
+	checker.expect_number(ta, op);
+	checker.expect_number(tb, op);
+	if(is_comparison(op) || op == token_kind::_and || op == token_kind::_or)
+		return inferred = {_bool};
+	uint32_t wa = ta.number_width(), wb = tb.number_width();
+	uint32_t width = 0;
+	if(wa && wb)
+		width = op == token_kind::_star ? wa + wb : max(wa, wb) + (op == token_kind::_plus || op == token_kind::_minus);
+	return inferred = {_integer, width};
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  unary_op
+//
+///////////////////////////////////////////////////////////////////////////////
+
+unary_op::unary_op(token_kind _op, AST_node_ptr _a)
+	: op(_op), a(_a)
+{
+}
+
+static opcodetype unary_opcode(token_kind op)
+{
+	switch(op)
 	{
-		pipe << OP_GREATERTHAN;
+	case token_kind::_minus: return OP_NEGATE;
+	case token_kind::_not: return OP_NOT;
+	default: return OP_INVALIDOPCODE;
 	}
-	else if(op == "||")   // follows Crypto conventions
+}
+
+// -x on a uintN is 0 - x.
+size_t unary_op::big_size(const class Hello_compiler& compiler) const
+{
+	return op == token_kind::_minus ? a->big_size(compiler) : 0;
+}
+
+bool unary_op::generate(class Hello_compiler& compiler)
+{
+	auto& pipe = compiler.pipe;
+	if(size_t size = a->big_size(compiler))
 	{
-		pipe << OP_CAT;
+		const intrinsic& info = big_operation(compiler, op, size);
+		pipe << valtype(size, 0);
+		bool is_ok = a->generate(compiler);
+		generate_body(pipe, *info.body);
+		return is_ok;
 	}
-	else
+	opcodetype opcode = unary_opcode(op);
+	if(opcode == OP_INVALIDOPCODE)
 	{
 		assert(false);
 		return false;
 	}
-	return true;
+	bool is_ok = a->generate(compiler);
+	pipe << opcode;
+	return is_ok;
+}
+
+void unary_op::lower(class Hello_compiler& compiler)
+{
+	opcodetype opcode = unary_opcode(op);
+	if(opcode == OP_INVALIDOPCODE)
+		throw runtime_error("Unsupported unary operator.");
+	if(size_t size = a->big_size(compiler))
+	{
+		const intrinsic& info = big_operation(compiler, op, size);
+		compiler.ir.push_constant(valtype(size, 0), _hex);
+		a->lower(compiler);
+		compiler.ir.apply(info.opcode, 2, 1, &info);
+		return;
+	}
+	a->lower(compiler);
+	compiler.ir.apply(opcode, 1, 1);
+}
+
+inferred_type unary_op::infer(class type_checker& checker)
+{
+	inferred_type t = a->infer(checker);
+	if(op == token_kind::_minus && t.is_uint)
+		return inferred = t;
+	checker.expect_number(t, op);
+	return inferred = op == token_kind::_not ? inferred_type{_bool} : inferred_type{_integer, t.number_width()};
 }
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -170,25 +529,67 @@ if_then_else::if_then_else(AST_node_ptr _cond, AST_node_ptr _a, AST_node_ptr _b,
 {
 }
 
-bool if_then_else::generate(class Hello_compiler& compiler, istream& f) 
+bool if_then_else::generate(class Hello_compiler& compiler) 
 {
 	auto& pipe = compiler.pipe;
 	compiler.pipe.declare_stmt({streampos1, streampos2});
-	bool is_ok = cond->generate(compiler, f);
+	bool is_ok = cond->generate(compiler);
 	pipe << OP_IF;
 	if(a)
 	{
-		is_ok = is_ok && a->generate(compiler, f);
+		is_ok = is_ok && a->generate(compiler);
 	}
 	if(b)
 	{
 		pipe << OP_ELSE;
-		is_ok = is_ok && b->generate(compiler, f);
+		is_ok = is_ok && b->generate(compiler);
 	}
 	pipe << OP_ENDIF;
 	return is_ok; 
 };
 
+void if_then_else::lower(class Hello_compiler& compiler)
+{
+	auto& ir = compiler.ir;
+	compiler.pipe.declare_stmt({streampos1, streampos2});
+	cond->lower(compiler);
+	switch(ir.begin_if())
+	{
+	case ir_builder::_then_branch:	// the condition is known. Only the branch taken is needed.
+		if(a)
+			a->lower(compiler);
+		return;
+	case ir_builder::_else_branch:
+		if(b)
+			b->lower(compiler);
+		return;
+	default:
+		break;
+	}
+	if(a)
+		a->lower(compiler);
+	ir.begin_else();
+	if(b)
+		b->lower(compiler);
+	ir.end_if();
+}
+
+// Both branches are checked from the types before the if, even if the condition is known.
+inferred_type if_then_else::infer(class type_checker& checker)
+{
+	checker.begin_stmt(streampos1);
+	cond->infer(checker);
+	type_checker::environment before = checker.variables();
+	if(a)
+		a->infer(checker);
+	type_checker::environment after_then = checker.variables();
+	checker.restore(before);
+	if(b)
+		b->infer(checker);
+	checker.merge(after_then);
+	return inferred = {};
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 //
 // for_loop
@@ -205,85 +606,226 @@ for_loop::for_loop(string _loop_variable_name, int _first_val, int _last_val, AS
 {
 }
 
-bool for_loop::generate(class Hello_compiler& compiler, istream& f)
+// The code for an iteration only differs in the value of the loop variable, except that the first one also 
+// declares any variables first assigned in the body. So the second iteration is generated as a template, which
+// the rest are copied from, after pushing their value of the loop variable.
+bool for_loop::generate(class Hello_compiler& compiler)
 {
-	compiler.pipe.declare_stmt({streampos1, streampos2});
+	auto& pipe = compiler.pipe;
+	pipe.declare_stmt({streampos1, streampos2});
 	bool ok = true;
-	if(first_val < last_val)
+	size_t iteration = 0;
+	size_t template_first = 0, template_last = 0;		// the second iteration, less the loop variable push.
+	uint32_t template_first_stmt = 0, template_last_stmt = 0;
+	auto generate_iteration = [&](int i)
 	{
-		for(int i=first_val; i <= last_val; i++)
+		if(iteration >= 2 && template_last > template_first)
 		{
-			compiler.assign_value_to_variable("i", i);
+			pipe << i;
+			pipe.repeat(template_first, template_last, template_first_stmt, template_last_stmt);
+		}
+		else
+		{
+			size_t first = pipe.size();
+			uint32_t first_stmt = uint32_t(compiler.stmts.size());
+			size_t no_of_variables = compiler.symbol_table.size();
+			compiler.assign_value_to_variable(loop_variable_name, i);
 			if(block)
-				ok = ok && block->generate(compiler, f);
+				ok = ok && block->generate(compiler);
+			if(iteration == 1 && ok && compiler.symbol_table.size() == no_of_variables)
+			{
+				template_first = first + 1;
+				template_last = pipe.size();
+				template_first_stmt = first_stmt;
+				template_last_stmt = uint32_t(compiler.stmts.size());
+			}
 		}
+		iteration++;
+	};
+	if(first_val < last_val)
+	{
+		for(int i=first_val; i <= last_val && ok; i++)
+			generate_iteration(i);
 	}
 	else 
 	{
-		for(int i=last_val; i >= first_val; i--)
-		{
-			compiler.assign_value_to_variable("i", i);
-			if(block)
-				ok = ok && block->generate(compiler, f);
-		}
+		for(int i=last_val; i >= first_val && ok; i--)
+			generate_iteration(i);
 	}
 	return ok;
 }
 
+void for_loop::lower(class Hello_compiler& compiler)
+{
+	compiler.pipe.declare_stmt({streampos1, streampos2});
+	auto iteration = [&](int i)
+	{
+		compiler.ir.push_constant(CScriptNum(i).getvch(), _integer);
+		compiler.ir.assign(loop_variable_name);
+		if(block)
+			block->lower(compiler);
+	};
+	if(first_val < last_val)
+	{
+		for(int i=first_val; i <= last_val; i++)
+			iteration(i);
+	}
+	else
+	{
+		for(int i=last_val; i >= first_val; i--)
+			iteration(i);
+	}
+}
+
+// The types at the start of an iteration are those before the loop, joined with those at the end of the previous
+// iteration. A join can only lose information, so that stops changing after a few rounds, and the body is left
+// checked with the types that hold for every iteration.
+inferred_type for_loop::infer(class type_checker& checker)
+{
+	type_checker::environment start = checker.variables();
+	for(;;)
+	{
+		checker.begin_stmt(streampos1);
+		checker.assign(loop_variable_name, {_integer, uint32_t(max({CScriptNum(first_val).getvch().size(),
+			CScriptNum(last_val).getvch().size(), size_t(1)}))});
+		if(block)
+			block->infer(checker);
+		checker.merge(start);
+		if(checker.variables() == start)
+			break;
+		start = checker.variables();
+	}
+	return inferred = {};
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 //
 // sequence
 //
 ///////////////////////////////////////////////////////////////////////////////
 
-sequence::sequence(AST_node_ptr _a, AST_node_ptr _b) 
-	: a(_a), b(_b)
+sequence::sequence(AST_node_ptr* _items, size_t _size) 
+	: items(_items), size(_size)
 {
 }
 
-void sequence::append(AST_node_ptr s) 
-{ 
-	if(!a)
-		a = s;
-	else if(!b)
-		b = s;
-	else
-		b = make_shared<sequence>(b, s);
-}
-
-bool sequence::generate(class Hello_compiler& compiler, istream& f)
+bool sequence::generate(class Hello_compiler& compiler)
 {
 	bool is_ok = true;
-	if(a) is_ok = a->generate(compiler, f);
-	if(b && is_ok) is_ok = b->generate(compiler, f);
+	for(size_t i=0; i<size && is_ok; i++)
+		is_ok = items[i]->generate(compiler);
 	return is_ok;
 };
 
+void sequence::lower(class Hello_compiler& compiler)
+{
+	for(size_t i=0; i<size; i++)
+		items[i]->lower(compiler);
+}
+
+inferred_type sequence::infer(class type_checker& checker)
+{
+	for(size_t i=0; i<size; i++)
+		items[i]->infer(checker);
+	return inferred = {};
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 //
 // native_function
 //
 ///////////////////////////////////////////////////////////////////////////////
 
-native_function::native_function(const string& _function_name, opcodetype _opcode)
-	: function_name(_function_name),
-	  opcode(_opcode)
+native_function::native_function(const intrinsic& _info)
+	: info(_info)
+{
+}
+
+void native_function::declare_stmt(const streampoint& _streampos1, const streampoint& _streampos2)
 {
+	is_stmt = true;
+	streampos1 = _streampos1;
+	streampos2 = _streampos2;
 }
 
-bool native_function::generate(class Hello_compiler& compiler, istream& f)
+bool native_function::generate(class Hello_compiler& compiler)
 {
-	if(opcode == OP_RETURN)
+	auto& pipe = compiler.pipe;
+	if(is_stmt)
+		pipe.declare_stmt({streampos1, streampos2});
+	if(info.opcode == OP_RETURN)
 	{
-		compiler.pipe << OP_RETURN;
-		args->generate(compiler, f);
+		pipe << OP_RETURN;
+		return args->generate(compiler);
 	}
-	else
+	bool ok = args->generate(compiler);
+	if(info.body)
+		generate_body(pipe, *info.body);	// user intrinsic.
+	else if(!is_redundant())
+		pipe << info.opcode;
+	if(info.is_void)
+	{
+		for(int i=0; i<info.no_of_results; i++)
+			pipe << OP_DROP;
+	}
+	return ok;
+}
+
+void native_function::lower(class Hello_compiler& compiler)
+{
+	auto& ir = compiler.ir;
+	if(is_stmt)
+		compiler.pipe.declare_stmt({streampos1, streampos2});
+	args->lower(compiler);
+	if(info.opcode == OP_RETURN)
+		ir.return_data(args->size);
+	else if(info.opcode == OP_DEPTH && !info.body)
+		ir.depth();
+	else if(!is_redundant())
+		ir.apply(info.opcode, args->size, info.no_of_results, &info);
+	if(info.is_void)
+		ir.discard(info.no_of_results);
+}
+
+// Bin2Num of a small number is the number itself, as the numbers the script makes are minimally encoded. It fails on
+// a longer one.
+bool native_function::is_redundant() const
+{
+	return info.opcode == OP_BIN2NUM && !info.body && args->items[0]->inferred.is_small_number();
+}
+
+// The hashes have a known width, as do the numbers depth() and the like give. User intrinsics could leave anything.
+inferred_type native_function::infer(class type_checker& checker)
+{
+	if(is_stmt)
+		checker.begin_stmt(streampos1);
+	vector<value_type> kinds;
+	for(size_t k = 0; k < args->size; k++)
+	{
+		inferred_type t = args->items[k]->infer(checker);
+		if(info.opcode == OP_ABS || info.opcode == OP_MIN || info.opcode == OP_MAX || info.opcode == OP_WITHIN)
+			checker.expect_number(t, info.kind);
+		kinds.push_back(t.kind);
+	}
+	if(info.body || info.is_void)
+		return inferred = {};
+	switch(info.opcode)
+	{
+	case OP_RIPEMD160: case OP_SHA1: case OP_HASH160:
+		return inferred = {_hex, 20};
+	case OP_SHA256: case OP_HASH256:
+		return inferred = {_hex, 32};
+	case OP_CAT:
 	{
-		args->generate(compiler, f);
-		compiler.pipe << opcode;
+		const inferred_type &a = args->items[0]->inferred, &b = args->items[1]->inferred;
+		bool is_known = a.kind == _hex && b.kind == _hex && a.width && b.width;
+		return inferred = {_hex, is_known ? a.width + b.width : 0};
+	}
+	case OP_DEPTH: case OP_SIZE: case OP_BIN2NUM:
+		return inferred = {_integer, 4};	// or the script has failed.
+	default:
+		return inferred = {result_type(info.opcode, info.no_of_results - 1, kinds.data())};
 	}
-	return false;
 }
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -299,13 +841,13 @@ assertion::assertion(AST_node_ptr _cond, const streampoint& _p1, const streampoi
 {
 }
 
-bool assertion::generate(class Hello_compiler& compiler, istream& f)
+bool assertion::generate(class Hello_compiler& compiler)
 {
 	if((compiler.options & ASSERTS_ON) == ASSERTS_ON)
 	{
 		auto& pipe = compiler.pipe;
 		compiler.pipe.declare_stmt({streampos1, streampos2});
-		bool ok = cond->generate(compiler, f);
+		bool ok = cond->generate(compiler);
 		// If the SCRIPT_VERIFY_DISCOUNRAGE_UPGRADABLE_NOPS is set, OP_NOP4 will cause a detectable error.
 		pipe << OP_NOTIF << OP_NOP4 << OP_ENDIF;
 		return ok;
@@ -313,3 +855,46 @@ bool assertion::generate(class Hello_compiler& compiler, istream& f)
 	return true;
 }
 
+void assertion::lower(class Hello_compiler& compiler)
+{
+	if((compiler.options & ASSERTS_ON) == ASSERTS_ON)
+	{
+		compiler.pipe.declare_stmt({streampos1, streampos2});
+		cond->lower(compiler);
+		compiler.ir.assert_true();
+	}
+}
+
+inferred_type assertion::infer(class type_checker& checker)
+{
+	checker.begin_stmt(streampos1);
+	cond->infer(checker);
+	return inferred = {};
+}
+
+import_stmt::import_stmt(string _path, const streampoint& _p1, const streampoint& _p2)
+	: path(_path),
+	  streampos1(_p1),
+	  streampos2(_p2)
+{
+}
+
+bool import_stmt::generate(class Hello_compiler& compiler)
+{
+	compiler.pipe.declare_stmt({streampos1, streampos2});
+	compiler.import_module(path, streampos1);
+	return true;
+}
+
+void import_stmt::lower(class Hello_compiler& compiler)
+{
+	compiler.pipe.declare_stmt({streampos1, streampos2});
+	compiler.import_module(path, streampos1);
+}
+
+// The module's statements are checked as they are compiled, or their types are replayed as it is linked.
+inferred_type import_stmt::infer(class type_checker& checker)
+{
+	checker.begin_stmt(streampos1);
+	return inferred = {};
+}
@@ -10,63 +10,98 @@ using namespace std;  // naughty.
 
 struct unary_op : public AST_node
 {
-	shared_ptr<AST_node> a;
-	unary_op(string op, AST_node_ptr a) {}
-	bool generate(class Hello_compiler& compiler, istream& f) override { return true; };
+	token_kind op;
+	AST_node_ptr a = nullptr;
+	unary_op(token_kind op, AST_node_ptr a);
+	bool generate(class Hello_compiler& compiler) override;
+	void lower(class Hello_compiler& compiler) override;
+	inferred_type infer(class type_checker& checker) override;
+	size_t big_size(const class Hello_compiler& compiler) const override;
 };
 
 struct binary_op : public AST_node
 {
-	string op;
-	shared_ptr<AST_node> a, b;
-	binary_op(string _op, AST_node_ptr _a, AST_node_ptr _b);
-	bool generate(class Hello_compiler& compiler, istream& f) override;
+	token_kind op;
+	AST_node_ptr a, b;
+	binary_op(token_kind _op, AST_node_ptr _a, AST_node_ptr _b);
+	bool generate(class Hello_compiler& compiler) override;
+	void lower(class Hello_compiler& compiler) override;
+	inferred_type infer(class type_checker& checker) override;
+	size_t big_size(const class Hello_compiler& compiler) const override;
+	size_t operand_size(const class Hello_compiler& compiler) const;	// 0 unless an operand is a uintN.
 };
 
 struct assign_op : public AST_node
 {
 	string variable_name;
-	shared_ptr<AST_node> expr;
+	AST_node_ptr expr;
+	size_t declared_size = 0;	// of a uintN declaration.
 	streampoint streampos1, streampos2;
 
 	assign_op(string variable_name, AST_node_ptr v, const streampoint& streampos1, const streampoint& streampos2);
-	bool generate(class Hello_compiler& compiler, istream& f) override;
+	bool generate(class Hello_compiler& compiler) override;
+	void lower(class Hello_compiler& compiler) override;
+	inferred_type infer(class type_checker& checker) override;
 };
 
 struct if_then_else : public AST_node
 {
-	shared_ptr<AST_node> cond, a, b;
+	AST_node_ptr cond, a, b;
 	streampoint streampos1, streampos2;
 
 	if_then_else(AST_node_ptr cond, AST_node_ptr a, AST_node_ptr b, const streampoint& p1, const streampoint& p2);
-	bool generate(class Hello_compiler& compiler, istream& f) override;
+	bool generate(class Hello_compiler& compiler) override;
+	void lower(class Hello_compiler& compiler) override;
+	inferred_type infer(class type_checker& checker) override;
 };
 
 struct for_loop : public AST_node
 {
 	string loop_variable_name;
 	int first_val, last_val; // lower and upper bounds.
-	shared_ptr<AST_node> block;
+	AST_node_ptr block;
 	streampoint streampos1, streampos2;
 
 	for_loop(string _variable_name, int first_val, int last_val, AST_node_ptr block, const streampoint& streampos1, const streampoint& streampos2);
-	bool generate(class Hello_compiler& compiler, istream& f) override;
+	bool generate(class Hello_compiler& compiler) override;
+	void lower(class Hello_compiler& compiler) override;
+	inferred_type infer(class type_checker& checker) override;
 };
 
 struct native_function : public AST_node
 {
-	string function_name; opcodetype opcode;
-	shared_ptr<AST_node> args;
-	native_function(const string& function_name, opcodetype opcode);
-	bool generate(class Hello_compiler& compiler, istream& f) override;
+	const struct intrinsic& info;
+	struct sequence* args = nullptr;
+	bool is_stmt = false;	// void functions are statements in their own right.
+	streampoint streampos1, streampos2;
+	native_function(const struct intrinsic& info);
+	void declare_stmt(const streampoint& streampos1, const streampoint& streampos2);
+	bool generate(class Hello_compiler& compiler) override;
+	void lower(class Hello_compiler& compiler) override;
+	inferred_type infer(class type_checker& checker) override;
+	bool is_redundant() const;	// leaves its arg as it is.
 };
 
 struct assertion : public AST_node
 {
-	shared_ptr<AST_node> cond;
+	AST_node_ptr cond;
 	streampoint streampos1, streampos2;
 	assertion(AST_node_ptr cond, const streampoint& p1, const streampoint& p2);
-	bool generate(class Hello_compiler& compiler, istream& f) override;
+	bool generate(class Hello_compiler& compiler) override;
+	void lower(class Hello_compiler& compiler) override;
+	inferred_type infer(class type_checker& checker) override;
+};
+
+// Links in a module, i.e. the code and variables of another source file, as if its statements were here. See
+// Hello_compiler::import_module().
+struct import_stmt : public AST_node
+{
+	string path;
+	streampoint streampos1, streampos2;
+	import_stmt(string path, const streampoint& p1, const streampoint& p2);
+	bool generate(class Hello_compiler& compiler) override;
+	void lower(class Hello_compiler& compiler) override;
+	inferred_type infer(class type_checker& checker) override;
 };
 
 struct rvalue_node : public AST_node
@@ -74,7 +109,10 @@ struct rvalue_node : public AST_node
 	bool is_extern;
 	string variable_name;
 	rvalue_node(string variable_name, bool is_extern = false);
-	bool generate(class Hello_compiler& compiler, istream& f) override;
+	bool generate(class Hello_compiler& compiler) override;
+	void lower(class Hello_compiler& compiler) override;
+	inferred_type infer(class type_checker& checker) override;
+	size_t big_size(const class Hello_compiler& compiler) const override;
 };
 
 struct const_node : public AST_node  // a bignum constant 
@@ -82,16 +120,24 @@ struct const_node : public AST_node  // a bignum constant
 	string value;
 	value_type type;
 	const_node(string value, value_type type);
-	bool generate(class Hello_compiler& compiler, istream& f) override;
+	bool generate(class Hello_compiler& compiler) override;
+	void lower(class Hello_compiler& compiler) override;
+	inferred_type infer(class type_checker& checker) override;
+	// Converted at compile time. A hex constant is zero extended, or truncated, and an integer is two's complement.
+	bool generate_as(class Hello_compiler& compiler, size_t size) override;
+	void lower_as(class Hello_compiler& compiler, size_t size) override;
+	valtype big_value(size_t size) const;
+	bool is_zero() const override;
 };
 
-// Needed to unroll for loops.
+// A flat list of statements (a block) or of function arguments. The items are held in the arena.
 struct sequence : public AST_node
 {
-	AST_node_ptr a, b;
-	sequence() {}
-	sequence(AST_node_ptr a, AST_node_ptr b);
-	void append(AST_node_ptr s);
-	bool generate(class Hello_compiler& compiler, istream& f) override;
+	AST_node_ptr* items;
+	size_t size;
+	sequence(AST_node_ptr* items, size_t size);
+	bool generate(class Hello_compiler& compiler) override;
+	void lower(class Hello_compiler& compiler) override;
+	inferred_type infer(class type_checker& checker) override;
 };
 
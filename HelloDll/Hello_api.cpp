@@ -0,0 +1,141 @@
+// Copyright (c) Shaun O'Kane, 2010, 2018
+#include "Hello_api.h"
+#include "Hello_compiler.h"
+
+using namespace std;
+
+// Where the code of a statement starts, past the whitespace and comments that its span begins with.
+static streampoint skip_ws(string_view source, streampoint pos, streampoint end)
+{
+	bool in_comment = false;
+	for(; pos < end; pos++)
+	{
+		char ch = source[pos];
+		if(ch == '\n')
+			in_comment = false;
+		else if(ch == '#')
+			in_comment = true;
+		else if(!in_comment && !isspace(ch))
+			break;
+	}
+	return pos;
+}
+
+Hello_context::Hello_context() : compiler(make_unique<Hello_compiler>()) {}
+
+Hello_context::~Hello_context() = default;
+
+const Hello_context::result& Hello_context::compile(string_view source, uint32_t options)
+{
+	compiler->set_options(options & ~(OUTPUT_FORMATS | OUTPUT_STREAMING));
+	last.source_map.clear();
+	tie(last.ok, last.diagnostics) = compiler->compile(source, last.script);
+	if(!last.ok)
+	{
+		last.script.clear();
+		return last;
+	}
+
+	// A span for each run of instructions from the same statement.
+	const instruction_pipeline& pipe = compiler->pipe;
+	line_table lines(source);
+	uint32_t offset = 0;
+	for(size_t k = 0; k < pipe.size(); k++)
+	{
+		uint32_t stmt_id = pipe.generating_stmt(k);
+		uint32_t size = uint32_t(pipe.encoded_size(k));
+		if(stmt_id < compiler->stmts.size())
+		{
+			const stmt& s = compiler->stmts[stmt_id];
+			streampoint start = skip_ws(source, s.start, s.end);
+			auto& map = last.source_map;
+			if(!map.empty() && map.back().script_end == offset && map.back().source_start == start
+				&& map.back().source_end == s.end)
+				map.back().script_end += size;
+			else
+				map.push_back({offset, offset + size, start, s.end, uint32_t(lines.line(start) + 1)});
+		}
+		offset += size;
+	}
+	return last;
+}
+
+void Hello_context::reset()
+{
+	compiler->reset();
+	compiler->incremental.clear();
+	last.ok = false;
+	last.script.clear();
+	last.source_map.clear();
+	last.diagnostics.clear();
+}
+
+void Hello_context::set_source_directory(string_view directory)
+{
+	compiler->set_source_directory(string(directory));
+}
+
+string Hello_context::statistics() const
+{
+	return compiler->statistics();
+}
+
+Hello_context* Hello_create_context(void)
+{
+	try
+	{
+		return new Hello_context();
+	}
+	catch(...)
+	{
+		return nullptr;
+	}
+}
+
+void Hello_destroy_context(Hello_context* context)
+{
+	delete context;
+}
+
+void Hello_reset_context(Hello_context* context)
+{
+	context->reset();
+}
+
+void Hello_set_source_directory(Hello_context* context, const char* directory)
+{
+	context->set_source_directory(directory);
+}
+
+// No exception gets out to a C caller. Running out of memory fails the compilation, with no diagnostics.
+int Hello_compile(Hello_context* context, const char* source, size_t size, uint32_t options)
+{
+	try
+	{
+		return context->compile(string_view(source, size), options).ok;
+	}
+	catch(...)
+	{
+		context->reset();
+		return 0;
+	}
+}
+
+const uint8_t* Hello_script(const Hello_context* context, size_t* size)
+{
+	const CScript& script = context->last_result().script;
+	*size = script.size();
+	return script.data();
+}
+
+const Hello_source_span* Hello_source_map(const Hello_context* context, size_t* no_of_spans)
+{
+	auto& map = context->last_result().source_map;
+	*no_of_spans = map.size();
+	return map.data();
+}
+
+const char* Hello_diagnostics(const Hello_context* context)
+{
+	return context->last_result().diagnostics.c_str();
+}
@@ -2,8 +2,10 @@
 #include "Hello_compiler.h"
 #include <ostream>
 #include <fstream>
+#include <filesystem>
 #include <chrono>
 #include <cstdlib>
+#include <mutex>
 #include "utilstrencodings.h"
 
 using namespace std;
@@ -14,106 +16,290 @@ using namespace std;
 //
 ///////////////////////////////////////////////////////////////////////////////
 
-instruction::instruction(opcodetype _op) 
-	: type(instruction_type::opcode) 
+instruction_pipeline::instruction_pipeline(stmt_table& _stmts, uint32_t& _options)
+	: options(_options),
+	  stmts(_stmts)
 {
-	opcode = _op;
 }
 
-instruction::instruction(const valtype& _v)
-	: type(instruction_type::data) 
+void instruction_pipeline::declare_stmt(const stmt& stmt)
+{
+	stmts.push_back(stmt);
+	current_stmt = uint32_t(stmts.size() - 1);
+}
+
+instruction_pipeline& instruction_pipeline::operator<<(enum opcodetype opcode)
 {
-	new(&v) valtype(_v);
+	assert(!is_push(opcode));
+	push(opcode, 0);
+	return *this;
 }
 
-instruction::instruction(const instruction& instr)
-	: type(instr.type),
-	  generating_stmt(instr.generating_stmt)
+instruction_pipeline& instruction_pipeline::operator<<(const valtype& v)
 {
-	if(type == instruction_type::opcode)
-		opcode = instr.opcode;
+	if(v.empty())
+	{
+		push(OP_0, 0);
+		return *this;
+	}
+	// Encode as CScript does.
+	uint32_t data_ref = uint32_t(pool.size());
+	size_t n = v.size();
+	if(n < OP_PUSHDATA1)
+		pool.push_back(uint8_t(n));
+	else if(n <= 0xff)
+		pool.insert(pool.end(), {OP_PUSHDATA1, uint8_t(n)});
+	else if(n <= 0xffff)
+		pool.insert(pool.end(), {OP_PUSHDATA2, uint8_t(n), uint8_t(n >> 8)});
 	else
-		new(&v) valtype(instr.v);
+		pool.insert(pool.end(), {OP_PUSHDATA4, uint8_t(n), uint8_t(n >> 8), uint8_t(n >> 16), uint8_t(n >> 24)});
+	pool.insert(pool.end(), v.begin(), v.end());
+	push(pool[data_ref], data_ref);
+	return *this;
 }
 
-instruction::~instruction() 
+instruction_pipeline& instruction_pipeline::operator<<(const CScriptNum& v) { return *this << v.getvch(); }
+
+instruction_pipeline& instruction_pipeline::operator<<(int n)
 {
-	if (type == instruction_type::data)
-		v.~valtype();
+	if(n == 0)
+		push(OP_0, 0);
+	else
+		*this << CScriptNum(n).getvch();
+	return *this;
 }
 
-instruction& instruction::operator=(const instruction& instr)
+void instruction_pipeline::placeholder(uint32_t p)
 {
-	type = instr.type;
-	switch(type)
+	placeholders.emplace_back(uint32_t(pool.size()), p);
+	*this << valtype(1, 0);		// not a small int, so the peephole optimiser leaves it alone.
+}
+
+uint32_t instruction_pipeline::placeholder_at(size_t k) const
+{
+	if(placeholders.empty() || !is_data(k))
+		return no_parameter;
+	auto p = lower_bound(placeholders.begin(), placeholders.end(), pair(data_refs[k], uint32_t(0)));
+	return (p != placeholders.end() && p->first == data_refs[k]) ? p->second : no_parameter;
+}
+
+pair<const uint8_t*, size_t> instruction_pipeline::data(size_t k) const
+{
+	assert(is_data(k));
+	const uint8_t* p = &pool[data_refs[k]];
+	switch(*p)
 	{
-	case instruction_type::opcode:
-	case instruction_type::data:
-	break;
+	case OP_PUSHDATA1: return pair(p + 2, size_t(p[1]));
+	case OP_PUSHDATA2: return pair(p + 3, size_t(ReadLE16(p + 1)));
+	case OP_PUSHDATA4: return pair(p + 5, size_t(ReadLE32(p + 1)));
+	default: return pair(p + 1, size_t(*p));
 	}
-	return *this;
 }
 
-inline bool instruction::operator==(enum opcodetype opcode) const
+size_t instruction_pipeline::encoded_size(size_t k) const
 {
-	return type == instruction::instruction_type::opcode && opcode == opcode;
+	if(!is_data(k))
+		return 1;
+	auto [p, n] = data(k);
+	return p + n - &pool[data_refs[k]];
 }
 
-instruction_pipeline::instruction_pipeline(stmt_table& _stmts, uint32_t& _options)
-	: stmts(_stmts),
-	  options(_options)
+void instruction_pipeline::erase_front(size_t n)
 {
+	// Push data is appended in instruction order, so the data of [0, n) is a prefix of pool.
+	size_t k = n;
+	while(k < size() && !is_data(k))
+		k++;
+	uint32_t first_kept = k < size() ? data_refs[k] : uint32_t(pool.size());
+	pool.erase(pool.begin(), pool.begin() + first_kept);
+	for(; k < size(); k++)
+		data_refs[k] -= first_kept;
+	auto p = lower_bound(placeholders.begin(), placeholders.end(), pair(first_kept, uint32_t(0)));
+	placeholders.erase(placeholders.begin(), p);
+	for(auto& placeholder : placeholders)
+		placeholder.first -= first_kept;
+	ops.erase(ops.begin(), ops.begin() + n);
+	stmt_ids.erase(stmt_ids.begin(), stmt_ids.begin() + n);
+	data_refs.erase(data_refs.begin(), data_refs.begin() + n);
 }
 
-void instruction_pipeline::declare_stmt(const stmt& stmt) {	stmts.push_back(stmt); }
+void instruction_pipeline::repeat(size_t first, size_t last, uint32_t first_stmt, uint32_t last_stmt)
+{
+	append(*this, first, last, first_stmt, last_stmt);
+}
 
-instruction_pipeline& instruction_pipeline::operator<<(enum opcodetype opcode)
+void instruction_pipeline::append(const instruction_pipeline& from, size_t first, size_t last, uint32_t first_stmt,
+	uint32_t last_stmt, streampoint shift)
+{
+	assert(first <= last && last <= from.size() && first_stmt <= last_stmt && last_stmt <= from.stmts.size());
+	uint32_t stmt_offset = uint32_t(stmts.size()) - first_stmt;
+	for(uint32_t s = first_stmt; s < last_stmt; s++)
+	{
+		stmt copy = from.stmts[s];
+		stmts.push_back({copy.start + shift, copy.end + shift});
+	}
+
+	// Push data is appended in instruction order, so the data of [first, last) is a run of pool.
+	size_t k = first;
+	while(k < last && !from.is_data(k))
+		k++;
+	size_t data_first = k < last ? from.data_refs[k] : from.pool.size();
+	for(k = last; k < from.size() && !from.is_data(k); k++)
+		;
+	size_t data_last = k < from.size() ? from.data_refs[k] : from.pool.size();
+	if(data_first > data_last)
+		data_last = data_first;		// no data in [first, last).
+	uint32_t data_offset = uint32_t(pool.size() - data_first);
+	size_t n = data_last - data_first;
+	pool.resize(pool.size() + n);
+	copy(from.pool.begin() + data_first, from.pool.begin() + data_first + n, pool.end() - n);
+	size_t p = lower_bound(from.placeholders.begin(), from.placeholders.end(), pair(uint32_t(data_first), uint32_t(0))) - from.placeholders.begin();
+	for(size_t end = from.placeholders.size(); p < end && from.placeholders[p].first < data_last; p++)
+		placeholders.emplace_back(from.placeholders[p].first + data_offset, from.placeholders[p].second);
+
+	size_t at = size(), count = last - first;
+	ops.resize(at + count);
+	stmt_ids.resize(at + count);
+	data_refs.resize(at + count);
+	copy(from.ops.begin() + first, from.ops.begin() + last, ops.begin() + at);
+	for(size_t j = 0; j < count; j++)
+	{
+		uint32_t id = from.stmt_ids[first + j];
+		stmt_ids[at + j] = (id >= first_stmt && id < last_stmt) ? id + stmt_offset : current_stmt;
+		data_refs[at + j] = is_push(ops[at + j]) ? from.data_refs[first + j] + data_offset : 0;
+	}
+	if(last_stmt > first_stmt)
+		current_stmt = uint32_t(stmts.size() - 1);
+}
+
+void instruction_pipeline::append_to(CScript& script, size_t first, size_t last) const
 {
-	uint32_t options = Hello_compiler_options::OPTIMISER_ON;  // temp
-	if((options & Hello_compiler_options::OPTIMISER_ON) == Hello_compiler_options::OPTIMISER_ON)
+	size_t size = script.size();
+	for(size_t k = first; k < last; k++)
+		size += encoded_size(k);
+	size_t pos = script.size();
+	script.resize(size);
+	for(size_t k = first; k < last; k++)
 	{
-		switch(opcode)
+		if(is_data(k))
 		{
-		case OP_TOALTSTACK:
-			if(back() == OP_FROMALTSTACK)
-				pop_back();
-			break;
-		case OP_FROMALTSTACK:
-			if(back() == OP_TOALTSTACK)
-				pop_back();
-			break;
+			size_t n = encoded_size(k);
+			memcpy(&script[pos], &pool[data_refs[k]], n);
+			pos += n;
 		}
+		else
+			script[pos++] = ops[k];
 	}
-	instruction instr(opcode);
-	instr.generating_stmt = stmts.size()-1;
-	push_back(instr);
-	return *this;
 }
 
-instruction_pipeline& instruction_pipeline::operator<<(const valtype& v)
+///////////////////////////////////////////////////////////////////////////////
+//
+//  script_template
+//
+///////////////////////////////////////////////////////////////////////////////
+
+pair<bool, string> script_template::instantiate(const vector<valtype>& values, CScript& result) const
 {
-	instruction instr(v);
-	instr.generating_stmt = stmts.size()-1;
-	push_back(instr);
-	return *this;
+	if(values.size() != parameters.size())
+		return pair(false, "Expected " + to_string(parameters.size()) + " values, got " + to_string(values.size()) + ".");
+	for(size_t k = 0; k < values.size(); k++)
+	{
+		if(parameters[k].size && values[k].size() != parameters[k].size)
+			return pair(false, "$" + parameters[k].name + " must be " + to_string(parameters[k].size) + " bytes.");
+	}
+
+	result.clear();
+	size_t pos = 0;
+	for(auto& slot : slots)
+	{
+		result.insert(result.end(), script.begin() + pos, script.begin() + slot.offset);
+		const valtype& v = values[slot.parameter];
+		if(slot.size)
+			result << v;	// the same size of push as the placeholder.
+		else if(v.empty())
+			result << OP_0;
+		else if(v.size() == 1 && v[0] >= 1 && v[0] <= 16)
+			result << CScript::EncodeOP_N(v[0]);
+		else if(v.size() == 1 && v[0] == 0x81)
+			result << OP_1NEGATE;
+		else
+			result << v;
+		pos = slot.offset + slot.size;
+	}
+	result.insert(result.end(), script.begin() + pos, script.end());
+	return pair(true, "");
 }
 
-instruction_pipeline& instruction_pipeline::operator<<(const CScriptNum& v)
+///////////////////////////////////////////////////////////////////////////////
+//
+//  line_table
+//
+///////////////////////////////////////////////////////////////////////////////
+
+pair<size_t, size_t> line_table::locate(streampoint pos) const
 {
-	instruction instr(v.getvch());
-	instr.generating_stmt = stmts.size()-1;
-	push_back(instr);
-	return *this;
+	if(line_starts.empty())
+	{
+		line_starts.push_back(0);
+		for(size_t k = source.find('\n'); k != string_view::npos; k = source.find('\n', k + 1))
+			line_starts.push_back(streampoint(k + 1));
+	}
+	auto p = upper_bound(line_starts.begin(), line_starts.end(), pos);
+	size_t line = (p - line_starts.begin()) - 1;
+	return pair(line, pos - line_starts[line]);
 }
 
-instruction_pipeline& instruction_pipeline::operator<<(int n)
+///////////////////////////////////////////////////////////////////////////////
+//
+//  arena
+//
+///////////////////////////////////////////////////////////////////////////////
+
+void arena::new_block(size_t size)
 {
-	if(n == 0)
-		push_back(OP_0);
-	else
-		push_back(CScriptNum(n).getvch());
-	back().generating_stmt = stmts.size()-1;
-	return *this;
+	// Reuse blocks left over from before the last reset() where possible.
+	while(current_block < blocks.size())
+	{
+		if(block_sizes[current_block] >= size)
+		{
+			next = blocks[current_block].get();
+			remaining = block_sizes[current_block];
+			return;
+		}
+		current_block++;
+	}
+	size = max(size, min_block_size);
+	blocks.emplace_back(new uint8_t[size]);
+	block_sizes.push_back(size);
+	current_block = blocks.size() - 1;
+	next = blocks.back().get();
+	remaining = size;
+}
+
+void* arena::allocate(size_t size, size_t align)
+{
+	size_t padding = (align - (reinterpret_cast<uintptr_t>(next) % align)) % align;
+	if(next == nullptr || padding + size > remaining)
+	{
+		if(next != nullptr)
+			current_block++;
+		new_block(size + align);
+		padding = (align - (reinterpret_cast<uintptr_t>(next) % align)) % align;
+	}
+	uint8_t* p = next + padding;
+	next += padding + size;
+	remaining -= padding + size;
+	return p;
+}
+
+void arena::reset()
+{
+	for(auto p = destructors.rbegin(); p != destructors.rend(); ++p)
+		p->second(p->first);
+	destructors.clear();
+	current_block = 0;
+	next = nullptr;
+	remaining = 0;
 }
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -156,6 +342,9 @@ void symbol_table::declare_new_variable(class instruction_pipeline& pipe, const
 ///////////////////////////////////////////////////////////////////////////////
 
 Hello_compiler::Hello_compiler()
+	: types(*this),
+	  ir(stmts),
+	  scheduler(pipe, costs)
 {
 }
 
@@ -167,20 +356,7 @@ pair<bool, string> Hello_compiler::execute(string script_txt)
 	if(!result.first)
 		return result;
 	CScript script;
-	for(auto instruction : pipe)
-	{
-		switch(instruction.type)
-		{
-		case instruction::instruction_type::opcode:
-			script << instruction.opcode;
-			break;
-		case instruction::instruction_type::data:
-			script << instruction.v;
-			break;
-		default:
-			assert(false);
-		}
-	}
+	pipe.append_to(script, 0, pipe.size());
 	reset();
 	{
 		const BaseSignatureChecker checker;
@@ -214,9 +390,68 @@ void Hello_compiler::stop()
 bool Hello_compiler::set_options(uint32_t _options)
 {
 	options = _options;
+	modules.use_disk = (options & MODULE_CACHE_ON_DISK) != 0;
+	costs.goal = cost_model::from_options(options);
+	peephole.set_objective(costs);
 	return true; // TODO: test options are supported.
 }
 
+string Hello_compiler::statistics() const
+{
+	string s = peephole.statistics();
+	if(!s.empty())
+		s = "Peephole rules fired:\n" + s;
+	string reused = cse.statistics();
+	if(!reused.empty())
+		s += "Common subexpressions reused:\n" + reused;
+	string dead = dead_code.statistics();
+	if(!dead.empty())
+		s += "Dead code removed (not counting stack moves):\n" + dead;
+	string reuse = incremental.statistics();
+	if(!reuse.empty())
+		s += "Top-level statements (incremental):\n" + reuse;
+	string imported = modules.statistics();
+	if(!imported.empty())
+		s += "Modules imported:\n" + imported;
+	string cost = cost_by_line.statistics();
+	if(!cost.empty())
+		s += "Cost by line:\n" + cost;
+	return s;
+}
+
+void Hello_compiler::reset()
+{
+	executable::reset();
+	types.reset();
+	peephole.reset();
+	ir.reset();
+	cse.reset();
+	dead_code.reset();
+	scheduler.reset();
+	cost_by_line.reset();
+	incremental.reset();
+	modules.reset();
+	importing.clear();
+	imported.clear();
+	template_parameters = declared_externs;
+	big_variables.clear();
+}
+
+void Hello_compiler::declare_big(const string& name, size_t size)
+{
+	if(name == "tos")
+		throw runtime_error("tos can't be declared.");
+	auto p = big_variables.emplace(name, size).first;
+	if(p->second != size)
+		throw runtime_error("'" + name + "' is already declared as uint" + to_string(p->second * 8) + ".");
+}
+
+size_t Hello_compiler::big_size(string_view name) const
+{
+	auto p = big_variables.find(name);
+	return p != big_variables.end() ? p->second : 0;
+}
+
 pair<size_t, bool> Hello_compiler::index_of(const string& variable_name)
 {
 	auto p = symbol_table.find(variable_name);
@@ -291,9 +526,34 @@ void Hello_compiler::copy_to_top_of_stack(const string& variable_name)
 	}
 }
 
-bool Hello_compiler::fill_pipeline(AST_node_ptr ast, istream& f)
+bool Hello_compiler::fill_pipeline(AST_node_ptr ast)
 {
-	return ast->generate(*this, f);
+	types.check(ast);
+	if(options & OPTIMISER_ON)
+	{
+		ast->lower(*this);
+		return true;
+	}
+	return ast->generate(*this);
+}
+
+void Hello_compiler::schedule(bool keep_live_values)
+{
+	ir.fn.analyse();
+	if(cse.run(ir.fn, costs))
+	{
+		ir.rename(cse.replacements);
+		ir.fn.analyse();
+	}
+	vector<ir_value> live_out;
+	if(keep_live_values)
+		live_out = ir.live_values();
+	if(dead_code.run(ir.fn, big_integers, live_out))
+		ir.fn.analyse();
+	auto& slots = scheduler.stack.slots;
+	slots.insert(slots.begin(), ir.stack_inputs.rbegin(), ir.stack_inputs.rend());
+	ir.stack_inputs.clear();
+	scheduler.run(ir.fn, live_out);
 }
 
 valtype Hello_compiler::get_extern_value(const string& name)
@@ -307,109 +567,764 @@ valtype Hello_compiler::get_extern_value(const string& name)
 
 valtype Hello_compiler::get_default_value() { return valtype(); }  // = 0.
 
+void Hello_compiler::declare_extern(const string& name, size_t size)
+{
+	auto p = find_if(declared_externs.begin(), declared_externs.end(), [&](auto& d) { return d.name == name; });
+	if(p != declared_externs.end())
+		p->size = size;
+	else
+		declared_externs.push_back({name, size});
+}
+
+uint32_t Hello_compiler::template_parameter(const string& name)
+{
+	auto p = find_if(template_parameters.begin(), template_parameters.end(), [&](auto& t) { return t.name == name; });
+	if(p == template_parameters.end())
+		p = template_parameters.insert(p, {name, 0});
+	return uint32_t(p - template_parameters.begin());
+}
+
 pair<bool, string> Hello_compiler::compile(istream& f_in, ostream& f_out)
 {
-	stringstream in_stream;
-	in_stream << f_in.rdbuf();   // not sure this works with cin. TODO: Check
+	if((options & OUTPUT_STREAMING) && (options & OUTPUT_FORMATS) && !(options & OPTIMISE_FOR_SIZE))
+		return compile_streaming(f_in, f_out);
+	const string source(istreambuf_iterator<char>(f_in), {});   // the tokeniser works directly over this buffer.
+	return compile(source, f_out);
+}
 
+pair<bool, string> Hello_compiler::compile(string_view source, ostream& f_out)
+{
 	//
 	// Pass 1 - Parse, build AST, fill pipeline.
 	//
-	reset();
-	auto result = compile_internal(in_stream, f_out);
+	auto result = compile_internal(source);
 	if(!result.first)
 		return result;
 
 	//
-	// Pass 2 - Write out annotated script.
+	// Pass 2 - Write out script.
 	//
-	if((options & OUTPUT_ANNOTATED_SCRIPT) == OUTPUT_ANNOTATED_SCRIPT)
+	write_header(f_out);
+	write_script(source, 0, f_out, pipe.size());
+	write_trailer(f_out);
+	return pair(true, "");
+}
+
+pair<bool, string> Hello_compiler::compile(istream& f_in, CScript& script)
+{
+	const string source(istreambuf_iterator<char>(f_in), {});
+	return compile(source, script);
+}
+
+// Serialises the pipeline straight into script, bypassing the text assembly form.
+pair<bool, string> Hello_compiler::compile(string_view source, CScript& script)
+{
+	auto result = compile_internal(source);
+	if(result.first)
 	{
-		in_stream.clear();
-		in_stream.seekg(0, istream::beg);
-		write_annotated_script(in_stream, f_out);
+		script.clear();
+		pipe.append_to(script, 0, pipe.size());
 	}
+	return result;
+}
 
-	return pair(true, "");
+pair<bool, string> Hello_compiler::compile(istream& f_in, script_template& t)
+{
+	const string source(istreambuf_iterator<char>(f_in), {});
+	return compile(source, t);
+}
+
+// As compile(source, script), but each placeholder push becomes a slot, with zeros in place of its value.
+pair<bool, string> Hello_compiler::compile(string_view source, script_template& t)
+{
+	uint32_t saved_options = options;
+	options |= EXTERN_PLACEHOLDERS;
+	auto result = compile_internal(source);
+	options = saved_options;
+	if(!result.first)
+		return result;
+
+	t.script.clear();
+	t.slots.clear();
+	t.parameters = template_parameters;
+	size_t first = 0;
+	for(size_t k = 0; k < pipe.size(); k++)
+	{
+		uint32_t p = pipe.placeholder_at(k);
+		if(p == instruction_pipeline::no_parameter)
+			continue;
+		pipe.append_to(t.script, first, k);
+		size_t offset = t.script.size();
+		if(t.parameters[p].size)
+			t.script << valtype(t.parameters[p].size, 0);
+		t.slots.push_back({offset, t.script.size() - offset, p});
+		first = k + 1;
+	}
+	pipe.append_to(t.script, first, pipe.size());
+	return result;
+}
+
+static size_t script_size(const instruction_pipeline& pipe)
+{
+	size_t n = 0;
+	for(size_t k = 0; k < pipe.size(); k++)
+		n += pipe.encoded_size(k);
+	return n;
 }
 
-pair<bool, string> Hello_compiler::compile_internal(istream& f, ostream& f_out)
+// -Os is never bigger than the script without the optimiser, which keeps its variables on the alt-stack and can
+// beat the stack moves of the optimised code. Whichever is smaller is compiled last, and so is what pipe holds.
+pair<bool, string> Hello_compiler::compile_internal(string_view source)
 {
-	Hello_parser parser(f);
+	if(!(options & OPTIMISE_FOR_SIZE))
+		return compile_once(source);
+	uint32_t saved_options = options;
+	options &= ~(OPTIMISER_ON | INCREMENTAL_COMPILE);
+	auto result = compile_once(source);
+	options = saved_options;
+	size_t unoptimised = result.first ? script_size(pipe) : numeric_limits<size_t>::max();
+	auto optimised = compile_once(source);
+	if(!optimised.first || script_size(pipe) <= unoptimised)
+		return optimised;
+	options &= ~(OPTIMISER_ON | INCREMENTAL_COMPILE);
+	result = compile_once(source);
+	options = saved_options;
+	return result;
+}
+
+pair<bool, string> Hello_compiler::compile_once(string_view source)
+{
+	if(source.size() > numeric_limits<streampoint>::max())
+		return pair(false, "Source is too large. The limit is 4GB.");
+
+	reset();
+	Hello_parser parser(source, ast_arena, intrinsics);
 	bool ok = true;
 	stringstream err_msg;
-	parser.ws();
-	while(!parser.eof() && ok)
+	try
+	{
+		if((options & INCREMENTAL_COMPILE) && !(options & OPTIMISER_ON))
+			ok = fill_pipeline_incrementally(source, parser);
+		else
+		{
+			parser.ws();
+			while(!parser.eof() && ok)
+				ok = fill_pipeline(parser.eat_statement());
+		}
+		if(ok && (options & OPTIMISER_ON))
+		{
+			ir.finish();
+			schedule();
+			dead_code.locate(stmts, line_table(source));
+		}
+	}
+	catch(type_error& err)
 	{
 		ok = false;
-		try
+		err_msg << "Type error. " << err.what() << " at line: " << line_table(source).line(err.pos)+1 << "\n";
+	}
+	catch(parse_error& err)
+	{
+		ok = false;
+		err_msg << "Parsing error. " << err.what() << " at line: " << line_table(source).line(err.pos)+1 << "\n";
+	}
+	catch(runtime_error& e)
+	{
+		ok = false;
+		err_msg << "Compile error. " << e.what() << "\n";
+	}
+	if(ok && (options & OPTIMISER_ON))
+		peephole.run(pipe);
+	if(ok)
+		cost_by_line.add(pipe, pipe.size(), stmts, line_table(source));
+	return pair(ok, err_msg.str());
+}
+
+// As the loop in compile_internal(), a top-level statement at a time. A statement whose code is in the cache has it
+// appended, and the rest are generated and added. One that reads an $extern from the environment is always
+// generated, as the value can change from one compilation to the next.
+bool Hello_compiler::fill_pipeline_incrementally(string_view source, Hello_parser& parser)
+{
+	statement_reader reader(source);
+	incremental.begin();
+	uint64_t state = state_hash();
+	bool ok = true;
+	while(ok && reader.next())
+	{
+		string_view text = reader.text();
+		streampoint offset = reader.offset();
+		if(auto cached = incremental.find(text, state))
+		{
+			replay(*cached, offset);
+			state = cached->state_after;
+			continue;
+		}
+
+		uint32_t first_stmt = uint32_t(stmts.size());
+		size_t first = pipe.size(), imported = modules_imported;
+		state_mark before = mark_state();
+		ast_arena.reset();
+		parser.reset(source.substr(offset, text.size()), offset);
+		parser.ws();
+		while(ok && !parser.eof())
+			ok = fill_pipeline(parser.eat_statement());
+		uint64_t state_before = state;
+		state = state_hash();
+		// An import is linked again each time, as the module can change without the statement changing.
+		if(ok && ((options & EXTERN_PLACEHOLDERS) || text.find('$') == string_view::npos) && imported == modules_imported)
+		{
+			auto& e = incremental.add(text, state_before);
+			e.state_after = state;
+			e.code.append(pipe, first, pipe.size(), first_stmt, uint32_t(stmts.size()), streampoint(0) - offset);
+			record_changes(before, e);
+		}
+	}
+	if(ok)
+		incremental.end();	// after an error, the statements that weren't reached are kept for the next time.
+	return ok;
+}
+
+// Has the same effect as generating the statement cached did, starting at offset in the source.
+void Hello_compiler::replay(const statement_cache::entry& cached, streampoint offset)
+{
+	pipe.append(cached.code, 0, cached.code.size(), 0, uint32_t(cached.stmts.size()), offset);
+	apply(cached);
+}
+
+Hello_compiler::state_mark Hello_compiler::mark_state() const
+{
+	return {symbol_table.size(), template_parameters.size(), types.variables(), big_variables};
+}
+
+void Hello_compiler::record_changes(const state_mark& before, state_delta& delta) const
+{
+	for(size_t k = before.no_of_variables; k < symbol_table.size(); k++)
+		delta.variables.push_back(symbol_table.at(k));
+	for(auto& [name, type] : types.variables())
+	{
+		auto p = before.types.find(name);
+		if(p == before.types.end() || p->second != type)
+			delta.types.emplace_back(name, type);
+	}
+	for(auto& [name, size] : big_variables)
+		if(before.big_variables.count(name) == 0)
+			delta.big_variables.emplace_back(name, size);
+	delta.template_parameters.assign(template_parameters.begin() + before.no_of_parameters, template_parameters.end());
+}
+
+void Hello_compiler::apply(const state_delta& delta)
+{
+	for(auto& name : delta.variables)
+		symbol_table.insert(name);
+	for(auto& [name, type] : delta.types)
+		types.assign(name, type);
+	for(auto& [name, size] : delta.big_variables)
+		big_variables.emplace(name, size);
+	template_parameters.insert(template_parameters.end(), delta.template_parameters.begin(),
+		delta.template_parameters.end());
+}
+
+uint64_t Hello_compiler::state_hash() const
+{
+	stringstream s;
+	s << (options & ~(OUTPUT_FORMATS | OUTPUT_STREAMING)) << ' ' << intrinsics.version() << '\n';	// not the code.
+	for(size_t k = 0; k < symbol_table.size(); k++)
+		s << symbol_table.at(k) << '\n';
+	for(auto& [name, type] : types.variables())
+		s << name << ' ' << type.kind << ' ' << type.width << ' ' << type.is_uint << '\n';
+	for(auto& [name, size] : big_variables)
+		s << name << ' ' << size << '\n';
+	for(auto& p : template_parameters)
+		s << '$' << p.name << ' ' << p.size << '\n';
+	return statement_cache::hash(s.str());
+}
+
+void Hello_compiler::set_source_directory(const string& directory)
+{
+	source_directory = directory;
+}
+
+// An error in a module, which is reported at its import.
+static string in_module(const string& path, string_view text, const parse_error& err)
+{
+	return err.what() + string(" at line: ") + to_string(line_table(text).line(err.pos) + 1) + " of '" + path +
+		"', imported";
+}
+
+// A module is compiled as if its statements were in place of the import, and all of its code is attributed to the
+// import. Like a statement, the code depends on the state before it, so that is part of the key it is cached by.
+// With OPTIMISER_ON, so do the values it reads, which are checked when it is linked. Imports at the start of a
+// source have the same state in every source that has the same imports before them, which is what makes a library
+// cheap to import. A module that reads an $extern from the environment, or any
+// module while there are user intrinsics, which the files on disk can't see, is compiled every time.
+void Hello_compiler::import_module(const string& path, streampoint pos)
+{
+	filesystem::path base = importing.empty() ? filesystem::path(source_directory)
+		: filesystem::path(importing.back()).parent_path();
+	string name = (base / path).lexically_normal().string();
+	if(find(importing.begin(), importing.end(), name) != importing.end())
+		throw parse_error("'" + path + "' imports itself.", pos);
+	string text;
+	if(!read_module(name, text))
+		throw parse_error("Unable to read module '" + path + "'.", pos);
+	modules_imported++;
+
+	uint64_t state = state_hash();
+	bool cacheable = intrinsics.version() == 0 && ((options & EXTERN_PLACEHOLDERS) || text.find('$') == string::npos);
+	if(cacheable)
+	{
+		auto cached = modules.find(name, text, state);
+		if(cached && is_current(*cached) && link_module(*cached))
+		{
+			modules.count_linked();
+			imported.insert(imported.end(), cached->imports.begin(), cached->imports.end());
+			imported.emplace_back(name, statement_cache::hash(cached->text));
+			return;
+		}
+	}
+
+	compiled_module module;
+	module.text = move(text);
+	module.state = state;
+	size_t first_import = imported.size();
+	size_t no_of_stack_inputs = ir.stack_inputs.size();
+	bool is_linkable = false;
+	importing.push_back(name);
+	try
+	{
+		is_linkable = compile_module(path, module);
+	}
+	catch(type_error& err)
+	{
+		importing.pop_back();
+		throw type_error(in_module(path, module.text, err), pos);
+	}
+	catch(parse_error& err)
+	{
+		importing.pop_back();
+		throw parse_error(in_module(path, module.text, err), pos);
+	}
+	catch(...)
+	{
+		importing.pop_back();
+		throw;
+	}
+	importing.pop_back();
+	module.imports.assign(imported.begin() + first_import, imported.end());
+	imported.emplace_back(name, statement_cache::hash(module.text));
+	modules.count_compiled();
+	// One that reads below the stack can't be linked.
+	if(cacheable && is_linkable && ir.stack_inputs.size() == no_of_stack_inputs)
+		modules.add(name, move(module));
+}
+
+bool Hello_compiler::read_module(const string& name, string& text)
+{
+	ifstream f(name, ios::in | ios::binary);
+	if(!f.is_open())
+		return false;
+	text.assign(istreambuf_iterator<char>(f), {});
+	return true;
+}
+
+// Whether the modules that module imports are as they were when it was compiled.
+bool Hello_compiler::is_current(const compiled_module& module)
+{
+	string text;
+	for(auto& [name, hash] : module.imports)
+		if(!read_module(name, text) || statement_cache::hash(text) != hash)
+			return false;
+	return true;
+}
+
+// Compiles the module's statements after the import's, then records what they added. Returns false if its IR can't
+// be linked anywhere else.
+bool Hello_compiler::compile_module(const string& path, compiled_module& module)
+{
+	uint32_t import_stmt = uint32_t(stmts.size() - 1);
+	size_t first = pipe.size();
+	state_mark before = mark_state();
+	map<string, ir_value, less<>> ir_variables_before = ir.variables;
+	vector<ir_value> vstack_before = ir.vstack;
+	bool was_recording = ir.record_reads;
+	size_t first_read = ir.variables_read.size();
+	ir.record_reads = true;
+	module.first_instr = uint32_t(ir.fn.instrs.size());
+	module.first_value = uint32_t(ir.fn.values.size());
+	module.first_operand = uint32_t(ir.fn.operands.size());
+	module.first_constant = uint32_t(ir.fn.constants.size());
+
+	Hello_parser parser(module.text, ast_arena, intrinsics);
+	parser.ws();
+	while(!parser.eof())
+		if(!fill_pipeline(parser.eat_statement()))
+			throw runtime_error("Unable to generate the code of '" + path + "'.");
+	ir.record_reads = was_recording;
+	module.reads.assign(ir.variables_read.begin() + first_read, ir.variables_read.end());
+	sort(module.reads.begin(), module.reads.end());
+	module.reads.erase(unique(module.reads.begin(), module.reads.end()), module.reads.end());
+	if(!was_recording)
+		ir.variables_read.clear();	// the enclosing module's reads include this one's.
+
+	// The module's statements are in another source, so their code is the import's.
+	pipe.attribute(first, pipe.size(), import_stmt);
+	pipe.set_stmt(import_stmt);
+	for(size_t k = module.first_instr; k < ir.fn.instrs.size(); k++)
+		ir.fn.instrs[k].stmt = import_stmt;
+	stmts.resize(import_stmt + 1);
+
+	record_changes(before, module);
+	if(!(options & OPTIMISER_ON))
+	{
+		pipe.append_to(module.code, first, pipe.size());
+		for(size_t k = first; k < pipe.size(); k++)
 		{
-			auto ast = parser.eat_statement();
-			ok = fill_pipeline(ast, f);
-			if(!ok)
-				break;
+			uint32_t p = pipe.placeholder_at(k);
+			if(p != instruction_pipeline::no_parameter)
+				module.placeholders.emplace_back(uint32_t(k - first), p);
 		}
-		catch(parse_error& err)
+		return true;
+	}
+
+	const ir_function& fn = ir.fn;
+	module.instrs.assign(fn.instrs.begin() + module.first_instr, fn.instrs.end());
+	for(auto& instr : module.instrs)
+	{
+		compiled_module::intrinsic_ref ref;
+		if(instr.info && instr.info->kind != token_kind::_none)
+			ref.kind = instr.info->kind;
+		else if(instr.info)
 		{
-			err_msg << "Parsing error. " << err.what() << " at line: " << get<1>(err.pos)+1 << "\n";
+			auto [op, size] = big_integers.operation_of(*instr.info);
+			assert(op != token_kind::_none);	// user intrinsics aren't cached.
+			ref.big_op = op;
+			ref.big_size = uint32_t(size);
 		}
-		catch(runtime_error& e)
+		module.infos.push_back(ref);
+		instr.info = nullptr;
+	}
+	module.values.assign(fn.values.begin() + module.first_value, fn.values.end());
+	module.operands.assign(fn.operands.begin() + module.first_operand, fn.operands.end());
+	module.constants.assign(fn.constants.begin() + module.first_constant, fn.constants.end());
+	for(auto& [name, v] : ir.variables)
+	{
+		auto p = ir_variables_before.find(name);
+		if(p == ir_variables_before.end() || p->second != v)
+			module.ir_variables.emplace_back(name, v);
+	}
+	module.vstack = ir.vstack;
+
+	// Where it found each value from before it that its IR refers to. It could only have got them from the variables
+	// it read and from vstack.
+	module.reads_hash = module_reads_hash(module.reads, ir_variables_before, vstack_before);
+	auto add_input = [&](ir_value v)
+	{
+		if(v >= module.first_value || any_of(module.inputs.begin(), module.inputs.end(), [&](auto& i) { return i.value == v; }))
+			return true;
+		for(auto& name : module.reads)
 		{
-			err_msg << "Compile error. " << e.what() << "\n";
+			auto p = ir_variables_before.find(name);
+			if(p != ir_variables_before.end() && p->second == v)
+			{
+				module.inputs.push_back({v, name, 0});
+				return true;
+			}
 		}
+		auto p = find(vstack_before.begin(), vstack_before.end(), v);
+		if(p == vstack_before.end())
+			return false;
+		module.inputs.push_back({v, string(), uint32_t(p - vstack_before.begin())});
+		return true;
+	};
+	bool is_linkable = true;
+	for(auto v : module.operands)
+		is_linkable = add_input(v) && is_linkable;
+	for(auto& [name, v] : module.ir_variables)
+		is_linkable = add_input(v) && is_linkable;
+	for(auto v : module.vstack)
+		is_linkable = add_input(v) && is_linkable;
+	return is_linkable;
+}
+
+// Has the same effect as compile_module() had, after the import. False if the values it reads aren't as they were
+// when it was compiled, or if it refers to a template parameter that there won't be. The rest of its indices were
+// checked when it was read. See compiled_module::is_well_formed().
+bool Hello_compiler::link_module(const compiled_module& module)
+{
+	size_t no_of_parameters = template_parameters.size() + module.template_parameters.size();
+	for(auto [k, p] : module.placeholders)
+		if(p >= no_of_parameters)
+			return false;
+	for(auto& instr : module.instrs)
+		if(instr.op == ir_instr::_extern && instr.data >= no_of_parameters)
+			return false;
+
+	if(!(options & OPTIMISER_ON))
+	{
+		apply(module);
+		auto placeholder = module.placeholders.begin();
+		opcodetype op;
+		valtype data;
+		size_t k = 0;
+		for(auto p = module.code.begin(); module.code.GetOp(p, op, data); k++)
+		{
+			if(placeholder != module.placeholders.end() && placeholder->first == k)
+				pipe.placeholder((placeholder++)->second);
+			else if(op <= OP_PUSHDATA4)
+				pipe << data;
+			else
+				pipe << op;
+		}
+		return true;
+	}
+
+	if(module_reads_hash(module.reads, ir.variables, ir.vstack) != module.reads_hash)
+		return false;
+	map<ir_value, ir_value> inputs;	// where each is now.
+	for(auto& input : module.inputs)
+	{
+		auto p = ir.variables.find(input.variable);
+		if(input.variable.empty() ? input.stack_index >= ir.vstack.size() : p == ir.variables.end())
+			return false;
+		inputs[input.value] = input.variable.empty() ? ir.vstack[input.stack_index] : p->second;
 	}
+
+	// The module's own instructions, values, operands and constants follow those so far.
+	ir_function& fn = ir.fn;
+	uint32_t first_instr = uint32_t(fn.instrs.size()), first_value = uint32_t(fn.values.size());
+	uint32_t first_operand = uint32_t(fn.operands.size()), first_constant = uint32_t(fn.constants.size());
+	auto relocate = [&](ir_value v) { return v < module.first_value ? inputs.at(v) : v - module.first_value + first_value; };
+	apply(module);
+	if(ir.record_reads)
+		ir.variables_read.insert(ir.variables_read.end(), module.reads.begin(), module.reads.end());
+	uint32_t import_stmt = uint32_t(stmts.size() - 1);
+	for(size_t k = 0; k < module.instrs.size(); k++)
+	{
+		ir_instr instr = module.instrs[k];
+		instr.stmt = import_stmt;
+		instr.first_operand = instr.first_operand - module.first_operand + first_operand;
+		if(instr.no_of_results)
+			instr.result = relocate(instr.result);
+		if(instr.op == ir_instr::_const)
+			instr.data = instr.data - module.first_constant + first_constant;
+		auto& ref = module.infos[k];
+		if(ref.kind != token_kind::_none)
+			instr.info = builtin_intrinsic(ref.kind);
+		else if(ref.big_op != token_kind::_none)
+			instr.info = &big_integers.operation(ref.big_op, ref.big_size, costs);
+		fn.instrs.push_back(instr);
+	}
+	for(auto v : module.values)
+	{
+		v.def = v.def - module.first_instr + first_instr;
+		fn.values.push_back(v);
+	}
+	for(auto v : module.operands)
+		fn.operands.push_back(relocate(v));
+	fn.constants.insert(fn.constants.end(), module.constants.begin(), module.constants.end());
+	for(auto& [name, v] : module.ir_variables)
+		ir.variables[name] = relocate(v);
+	ir.vstack.clear();
+	for(auto v : module.vstack)
+		ir.vstack.push_back(relocate(v));
+	return true;
+}
+
+// What the IR of a module that read the variables in reads depends on, besides the state. See
+// compiled_module::reads.
+uint64_t Hello_compiler::module_reads_hash(const vector<string>& reads, const map<string, ir_value, less<>>& variables,
+	const vector<ir_value>& vstack) const
+{
+	const ir_function& fn = ir.fn;
+	vector<ir_value> seen;
+	stringstream s;
+	auto describe = [&](ir_value v)
+	{
+		size_t k = find(seen.begin(), seen.end(), v) - seen.begin();
+		if(k == seen.size())
+			seen.push_back(v);
+		if(fn.is_constant(v))
+			s << "= " << HexStr(fn.constant(v)) << ' ' << fn.values[v].type << '\n';
+		else
+			s << fn.values[v].type << ' ' << k << '\n';
+	};
+	for(auto& name : reads)
+	{
+		s << name << ' ';
+		auto p = variables.find(name);
+		if(p == variables.end())
+			s << "-\n";
+		else
+			describe(p->second);
+	}
+	s << vstack.size() << '\n';
+	for(auto v : vstack)
+		describe(v);
+	return statement_cache::hash(s.str());
+}
+
+// With OPTIMISER_ON, the no. of IR instructions lowered before they are scheduled.
+static constexpr size_t streaming_ir_window = 4096;
+
+// Parses, generates and writes out one top-level statement at a time. Only the source text and instructions that
+// are not yet final, i.e. that the optimiser could still rewrite, are held in memory.
+pair<bool, string> Hello_compiler::compile_streaming(istream& f_in, ostream& f_out)
+{
+	reset();
+	statement_reader reader(f_in);
+	Hello_parser parser(string_view(), ast_arena, intrinsics);
+	bool ok = true;
+	stringstream err_msg;
+	write_header(f_out);
+	size_t optimised = 0;	// pipe[0, optimised) has been through the optimiser.
+	try
+	{
+		while(ok && reader.next())
+		{
+			ast_arena.reset();
+			parser.reset(reader.text(), reader.offset());
+			parser.ws();
+			while(ok && !parser.eof())
+				ok = fill_pipeline(parser.eat_statement());
+
+			size_t n = pipe.size();
+			if(ok && (options & OPTIMISER_ON))
+			{
+				// The IR is scheduled a window of statements at a time, so that the dead code pass can see most
+				// stores overwritten. Values still live at the end of the window stay on the stack, and are inputs
+				// to the next one.
+				if(ir.fn.instrs.size() >= streaming_ir_window)
+				{
+					schedule(true);
+					dead_code.locate(stmts, reader);
+					ir.next_chunk(scheduler.stack.slots);
+					peephole.run(pipe, optimised);
+				}
+				n = peephole.final_prefix(pipe);
+			}
+			cost_by_line.add(pipe, n, stmts, reader);
+			write_script(reader.window(), reader.window_offset(), f_out, n);
+			pipe.erase_front(n);
+			optimised = pipe.size();
+			// Keep the text of any statement that has not been written out yet, or is still in the IR.
+			streampoint keep = reader.offset();
+			if(!pipe.empty())
+				keep = stmts[pipe.generating_stmt(0)].start;
+			else if(ir.first_stmt < stmts.size())
+				keep = stmts[ir.first_stmt].start;
+			reader.release(keep);
+		}
+	}
+	catch(type_error& err)
+	{
+		ok = false;
+		err_msg << "Type error. " << err.what() << " at line: " << reader.line(err.pos)+1 << "\n";
+	}
+	catch(parse_error& err)
+	{
+		ok = false;
+		err_msg << "Parsing error. " << err.what() << " at line: " << reader.line(err.pos)+1 << "\n";
+	}
+	catch(runtime_error& e)
+	{
+		ok = false;
+		err_msg << "Compile error. " << e.what() << "\n";
+	}
+	if(ok)
+	{
+		if(options & OPTIMISER_ON)
+		{
+			ir.finish();
+			schedule();
+			dead_code.locate(stmts, reader);
+			peephole.run(pipe, optimised);
+		}
+		cost_by_line.add(pipe, pipe.size(), stmts, reader);
+		write_script(reader.window(), reader.window_offset(), f_out, pipe.size());
+		write_trailer(f_out);
+	}
+	pipe.clear();
 	return pair(ok, err_msg.str());
 }
 
-void Hello_compiler::write_annotated_script(istream& f, ostream& f_out)
+void Hello_compiler::write_header(ostream& f_out)
 {
 	using namespace chrono;
 
-	time_t t = system_clock::to_time_t(system_clock::now());
-	f_out << "### Autogenerated Hello script. Created @ " << ctime(&t);
+	annotated_stmts = 0;
+	if(options & OUTPUT_ANNOTATED_SCRIPT)
+	{
+		static mutex ctime_mutex;	// ctime() formats into a static buffer, and compilers can run on several threads.
+		time_t t = system_clock::to_time_t(system_clock::now());
+		lock_guard<mutex> lock(ctime_mutex);
+		f_out << "### Autogenerated Hello script. Created @ " << ctime(&t);
+	}
+}
+
+// Writes out pipe[0, n) in the first output format selected. Called once per chunk when streaming.
+void Hello_compiler::write_script(string_view source, streampoint source_offset, ostream& f_out, size_t n)
+{
+	if(options & OUTPUT_ANNOTATED_SCRIPT)
+		write_annotated_script(source, source_offset, f_out, n);
+	else if(options & (OUTPUT_BINARY_SCRIPT | OUTPUT_HEX_SCRIPT))
+	{
+		script_buf.clear();
+		pipe.append_to(script_buf, 0, n);
+		if(options & OUTPUT_BINARY_SCRIPT)
+			f_out.write(reinterpret_cast<const char*>(script_buf.data()), script_buf.size());
+		else
+			f_out << HexStr(script_buf.begin(), script_buf.end());
+	}
+}
+
+void Hello_compiler::write_trailer(ostream& f_out)
+{
+	if((options & OUTPUT_FORMATS) == OUTPUT_HEX_SCRIPT)
+		f_out << "\n";
+}
 
-	set<size_t> processed_stmts;
-	for(size_t k=0; k<pipe.size(); k++)
+// Writes out pipe[0, n) in a single pass. Each statement is written out before its first instruction. 
+// Statements are declared in order, so an instruction's statement has already been written out if it is 
+// below annotated_stmts. source holds the source text from offset source_offset.
+void Hello_compiler::write_annotated_script(string_view source, streampoint source_offset, ostream& f_out, size_t n)
+{
+	for(size_t k=0; k<n; k++)
 	{
-		auto& instr = pipe[k];
-		stmt& stmt = stmts[instr.generating_stmt];
-		if(processed_stmts.find(instr.generating_stmt) == processed_stmts.end())  // only write out once.
+		uint32_t generating_stmt = pipe.generating_stmt(k);
+		if(generating_stmt >= annotated_stmts && generating_stmt < stmts.size())  // only write out once.
 		{
-			write_annotation(f, f_out, stmt);
-			processed_stmts.insert(instr.generating_stmt);
+			write_annotation(source, source_offset, f_out, stmts[generating_stmt]);
+			annotated_stmts = generating_stmt + 1;
 		}
 
-		if(instr.type == instruction::instruction_type::opcode)
+		if(pipe.is_data(k))
 		{
-			if(instr.opcode == OP_0)
-				f_out << "L1 0x00\n";
-			else
-				f_out << GetOpName(instr.opcode) << "\n";
+			auto [p, size] = pipe.data(k);
+			f_out << "L" << size << " 0x" << HexStr(p, p + size) << "\n";
 		}
+		else if(pipe.opcode(k) == OP_0)
+			f_out << "L1 0x00\n";
 		else
-			f_out << "L" << instr.v.size() << " 0x" << HexStr(instr.v) << "\n";
+			f_out << GetOpName(pipe.opcode(k)) << "\n";
 	}
 }
 
-void Hello_compiler::write_annotation(istream& f, ostream& f_out, const stmt& stmt) const 
+void Hello_compiler::write_annotation(string_view source, streampoint source_offset, ostream& f_out, const stmt& stmt) const 
 {
-	streampos origpos = f.tellg();  // push pos.
-	streampos pos = get<0>(stmt.start); 
-	streampos last = get<0>(stmt.end); 
-	assert(pos < last);
-	f.seekg(pos);
+	assert(source_offset <= stmt.start);
+	size_t pos = stmt.start - source_offset; 
+	size_t last = stmt.end - source_offset; 
+	assert(pos < last && last <= source.size());
 	f_out << "\n### ";
 	while(pos != last)
 	{
-		assert(!f.eof() && f.good());
-		char ch = f.get();
-		pos = f.tellg();		
-
-		f_out << ch;
-		if(ch == '\n')
+		// Write a line at a time rather than a char at a time.
+		size_t eol = source.find('\n', pos);
+		size_t n = (eol == string_view::npos || eol >= last) ? last - pos : eol + 1 - pos;
+		f_out.write(source.data() + pos, n);
+		pos += n;
+		if(source[pos-1] == '\n')
 			f_out << "### ";
 	}
 	f_out << "\n";
-	f.seekg(origpos);  // pop pos.
 }
-
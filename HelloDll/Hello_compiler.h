@@ -3,7 +3,16 @@
 
 #include "tokeniser.h"
 #include "parser.h"
-#include <map>
+#include "peephole.h"
+#include "type_checker.h"
+#include "ir.h"
+#include "big_integer.h"
+#include "cse.h"
+#include "dead_code.h"
+#include "stack_scheduler.h"
+#include "cost_model.h"
+#include "statement_cache.h"
+#include "module_cache.h"
 
 using namespace std;
 
@@ -13,16 +22,51 @@ public:
 	Hello_compiler();
 
 	pair<bool, string> compile(istream& in_filename, ostream& out_filename) override;
+	pair<bool, string> compile(string_view source, ostream& out_filename);
+	pair<bool, string> compile(istream& in, CScript& script) override;
+	pair<bool, string> compile(string_view source, CScript& script);
+	pair<bool, string> compile(istream& in, script_template& t) override;
+	pair<bool, string> compile(string_view source, script_template& t);
+	void declare_extern(const string& name, size_t size) override;
+	void set_source_directory(const string& directory) override;
 	pair<bool, string> execute(std::string script_txt) override;
 	pair<bool, string> go() override;
 	pair<bool, string> step_over() override;
 	pair<bool, string> step_into() override;
 	void stop() override;
 	bool set_options(uint32_t options) override;
+	string statistics() const override;
+	void reset() override;
+
+	// Builtin native functions plus any registered by the user.
+	intrinsic_registry intrinsics;
+
+	// What the optimiser minimises, from the options.
+	cost_model costs;
+	// Run on each statement before it is generated.
+	type_checker types;
+	peephole_optimiser peephole;
+	// With OPTIMISER_ON the AST is lowered to SSA form, then scheduled onto the main stack.
+	ir_builder ir;
+	common_subexpression_eliminator cse;
+	dead_code_eliminator dead_code;
+	stack_scheduler scheduler;
+	big_integer_lowering big_integers;
+	cost_report cost_by_line;	// of the script written out.
+	// INCREMENTAL_COMPILE. Kept from one compilation to the next.
+	statement_cache incremental;
+	// Imported modules. Kept from one compilation to the next, and with MODULE_CACHE_ON_DISK, on disk.
+	module_cache modules;
+
+	// uintN variables. A variable keeps the size it was declared with.
+	void declare_big(const string& name, size_t size);
+	size_t big_size(string_view name) const;	// 0 if name isn't a uintN.
 
 	// These are used to get the value of $<variable-name> 
 	virtual valtype get_extern_value(const string& name);
 	virtual valtype get_default_value();
+	// With EXTERN_PLACEHOLDERS, the template parameter for $name. Added the first time it's used.
+	uint32_t template_parameter(const string& name);
 
 	pair<size_t, bool> index_of(const string& variable_name);
 	void copy_to_top_of_stack(const string& variable_name);
@@ -30,8 +74,51 @@ public:
 	void assign_value_to_variable(const string& variable_name, int i);
 	void assign_value_to_variable(const string& variable_name, const valtype& value);
 
-	pair<bool, string> compile_internal(std::istream& f, ostream& f_out);
-	bool fill_pipeline(AST_node_ptr ast, istream& f);
-	void write_annotated_script(istream& f, ostream& f_out);
-	void write_annotation(istream& f, ostream& f_out, const stmt& stmt) const;
+	// import "path", where the import statement starts at pos. The module is linked in from the cache, or compiled
+	// here and added to it.
+	void import_module(const string& path, streampoint pos);
+
+	pair<bool, string> compile_internal(string_view source);
+	pair<bool, string> compile_once(string_view source);	// with the options as they are.
+	bool fill_pipeline_incrementally(string_view source, Hello_parser& parser);
+	void replay(const statement_cache::entry& cached, streampoint offset);
+	uint64_t state_hash() const;	// of what the code generated for a statement depends on, besides its text.
+	// The state before some code, from which record_changes() works out what the code added to it.
+	struct state_mark
+	{
+		size_t no_of_variables, no_of_parameters;
+		type_checker::environment types;
+		map<string, size_t, less<>> big_variables;
+	};
+	state_mark mark_state() const;
+	void record_changes(const state_mark& before, state_delta& delta) const;
+	void apply(const state_delta& delta);
+	pair<bool, string> compile_streaming(istream& f_in, ostream& f_out);
+	bool fill_pipeline(AST_node_ptr ast);
+	// OPTIMISER_ON. Optimises the IR so far and generates its code. keep_live_values leaves the variables and the
+	// values the source can see on the stack, for the next chunk.
+	void schedule(bool keep_live_values = false);
+	void write_header(ostream& f_out);
+	void write_script(string_view source, streampoint source_offset, ostream& f_out, size_t n);
+	void write_trailer(ostream& f_out);
+	void write_annotated_script(string_view source, streampoint source_offset, ostream& f_out, size_t n);
+	void write_annotation(string_view source, streampoint source_offset, ostream& f_out, const stmt& stmt) const;
+
+private:
+	size_t annotated_stmts = 0;	// stmts[0, annotated_stmts) have been written out.
+	CScript script_buf;			// reused by the binary and hex writers.
+	vector<script_template::parameter> declared_externs;	// in the order declared.
+	vector<script_template::parameter> template_parameters;	// of the script_template being compiled.
+	map<string, size_t, less<>> big_variables;		// -> size in bytes.
+	string source_directory;	// imports in the source are relative to it.
+	vector<string> importing;	// the modules being compiled, innermost last.
+	vector<pair<string, uint64_t>> imported;	// each module imported so far, and the hash of its text.
+	size_t modules_imported = 0;
+
+	uint64_t module_reads_hash(const vector<string>& reads, const map<string, ir_value, less<>>& variables,
+		const vector<ir_value>& vstack) const;
+	bool compile_module(const string& path, compiled_module& module);
+	bool link_module(const compiled_module& module);
+	static bool read_module(const string& name, string& text);
+	static bool is_current(const compiled_module& module);
 };
\ No newline at end of file
@@ -0,0 +1,482 @@
+// Copyright (c) Shaun O'Kane, 2010, 2018
+#include "big_integer.h"
+#include <algorithm>
+#include <vector>
+#include "ir.h"
+
+using namespace std;
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  limb_program
+//
+///////////////////////////////////////////////////////////////////////////////
+
+// The limb code as a list of operations on values, which emit() then turns into stack code. Each value is moved to
+// the top for its last use, and copied for the others. Constants are pushed where they are used.
+class limb_program
+{
+public:
+	typedef uint32_t value;
+	static constexpr value none = numeric_limits<value>::max();
+
+	explicit limb_program(size_t no_of_inputs) : no_of_inputs(no_of_inputs), values(no_of_inputs) {}
+
+	value input(size_t k) const { return value(k); }
+	value constant(const valtype& v);
+	value constant(int64_t n) { return constant(CScriptNum(n).getvch()); }
+	value apply(opcodetype opcode, value a, value b) { return add(opcode, a, b, 1); }
+	value apply(opcodetype opcode, value a) { return add(opcode, a, none, 1); }
+	pair<value, value> split(value x, size_t n)
+	{
+		value low = add(OP_SPLIT, x, constant(int64_t(n)), 2);
+		return pair(low, low + 1);
+	}
+
+	// The code, which takes the inputs from the stack, bottom first, and leaves just result.
+	CScript emit(value result) const;
+
+private:
+	struct instr
+	{
+		opcodetype opcode;
+		value args[2];
+		uint32_t no_of_args;
+		value result;
+		uint32_t no_of_results;
+	};
+	struct value_info
+	{
+		bool is_constant = false;
+		valtype data;
+	};
+	size_t no_of_inputs;
+	vector<value_info> values;
+	vector<instr> instrs;
+
+	value add(opcodetype opcode, value a, value b, uint32_t no_of_results);
+};
+
+limb_program::value limb_program::constant(const valtype& v)
+{
+	values.push_back({true, v});
+	return value(values.size() - 1);
+}
+
+limb_program::value limb_program::add(opcodetype opcode, value a, value b, uint32_t no_of_results)
+{
+	instr i{opcode, {a, b}, b == none ? 1u : 2u, value(values.size()), no_of_results};
+	values.resize(values.size() + no_of_results);
+	instrs.push_back(i);
+	return i.result;
+}
+
+// The smallest push of v, as the interpreter would want it with SCRIPT_VERIFY_MINIMALDATA.
+static void push(CScript& code, const valtype& v)
+{
+	if(v.empty())
+		code << OP_0;
+	else if(v.size() == 1 && v[0] >= 1 && v[0] <= 16)
+		code << CScript::EncodeOP_N(v[0]);
+	else if(v.size() == 1 && v[0] == 0x81)
+		code << OP_1NEGATE;
+	else
+		code << v;
+}
+
+CScript limb_program::emit(value result) const
+{
+	vector<uint32_t> uses(values.size(), 0);
+	for(auto& i : instrs)
+	{
+		for(uint32_t k = 0; k < i.no_of_args; k++)
+		{
+			if(!values[i.args[k]].is_constant)
+				uses[i.args[k]]++;
+		}
+	}
+	uses[result]++;		// left on the stack.
+
+	CScript code;
+	vector<value> stack;	// bottom first.
+	auto position = [&](value v) { return int64_t(find(stack.rbegin(), stack.rend(), v) - stack.rbegin()); };
+	auto drop = [&](value v)
+	{
+		int64_t depth = position(v);
+		if(depth == 0)
+			code << OP_DROP;
+		else if(depth == 1)
+			code << OP_NIP;
+		else
+			code << depth << OP_ROLL << OP_DROP;
+		stack.erase(stack.end() - 1 - depth);
+	};
+	auto bring = [&](value v, bool move)
+	{
+		int64_t depth = position(v);
+		if(move)
+		{
+			if(depth == 1)
+				code << OP_SWAP;
+			else if(depth == 2)
+				code << OP_ROT;
+			else if(depth > 2)
+				code << depth << OP_ROLL;
+			stack.erase(stack.end() - 1 - depth);
+		}
+		else if(depth == 0)
+			code << OP_DUP;
+		else if(depth == 1)
+			code << OP_OVER;
+		else
+			code << depth << OP_PICK;
+		stack.push_back(v);
+	};
+
+	for(value v = 0; v < no_of_inputs; v++)
+		stack.push_back(v);
+	for(value v = 0; v < no_of_inputs; v++)
+	{
+		if(uses[v] == 0)
+			drop(v);
+	}
+	for(auto& i : instrs)
+	{
+		// The operands may already be on top, each for its last use.
+		const value* args = i.args;
+		uint32_t n = i.no_of_args;
+		auto last_use = [&](value v) { return !values[v].is_constant && uses[v] == 1; };
+		bool in_place = n <= stack.size() && equal(args, args + n, stack.end() - n)
+			&& all_of(args, args + n, last_use) && (n == 1 || args[0] != args[1]);
+		if(!in_place && n == 2 && stack.size() >= 2 && is_commutative(i.opcode) && args[0] != args[1]
+			&& last_use(args[0]) && last_use(args[1]) && stack.end()[-1] == args[0] && stack.end()[-2] == args[1])
+			in_place = true;
+		for(uint32_t k = 0; k < n; k++)
+		{
+			if(values[args[k]].is_constant)
+			{
+				push(code, values[args[k]].data);
+				stack.push_back(args[k]);
+			}
+			else if(--uses[args[k]] == 0 || in_place)
+			{
+				if(!in_place)
+					bring(args[k], true);
+			}
+			else
+				bring(args[k], false);
+		}
+		code << i.opcode;
+		stack.resize(stack.size() - n);
+		for(uint32_t r = 0; r < i.no_of_results; r++)
+			stack.push_back(i.result + r);
+		for(uint32_t r = i.no_of_results; r-- > 0; )
+		{
+			if(uses[i.result + r] == 0)
+				drop(i.result + r);		// e.g. the carry out of the top limb.
+		}
+	}
+	assert(stack.size() == 1 && stack[0] == result);
+	return code;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  limb code
+//
+///////////////////////////////////////////////////////////////////////////////
+
+typedef limb_program::value value;
+
+// Limbs are n bytes, for n <= 3, so that they are valid script numbers with a byte to spare. Appending a byte c
+// gives the limb + c * 2^(8n), which is minimally encoded for c > 0. It saves converting the limb with
+// BIN2NUM(CAT(limb, 0x00)), which would be four bytes of code, not two.
+static value biased(limb_program& p, value limb, int c = 1)
+{
+	return p.apply(OP_CAT, limb, p.constant(c));
+}
+
+// The next n byte limb of x, which is left holding the rest. x is the limb itself if there is no rest.
+static value next_limb(limb_program& p, value& x, size_t n, bool last)
+{
+	if(last)
+		return x;
+	auto [limb, rest] = p.split(x, n);
+	x = rest;
+	return limb;
+}
+
+static value concatenate(limb_program& p, value result, value limb)
+{
+	return result == limb_program::none ? limb : p.apply(OP_CAT, result, limb);
+}
+
+// a + b. Each limb sum has a bias of 2 * 2^(8n), so that the byte above it, the carry + 2, is a valid number.
+static value add(limb_program& p, value a, value b, size_t size, size_t limb)
+{
+	value result = limb_program::none, carry = limb_program::none;
+	for(size_t done = 0; done < size; done += limb)
+	{
+		size_t n = min(limb, size - done);
+		bool last = done + n == size;
+		value la = next_limb(p, a, n, last), lb = next_limb(p, b, n, last);
+		value sum = p.apply(OP_ADD, biased(p, la), biased(p, lb));
+		if(carry != limb_program::none)
+			sum = p.apply(OP_SUB, p.apply(OP_ADD, sum, carry), p.constant(2));
+		auto [low, high] = p.split(p.apply(OP_NUM2BIN, sum, p.constant(int64_t(n + 1))), n);
+		carry = high;
+		result = concatenate(p, result, low);
+	}
+	return result;
+}
+
+// a - b, mod 2^(8 * size). Each limb difference has a bias of 2 * 2^(8n). The byte above it is 2, or 1 if there is
+// a borrow.
+static value subtract(limb_program& p, value a, value b, size_t size, size_t limb)
+{
+	value result = limb_program::none, no_borrow = limb_program::none;
+	for(size_t done = 0; done < size; done += limb)
+	{
+		size_t n = min(limb, size - done);
+		bool last = done + n == size;
+		value la = next_limb(p, a, n, last), lb = next_limb(p, b, n, last);
+		value diff = p.apply(OP_SUB, biased(p, la, 3), biased(p, lb));
+		if(no_borrow != limb_program::none)
+			diff = p.apply(OP_SUB, p.apply(OP_ADD, diff, no_borrow), p.constant(2));
+		auto [low, high] = p.split(p.apply(OP_NUM2BIN, diff, p.constant(int64_t(n + 1))), n);
+		no_borrow = high;
+		result = concatenate(p, result, low);
+	}
+	return result;
+}
+
+// a >= b, from the borrow out of a - b. Only the comparisons of each limb are needed, not the difference.
+static value greater_or_equal(limb_program& p, value a, value b, size_t size, size_t limb)
+{
+	value ge = limb_program::none;
+	for(size_t done = 0; done < size; done += limb)
+	{
+		size_t n = min(limb, size - done);
+		bool last = done + n == size;
+		value la = biased(p, next_limb(p, a, n, last)), lb = biased(p, next_limb(p, b, n, last));
+		if(ge == limb_program::none)
+			ge = p.apply(OP_GREATERTHANOREQUAL, la, lb);
+		else
+			ge = p.apply(OP_GREATERTHAN, p.apply(OP_ADD, la, ge), lb);
+	}
+	return ge;
+}
+
+// Multiplication works on polynomials in 2^8, i.e. the product of one byte limbs, before the carries. A coefficient
+// is a sum of products of limbs, or sums of limbs, so stays well within a script number.
+typedef vector<value> polynomial;
+
+static polynomial sum(limb_program& p, const polynomial& a, const polynomial& b)
+{
+	polynomial c = a.size() >= b.size() ? a : b;
+	for(size_t k = 0; k < min(a.size(), b.size()); k++)
+		c[k] = p.apply(OP_ADD, a[k], b[k]);
+	return c;
+}
+
+static void accumulate(limb_program& p, polynomial& c, size_t offset, const polynomial& a, opcodetype opcode = OP_ADD)
+{
+	for(size_t k = 0; k < a.size() && offset + k < c.size(); k++)
+		c[offset + k] = c[offset + k] == limb_program::none ? a[k] : p.apply(opcode, c[offset + k], a[k]);
+}
+
+// The low n coefficients of a * b. a and b have n limbs each, or 2n - 1 coefficients are wanted.
+static polynomial schoolbook(limb_program& p, const polynomial& a, const polynomial& b, size_t n)
+{
+	polynomial c(n, limb_program::none);
+	for(size_t j = 0; j < n; j++)
+	{
+		for(size_t i = (j >= b.size() ? j - b.size() + 1 : 0); i <= j && i < a.size(); i++)
+		{
+			value product = p.apply(OP_MUL, a[i], b[j - i]);
+			c[j] = c[j] == limb_program::none ? product : p.apply(OP_ADD, c[j], product);
+		}
+	}
+	return c;
+}
+
+// a * b, where a and b have the same no. of limbs. Three half size products instead of four.
+static polynomial karatsuba(limb_program& p, const polynomial& a, const polynomial& b, size_t threshold)
+{
+	size_t n = a.size();
+	if(n <= threshold)
+		return schoolbook(p, a, b, 2 * n - 1);
+	size_t h = n / 2;
+	polynomial a0(a.begin(), a.begin() + h), a1(a.begin() + h, a.end());
+	polynomial b0(b.begin(), b.begin() + h), b1(b.begin() + h, b.end());
+	polynomial z0 = karatsuba(p, a0, b0, threshold);
+	polynomial z2 = karatsuba(p, a1, b1, threshold);
+	polynomial z1 = karatsuba(p, sum(p, a0, a1), sum(p, b0, b1), threshold);
+	accumulate(p, z1, 0, z0, OP_SUB);
+	accumulate(p, z1, 0, z2, OP_SUB);
+	polynomial c(2 * n - 1, limb_program::none);
+	accumulate(p, c, 0, z0);
+	accumulate(p, c, h, z1);
+	accumulate(p, c, 2 * h, z2);
+	return c;
+}
+
+// The low n coefficients of a * b: the whole product of the low halves, plus the low halves of the cross products.
+static polynomial truncated_product(limb_program& p, const polynomial& a, const polynomial& b, size_t n, size_t threshold)
+{
+	if(n <= threshold)
+		return schoolbook(p, a, b, n);
+	size_t h = n - n / 2;
+	polynomial c = karatsuba(p, polynomial(a.begin(), a.begin() + h), polynomial(b.begin(), b.begin() + h), threshold);
+	c.resize(n, limb_program::none);
+	polynomial a_low(a.begin(), a.begin() + (n - h)), b_low(b.begin(), b.begin() + (n - h));
+	polynomial a_high(a.begin() + h, a.begin() + n), b_high(b.begin() + h, b.begin() + n);
+	accumulate(p, c, h, truncated_product(p, a_low, b_high, n - h, threshold));
+	accumulate(p, c, h, truncated_product(p, a_high, b_low, n - h, threshold));
+	return c;
+}
+
+// A limb of up to 3 bytes as a script number.
+static value as_number(limb_program& p, value limb)
+{
+	return p.apply(OP_BIN2NUM, p.apply(OP_CAT, limb, p.constant(valtype(1, 0))));
+}
+
+static polynomial byte_limbs(limb_program& p, value x, size_t size)
+{
+	polynomial limbs;
+	for(size_t k = 0; k < size; k++)
+		limbs.push_back(as_number(p, next_limb(p, x, 1, k + 1 == size)));
+	return limbs;
+}
+
+// The low size coefficients of a * b, where a has two byte limbs and b one byte limbs, so each product is still
+// less than 2^24. Half as many products as with one byte limbs for both, but no Karatsuba. Each limb is split off
+// when it is first needed, which keeps the stack shallower.
+static polynomial mixed_product(limb_program& p, value a, value b, size_t size)
+{
+	polynomial a_limbs, b_limbs, c(size, limb_program::none);
+	auto limb = [&](value& x, size_t done, size_t n)
+	{
+		return as_number(p, next_limb(p, x, min(n, size - done), done + n >= size));
+	};
+	for(size_t j = 0; j < size; j++)
+	{
+		b_limbs.push_back(limb(b, j, 1));
+		if(j % 2 == 0)
+			a_limbs.push_back(limb(a, j, 2));
+		for(size_t i = 0; i < a_limbs.size(); i++)
+		{
+			value product = p.apply(OP_MUL, a_limbs[i], b_limbs[j - 2 * i]);
+			c[j] = c[j] == limb_program::none ? product : p.apply(OP_ADD, c[j], product);
+		}
+	}
+	return c;
+}
+
+// The coefficients of a product in 2^8, with the carries propagated, mod 2^(8 * size).
+static value carry_through(limb_program& p, const polynomial& c, size_t size)
+{
+	value result = limb_program::none, carry = limb_program::none;
+	for(size_t j = 0; j < size; j++)
+	{
+		value t = carry == limb_program::none ? c[j] : p.apply(OP_ADD, c[j], carry);
+		auto [low, high] = p.split(p.apply(OP_NUM2BIN, t, p.constant(4)), 1);
+		carry = j + 1 < size ? p.apply(OP_BIN2NUM, high) : high;
+		result = concatenate(p, result, low);
+	}
+	return result;
+}
+
+// a * b, mod 2^(8 * size). threshold is the no. of limbs below which Karatsuba isn't used, or 0 for mixed limbs.
+static value multiply(limb_program& p, value a, value b, size_t size, size_t threshold)
+{
+	if(threshold == 0)
+		return carry_through(p, mixed_product(p, a, b, size), size);
+	return carry_through(p, truncated_product(p, byte_limbs(p, a, size), byte_limbs(p, b, size), size, threshold), size);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  big_integer_lowering
+//
+///////////////////////////////////////////////////////////////////////////////
+
+bool big_integer_lowering::is_supported(token_kind op)
+{
+	switch(op)
+	{
+	case token_kind::_plus: case token_kind::_minus: case token_kind::_star:
+	case token_kind::_lt: case token_kind::_le: case token_kind::_eq: case token_kind::_ne: case token_kind::_ge:
+	case token_kind::_gt:
+		return true;
+	default:
+		return false;
+	}
+}
+
+// The body of op, written each way it can be. The one that weighs least under costs is kept.
+static CScript lower(token_kind op, size_t size, const cost_model& costs)
+{
+	CScript cheapest;
+	uint64_t weight = 0;
+	auto keep = [&](limb_program& p, value result)
+	{
+		CScript code = p.emit(result);
+		uint64_t w = costs.weigh(cost_model::script(code));
+		if(cheapest.empty() || w < weight)
+		{
+			cheapest = code;
+			weight = w;
+		}
+	};
+	for(size_t limb = 1; limb <= 3; limb++)
+	{
+		limb_program p(2);
+		value a = p.input(0), b = p.input(1);
+		switch(op)
+		{
+		case token_kind::_plus:		keep(p, add(p, a, b, size, limb)); break;
+		case token_kind::_minus:	keep(p, subtract(p, a, b, size, limb)); break;
+		case token_kind::_ge:		keep(p, greater_or_equal(p, a, b, size, limb)); break;
+		case token_kind::_lt:		keep(p, p.apply(OP_NOT, greater_or_equal(p, a, b, size, limb))); break;
+		case token_kind::_le:		keep(p, greater_or_equal(p, b, a, size, limb)); break;
+		case token_kind::_gt:		keep(p, p.apply(OP_NOT, greater_or_equal(p, b, a, size, limb))); break;
+		default: break;
+		}
+	}
+	if(op == token_kind::_star)
+	{
+		for(size_t threshold : {size_t(0), size, size_t(2), size_t(4), size_t(8)})
+		{
+			limb_program p(2);
+			keep(p, multiply(p, p.input(0), p.input(1), size, threshold));
+		}
+	}
+	else if(op == token_kind::_eq)
+		cheapest << OP_EQUAL;
+	else if(op == token_kind::_ne)
+		cheapest << OP_EQUAL << OP_NOT;
+	return cheapest;
+}
+
+const intrinsic& big_integer_lowering::operation(token_kind op, size_t size, const cost_model& costs)
+{
+	assert(is_supported(op) && size > 0);
+	auto p = operations.find(tuple(op, size, costs.goal));
+	if(p != operations.end())
+		return *p->second;
+	names.push_back("uint" + to_string(size * 8) + string(spelling(op)));
+	bodies.push_back(lower(op, size, costs));
+	intrinsics.push_back({names.back(), token_kind::_none, 2, 1, OP_INVALIDOPCODE, 1, false, true, &bodies.back()});
+	operations.emplace(tuple(op, size, costs.goal), &intrinsics.back());
+	return intrinsics.back();
+}
+
+pair<token_kind, size_t> big_integer_lowering::operation_of(const intrinsic& f) const
+{
+	for(auto& [key, p] : operations)
+		if(p == &f)
+			return pair(get<0>(key), get<1>(key));
+	return pair(token_kind::_none, size_t(0));
+}
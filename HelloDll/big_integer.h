@@ -0,0 +1,38 @@
+#pragma once
+// Copyright (c) Shaun O'Kane, 2010, 2018
+
+#include <deque>
+#include <map>
+#include <string>
+#include <tuple>
+#include "Internals.h"
+#include "intrinsics.h"
+#include "cost_model.h"
+
+using namespace std;
+
+// Arithmetic on fixed width unsigned integers, e.g. uint256. A value is held as a little endian byte array of its
+// full width, but the numeric opcodes only take 4 byte operands, so each operation is lowered to code that works
+// on limbs of a few bytes at a time and propagates the carries. + and - wrap round, as does *, which only works out
+// the low half of the product.
+//
+// Each operation is an intrinsic, with a body that takes the two operands (a below b) and leaves the result. So it
+// is scheduled and reused like any other pure function. Several ways of writing the body are tried, i.e. limb sizes,
+// and schoolbook, mixed limb or Karatsuba multiplication, and the cheapest under the cost_model's objective is
+// kept.
+class big_integer_lowering
+{
+public:
+	// op is +, -, * or a comparison, on values of size bytes. Comparisons give a script number, 0 or 1.
+	const intrinsic& operation(token_kind op, size_t size, const cost_model& costs);
+	// The op and size that f was made for, or token_kind::_none if it isn't one of these operations.
+	pair<token_kind, size_t> operation_of(const intrinsic& f) const;
+
+	static bool is_supported(token_kind op);
+
+private:
+	deque<string> names;
+	deque<CScript> bodies;
+	deque<intrinsic> intrinsics;	// deques so that pointers stay valid.
+	map<tuple<token_kind, size_t, cost_model::objective>, const intrinsic*> operations;
+};
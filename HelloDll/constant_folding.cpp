@@ -0,0 +1,140 @@
+// Copyright (c) Shaun O'Kane, 2010, 2018
+#include "constant_folding.h"
+#include "hash.h"
+#include "crypto/sha1.h"
+
+using namespace std;
+
+static const valtype vch_false;
+static const valtype vch_true(1, 1);
+
+bool to_bool(const valtype& v)
+{
+	for(size_t i = 0; i < v.size(); i++)
+	{
+		if(v[i] != 0)
+			return !(i == v.size() - 1 && v[i] == 0x80);	// negative zero.
+	}
+	return false;
+}
+
+static bool evaluate_numeric(opcodetype opcode, vector<valtype>& stack)
+{
+	// Numeric operands are limited to 4 bytes. Results can be bigger.
+	vector<CScriptNum> args;
+	for(auto& v : stack)
+		args.emplace_back(v, false);
+	CScriptNum bn(0);
+	switch(opcode)
+	{
+	// (in -- out)
+	case OP_NEGATE:		bn = -args[0]; break;
+	case OP_ABS:		bn = args[0] < 0 ? -args[0] : args[0]; break;
+	case OP_NOT:		bn = CScriptNum(args[0] == 0); break;
+	case OP_0NOTEQUAL:	bn = CScriptNum(args[0] != 0); break;
+	// (x1 x2 -- out)
+	case OP_ADD:		bn = args[0] + args[1]; break;
+	case OP_SUB:		bn = args[0] - args[1]; break;
+	case OP_MUL:		bn = args[0] * args[1]; break;
+	case OP_DIV:
+		if(args[1] == 0)
+			return false;
+		bn = args[0] / args[1];
+		break;
+	case OP_MOD:
+		if(args[1] == 0)
+			return false;
+		bn = args[0] % args[1];
+		break;
+	case OP_BOOLAND:				bn = CScriptNum(args[0] != 0 && args[1] != 0); break;
+	case OP_BOOLOR:					bn = CScriptNum(args[0] != 0 || args[1] != 0); break;
+	case OP_NUMEQUAL:				bn = CScriptNum(args[0] == args[1]); break;
+	case OP_NUMNOTEQUAL:			bn = CScriptNum(args[0] != args[1]); break;
+	case OP_LESSTHAN:				bn = CScriptNum(args[0] < args[1]); break;
+	case OP_GREATERTHAN:			bn = CScriptNum(args[0] > args[1]); break;
+	case OP_LESSTHANOREQUAL:		bn = CScriptNum(args[0] <= args[1]); break;
+	case OP_GREATERTHANOREQUAL:		bn = CScriptNum(args[0] >= args[1]); break;
+	case OP_MIN:					bn = args[0] < args[1] ? args[0] : args[1]; break;
+	case OP_MAX:					bn = args[0] > args[1] ? args[0] : args[1]; break;
+	// (x min max -- out)
+	case OP_WITHIN:					bn = CScriptNum(args[1] <= args[0] && args[0] < args[2]); break;
+	default:
+		return false;
+	}
+	stack.assign(1, bn.getvch());
+	return true;
+}
+
+static bool evaluate_hash(opcodetype opcode, valtype& v)
+{
+	valtype hash((opcode == OP_RIPEMD160 || opcode == OP_SHA1 || opcode == OP_HASH160) ? 20 : 32);
+	switch(opcode)
+	{
+	case OP_RIPEMD160:	CRIPEMD160().Write(v.data(), v.size()).Finalize(hash.data()); break;
+	case OP_SHA1:		CSHA1().Write(v.data(), v.size()).Finalize(hash.data()); break;
+	case OP_SHA256:		CSHA256().Write(v.data(), v.size()).Finalize(hash.data()); break;
+	case OP_HASH160:	CHash160().Write(v.data(), v.size()).Finalize(hash.data()); break;
+	case OP_HASH256:	CHash256().Write(v.data(), v.size()).Finalize(hash.data()); break;
+	default:
+		return false;
+	}
+	v = move(hash);
+	return true;
+}
+
+bool evaluate_opcode(opcodetype opcode, vector<valtype>& stack)
+{
+	size_t n = 0;	// no. of args.
+	switch(opcode)
+	{
+	case OP_NEGATE: case OP_ABS: case OP_NOT: case OP_0NOTEQUAL:
+	case OP_RIPEMD160: case OP_SHA1: case OP_SHA256: case OP_HASH160: case OP_HASH256:
+	case OP_SIZE:
+		n = 1;
+		break;
+	case OP_WITHIN:
+		n = 3;
+		break;
+	default:
+		n = 2;
+		break;
+	}
+	if(stack.size() != n)
+		return false;
+
+	try
+	{
+		switch(opcode)
+		{
+		case OP_RIPEMD160: case OP_SHA1: case OP_SHA256: case OP_HASH160: case OP_HASH256:
+			return evaluate_hash(opcode, stack[0]);
+		case OP_SIZE:
+			stack.push_back(CScriptNum(stack[0].size()).getvch());
+			return true;
+		case OP_EQUAL:
+			stack.assign(1, stack[0] == stack[1] ? vch_true : vch_false);
+			return true;
+		case OP_CAT:
+			if(stack[0].size() + stack[1].size() > MAX_SCRIPT_ELEMENT_SIZE)
+				return false;
+			stack[0].insert(stack[0].end(), stack[1].begin(), stack[1].end());
+			stack.pop_back();
+			return true;
+		case OP_SPLIT:
+		{
+			uint64_t position = CScriptNum(stack[1], false).getint();
+			if(position > stack[0].size())
+				return false;
+			stack[1].assign(stack[0].begin() + position, stack[0].end());
+			stack[0].resize(position);
+			return true;
+		}
+		default:
+			return evaluate_numeric(opcode, stack);
+		}
+	}
+	catch(scriptnum_error&)
+	{
+		return false;	// e.g. an operand is too big to be a number.
+	}
+}
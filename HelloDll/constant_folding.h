@@ -0,0 +1,14 @@
+#pragma once
+// Copyright (c) Shaun O'Kane, 2010, 2018
+
+#include <vector>
+#include "Internals.h"
+
+using namespace std;
+
+// Compile time evaluation of an opcode, with the same semantics as the interpreter. stack holds the arguments and
+// is left holding the results. Returns false if opcode isn't supported, or would fail at run time, in which case
+// the opcode is left to run time and stack is unspecified.
+bool evaluate_opcode(opcodetype opcode, vector<valtype>& stack);
+
+bool to_bool(const valtype& v);	// as CastToBool()
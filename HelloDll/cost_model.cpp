@@ -0,0 +1,114 @@
+// Copyright (c) Shaun O'Kane, 2010, 2018
+#include "cost_model.h"
+#include <array>
+#include <sstream>
+#include "ir.h"
+
+using namespace std;
+
+static constexpr array<uint16_t, 256> execution_costs()
+{
+	array<uint16_t, 256> costs {};
+	for(auto& c : costs)
+		c = 1;
+	for(auto& f : builtin_intrinsics)
+		if(f.opcode >= OP_RIPEMD160 && f.opcode <= OP_CHECKMULTISIGVERIFY)
+			costs[f.opcode] = f.cost;
+	return costs;
+}
+
+static constexpr auto opcode_costs = execution_costs();
+
+cost_model::objective cost_model::from_options(uint32_t options)
+{
+	if(options & OPTIMISE_FOR_SIZE)
+		return _size;
+	if(options & OPTIMISE_FOR_OPS)
+		return _ops;
+	return _balanced;
+}
+
+// _balanced is what the optimiser weighed before there was a choice, so -O output doesn't change.
+uint64_t cost_model::weigh(const code_cost& c) const
+{
+	switch(goal)
+	{
+	case _size: return (uint64_t(c.bytes) << 32) + c.execution;
+	case _ops: return (uint64_t(c.execution) << 32) + c.bytes;
+	default: return c.bytes + c.execution - c.opcodes;
+	}
+}
+
+code_cost cost_model::opcode(opcodetype op)
+{
+	return {1, 1, opcode_costs[op]};
+}
+
+code_cost cost_model::push(const valtype& v)
+{
+	return {push_size(v), 1, 1};
+}
+
+code_cost cost_model::script(const CScript& s)
+{
+	code_cost c;
+	opcodetype op;
+	for(auto p = s.begin(); p < s.end() && s.GetOp(p, op); )
+		c += op <= OP_PUSHDATA4 ? code_cost{0, 1, 1} : opcode(op);
+	c.bytes = s.size();
+	return c;
+}
+
+// A function with a body of its own, e.g. a uintN operation, is charged its body plus anything its cost says
+// on top, as for a native function.
+code_cost cost_model::call(uint16_t op, const intrinsic* info)
+{
+	if(!info)
+		return opcode(opcodetype(op));
+	code_cost c = info->body ? script(*info->body) : code_cost{1, 1, 1};
+	if(info->cost > 1)
+		c.execution += info->cost - 1;
+	return c;
+}
+
+code_cost cost_model::instruction(const instruction_pipeline& pipe, size_t k)
+{
+	if(pipe.is_data(k))
+		return {pipe.encoded_size(k), 1, 1};
+	return opcode(pipe.opcode(k));
+}
+
+code_cost cost_model::copy(size_t depth)
+{
+	if(depth < 2)
+		return {1, 1, 1};
+	return push(CScriptNum(int64_t(depth)).getvch()) + opcode(OP_PICK);
+}
+
+code_cost cost_model::move(size_t depth)
+{
+	if(depth == 0)
+		return {};
+	if(depth < 3)
+		return {1, 1, 1};
+	return push(CScriptNum(int64_t(depth)).getvch()) + opcode(OP_ROLL);
+}
+
+string cost_report::statistics() const
+{
+	code_cost total = unattributed;
+	stringstream s;
+	for(auto& [line, c] : by_line)
+	{
+		s << "\tline " << line + 1 << ": " << c.bytes << " bytes, " << c.opcodes << " opcodes, " << c.execution
+			<< " execution\n";
+		total += c;
+	}
+	if(unattributed.opcodes)
+		s << "\tother: " << unattributed.bytes << " bytes, " << unattributed.opcodes << " opcodes, "
+			<< unattributed.execution << " execution\n";
+	if(total.opcodes)
+		s << "\ttotal: " << total.bytes << " bytes, " << total.opcodes << " opcodes, " << total.execution
+			<< " execution\n";
+	return s.str();
+}
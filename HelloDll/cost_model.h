@@ -0,0 +1,86 @@
+#pragma once
+// Copyright (c) Shaun O'Kane, 2010, 2018
+
+#include <map>
+#include <string>
+#include "Internals.h"
+#include "intrinsics.h"
+
+using namespace std;
+
+// What some code costs. bytes is its size in the script, which the fee is paid on. opcodes is the no. of
+// instructions executed, pushes included, and execution weighs each of them by its rough relative cost, e.g. a
+// signature check is far dearer than a stack move. Straight line code only: an if costs both of its branches.
+struct code_cost
+{
+	size_t bytes = 0, opcodes = 0, execution = 0;
+
+	code_cost& operator+=(const code_cost& c) { bytes += c.bytes; opcodes += c.opcodes; execution += c.execution; return *this; }
+	friend code_cost operator+(code_cost a, const code_cost& b) { return a += b; }
+};
+
+// The costs of opcodes and pushes, and what the optimiser minimises. Wherever it has a choice between two ways of
+// writing the same code, e.g. the order operands are staged in, reusing a subexpression or computing it again, a
+// peephole rule or the body of a uintN operation, it takes the one that weighs less.
+class cost_model
+{
+public:
+	enum objective : uint8_t
+	{
+		_balanced,	// -O. Bytes, plus the execution cost over that of the cheapest opcode.
+		_size,		// -Os. The fewest bytes. Execution cost only breaks ties.
+		_ops		// -Oops. The least execution cost. Bytes only break ties.
+	};
+	objective goal = _balanced;
+
+	static objective from_options(uint32_t options);
+
+	uint64_t weigh(const code_cost& c) const;
+
+	// Opcodes cost one, apart from the hashes and signature checks, which cost what their intrinsics say.
+	static code_cost opcode(opcodetype op);
+	static code_cost push(const valtype& v);	// once the peephole optimiser has shrunk small ints.
+	static code_cost script(const CScript& s);
+	static code_cost call(uint16_t op, const intrinsic* info);	// an operator, or a native or user function.
+	static code_cost instruction(const instruction_pipeline& pipe, size_t k);
+	// As variable_allocator emits them.
+	static code_cost copy(size_t depth);
+	static code_cost move(size_t depth);
+};
+
+// What the compiled script costs, by source line.
+class cost_report
+{
+public:
+	// Adds the cost of pipe[0, n), which is about to be written out. lines has line(streampoint), as for
+	// dead_code_eliminator::locate().
+	template<typename line_source> void add(const instruction_pipeline& pipe, size_t n, const stmt_table& stmts,
+		const line_source& lines)
+	{
+		// Summed over each run of instructions from the same statement, as lookups are by far the dearest part.
+		uint32_t stmt_id = numeric_limits<uint32_t>::max();
+		code_cost run;
+		for(size_t k = 0; k <= n; k++)
+		{
+			uint32_t s = k < n ? pipe.generating_stmt(k) : numeric_limits<uint32_t>::max();
+			if(k == n || s != stmt_id)
+			{
+				if(stmt_id < stmts.size())
+					by_line[lines.line(stmts[stmt_id].start)] += run;
+				else
+					unattributed += run;
+				stmt_id = s;
+				run = code_cost();
+			}
+			if(k < n)
+				run += cost_model::instruction(pipe, k);
+		}
+	}
+
+	void reset() { by_line.clear(); unattributed = code_cost(); }
+	string statistics() const;
+
+private:
+	map<size_t, code_cost> by_line;
+	code_cost unattributed;		// e.g. the final clean up of the stack.
+};
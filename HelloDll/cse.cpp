@@ -0,0 +1,89 @@
+// Copyright (c) Shaun O'Kane, 2010, 2018
+#include "cse.h"
+#include <sstream>
+#include <tuple>
+#include "intrinsics.h"
+
+using namespace std;
+
+static bool is_pure(const ir_instr& instr)
+{
+	return instr.op < ir_instr::_const && (!instr.info || instr.info->is_pure);	// operators are pure.
+}
+
+// To compute instr again. Each operand that isn't a constant is taken to cost an opcode to bring to the top, which
+// favours computing it again.
+static code_cost recompute_cost(const ir_function& fn, const ir_instr& instr)
+{
+	code_cost cost = cost_model::call(instr.op, instr.info);
+	const ir_value* args = fn.operands_of(instr);
+	for(uint32_t k = 0; k < instr.no_of_operands; k++)
+		cost += fn.is_constant(args[k]) ? cost_model::push(fn.constant(args[k])) : code_cost{1, 1, 1};
+	return cost;
+}
+
+// Value numbering over the instructions in order. An earlier instruction can only be reused if it dominates, i.e.
+// isn't in a branch that the later one is outside of.
+bool common_subexpression_eliminator::run(ir_function& fn, const cost_model& costs)
+{
+	uint64_t pick_cost = costs.weigh({2, 2, 2});	// n OP_PICK, to copy the earlier result to the top.
+	replacements.resize(fn.values.size());
+	for(ir_value v = 0; v < fn.values.size(); v++)
+		replacements[v] = v;
+
+	typedef tuple<uint16_t, const intrinsic*, vector<ir_value>> expression;
+	map<expression, vector<uint32_t>> computed;		// -> the instructions that compute it.
+	map<valtype, ir_value> constants;	// each constant is a value of its own. The first with the same bytes.
+	bool replaced = false;
+	for(uint32_t i = 0; i < fn.instrs.size(); i++)
+	{
+		ir_instr& instr = fn.instrs[i];
+		if(instr.op == ir_instr::_nop)
+			continue;
+		ir_value* args = fn.operands_of(instr);
+		for(uint32_t k = 0; k < instr.no_of_operands; k++)
+			args[k] = replacements[args[k]];
+
+		if(instr.op == ir_instr::_phi && args[0] == args[1])
+		{
+			replacements[instr.result] = args[0];	// the branches now agree.
+			instr.op = ir_instr::_nop;
+			replaced = true;
+			continue;
+		}
+		if(!is_pure(instr) || costs.weigh(recompute_cost(fn, instr)) <= pick_cost)
+			continue;
+
+		expression e(instr.op, instr.info, vector<ir_value>(args, args + instr.no_of_operands));
+		auto& operands = get<2>(e);
+		for(auto& v : operands)
+		{
+			if(fn.is_constant(v))
+				v = constants.emplace(fn.constant(v), v).first->second;
+		}
+		if(operands.size() == 2 && is_commutative(instr.op) && operands[0] > operands[1])
+			swap(operands[0], operands[1]);
+		auto& earlier = computed[e];
+		auto p = find_if(earlier.begin(), earlier.end(), [&](uint32_t j) { return fn.dominates(j, i); });
+		if(p == earlier.end())
+		{
+			earlier.push_back(i);
+			continue;
+		}
+		const ir_instr& first = fn.instrs[*p];
+		for(uint16_t r = 0; r < instr.no_of_results; r++)
+			replacements[instr.result + r] = first.result + r;
+		instr.op = ir_instr::_nop;
+		replaced = true;
+		counts[first.info ? string(first.info->name) : string(GetOpName(opcodetype(first.op)))]++;
+	}
+	return replaced;
+}
+
+string common_subexpression_eliminator::statistics() const
+{
+	stringstream s;
+	for(auto& [name, n] : counts)
+		s << "\t" << name << ": " << n << "\n";
+	return s.str();
+}
@@ -0,0 +1,32 @@
+#pragma once
+// Copyright (c) Shaun O'Kane, 2010, 2018
+
+#include <map>
+#include <string>
+#include <vector>
+#include "Internals.h"
+#include "ir.h"
+#include "cost_model.h"
+
+using namespace std;
+
+// Common subexpression elimination. An expression without side effects, i.e. an operator or a pure intrinsic,
+// that has already been computed with the same operands is replaced by the earlier result, which then stays on the
+// stack until its last use. That is only done where reaching the earlier result, typically an OP_PICK, weighs less
+// than computing it again.
+class common_subexpression_eliminator
+{
+public:
+	// Set by run(). value -> the value that replaced it, otherwise itself.
+	vector<ir_value> replacements;
+
+	// fn must have been analysed, and is left needing analyse() again if anything was replaced. Returns whether
+	// anything was.
+	bool run(ir_function& fn, const cost_model& costs);
+
+	void reset() { counts.clear(); }
+	string statistics() const;	// the expressions reused, by opcode or intrinsic.
+
+private:
+	map<string, size_t> counts;
+};
@@ -0,0 +1,360 @@
+// Copyright (c) Shaun O'Kane, 2010, 2018
+#include "dead_code.h"
+#include <map>
+#include <sstream>
+#include "intrinsics.h"
+#include "big_integer.h"
+
+using namespace std;
+
+static bool has_side_effects(const ir_instr& instr)
+{
+	switch(instr.op)
+	{
+	case ir_instr::_input: case ir_instr::_assert: case ir_instr::_return: case ir_instr::_exit:
+		return true;
+	case ir_instr::_const: case ir_instr::_phi: case ir_instr::_depth: case ir_instr::_nop:
+	case ir_instr::_if: case ir_instr::_else: case ir_instr::_endif:
+		return false;	// the markers are live if anything in the if is.
+	default:
+		return instr.info && !instr.info->is_pure;	// operators are pure.
+	}
+}
+
+// What is known about a value, to tell whether the instructions that use it can fail. A script fails as soon as an
+// opcode does, so one that could must stay, even if its result is never used.
+struct value_facts
+{
+	size_t max_size = MAX_SCRIPT_ELEMENT_SIZE;	// in bytes.
+	bool exact = false;			// whether it is always max_size bytes.
+	bool is_number = false;		// a minimally encoded number of max_size <= 4 bytes, which arithmetic accepts.
+};
+
+static value_facts bytes_of(size_t size) { return {size, true, false}; }
+static value_facts number_of(size_t size) { return {size, false, size <= CScriptNum::MAXIMUM_ELEMENT_SIZE}; }
+
+static bool is_number(const valtype& v)
+{
+	try
+	{
+		CScriptNum(v, true);
+		return true;
+	}
+	catch(scriptnum_error&)
+	{
+		return false;
+	}
+}
+
+// Works out the facts about each value, in script order, and whether each instruction could fail on them. Anything
+// not known to be safe could.
+class failure_analysis
+{
+	const ir_function& fn;
+	const big_integer_lowering& big_integers;
+	vector<value_facts> facts;
+
+	bool numbers(const ir_value* args, size_t n) const
+	{
+		return all_of(args, args + n, [this](ir_value v) { return facts[v].is_number; });
+	}
+	bool is_constant_number(ir_value v) const { return fn.is_constant(v) && facts[v].is_number; }
+	int64_t constant_number(ir_value v) const { return CScriptNum(fn.constant(v), true).getint(); }
+
+	bool opcode_can_fail(const ir_instr& instr, const ir_value* args) const;
+	void set_results(const ir_instr& instr, const ir_value* args);
+
+public:
+	vector<bool> can_fail;
+
+	failure_analysis(const ir_function& fn, const big_integer_lowering& big_integers);
+};
+
+failure_analysis::failure_analysis(const ir_function& _fn, const big_integer_lowering& _big_integers)
+	: fn(_fn), big_integers(_big_integers), facts(_fn.values.size()), can_fail(_fn.instrs.size(), false)
+{
+	for(uint32_t i = 0; i < fn.instrs.size(); i++)
+	{
+		const ir_instr& instr = fn.instrs[i];
+		const ir_value* args = fn.operands_of(instr);
+		switch(instr.op)
+		{
+		case ir_instr::_const:
+		{
+			const valtype& c = fn.constant(instr.result);
+			facts[instr.result] = {c.size(), true, c.size() <= CScriptNum::MAXIMUM_ELEMENT_SIZE && is_number(c)};
+			break;
+		}
+		case ir_instr::_depth:
+			facts[instr.result] = number_of(4);
+			break;
+		case ir_instr::_phi:
+		{
+			const value_facts& a = facts[args[0]];
+			const value_facts& b = facts[args[1]];
+			facts[instr.result] = {max(a.max_size, b.max_size), a.exact && b.exact && a.max_size == b.max_size,
+				a.is_number && b.is_number};
+			break;
+		}
+		case ir_instr::_input: case ir_instr::_extern: case ir_instr::_nop: case ir_instr::_if: case ir_instr::_else:
+		case ir_instr::_endif: case ir_instr::_assert: case ir_instr::_return: case ir_instr::_exit:
+			break;	// nothing is known about inputs. The rest either have side effects or can't fail.
+		default:
+			can_fail[i] = opcode_can_fail(instr, args);
+			set_results(instr, args);
+			break;
+		}
+	}
+}
+
+bool failure_analysis::opcode_can_fail(const ir_instr& instr, const ir_value* args) const
+{
+	size_t n = instr.no_of_operands;
+	if(instr.info && instr.info->body)
+	{
+		// uintN operations can't fail on operands of their size. User intrinsics could do anything.
+		auto [op, size] = big_integers.operation_of(*instr.info);
+		return op == token_kind::_none || !all_of(args, args + n, [&](ir_value v)
+			{ return facts[v].exact && facts[v].max_size == size; });
+	}
+	switch(instr.op)
+	{
+	case OP_RIPEMD160: case OP_SHA1: case OP_SHA256: case OP_HASH160: case OP_HASH256:
+	case OP_SIZE: case OP_EQUAL: case OP_INVERT:
+		return false;
+	case OP_1ADD: case OP_1SUB: case OP_NEGATE: case OP_ABS: case OP_NOT: case OP_0NOTEQUAL:
+	case OP_ADD: case OP_SUB: case OP_MUL: case OP_BOOLAND: case OP_BOOLOR:
+	case OP_NUMEQUAL: case OP_NUMNOTEQUAL: case OP_LESSTHAN: case OP_GREATERTHAN:
+	case OP_LESSTHANOREQUAL: case OP_GREATERTHANOREQUAL: case OP_MIN: case OP_MAX: case OP_WITHIN:
+		return !numbers(args, n);
+	case OP_DIV: case OP_MOD:
+		return !numbers(args, n) || !is_constant_number(args[1]) || constant_number(args[1]) == 0;
+	case OP_LSHIFT: case OP_RSHIFT:
+		return !is_constant_number(args[1]) || constant_number(args[1]) < 0;
+	case OP_CAT:
+		return facts[args[0]].max_size + facts[args[1]].max_size > MAX_SCRIPT_ELEMENT_SIZE;
+	case OP_SPLIT:
+		return !facts[args[0]].exact || !is_constant_number(args[1]) || constant_number(args[1]) < 0
+			|| size_t(constant_number(args[1])) > facts[args[0]].max_size;
+	case OP_AND: case OP_OR: case OP_XOR:
+		return !facts[args[0]].exact || !facts[args[1]].exact || facts[args[0]].max_size != facts[args[1]].max_size;
+	case OP_NUM2BIN:
+		return !facts[args[0]].is_number || !is_constant_number(args[1]) || constant_number(args[1]) < 0
+			|| size_t(constant_number(args[1])) > MAX_SCRIPT_ELEMENT_SIZE
+			|| size_t(constant_number(args[1])) < facts[args[0]].max_size;
+	case OP_BIN2NUM:
+		return facts[args[0]].max_size > CScriptNum::MAXIMUM_ELEMENT_SIZE;
+	default:
+		return true;	// e.g. CHECKSIG, which fails on a badly encoded signature.
+	}
+}
+
+void failure_analysis::set_results(const ir_instr& instr, const ir_value* args)
+{
+	ir_value r = instr.result;
+	if(instr.no_of_results == 0)
+		return;
+	if(instr.info && instr.info->body)
+	{
+		auto [op, size] = big_integers.operation_of(*instr.info);
+		if(op != token_kind::_none)
+			facts[r] = is_comparison(op) ? number_of(1) : bytes_of(size);
+		return;
+	}
+	auto arg = [&](size_t k) { return facts[args[k]]; };
+	switch(instr.op)
+	{
+	case OP_RIPEMD160: case OP_SHA1: case OP_HASH160:
+		facts[r] = bytes_of(20);
+		break;
+	case OP_SHA256: case OP_HASH256:
+		facts[r] = bytes_of(32);
+		break;
+	case OP_SIZE:
+		facts[r] = arg(0);
+		facts[r + 1] = number_of(2);
+		break;
+	case OP_EQUAL: case OP_NOT: case OP_0NOTEQUAL: case OP_BOOLAND: case OP_BOOLOR: case OP_NUMEQUAL:
+	case OP_NUMNOTEQUAL: case OP_LESSTHAN: case OP_GREATERTHAN: case OP_LESSTHANOREQUAL:
+	case OP_GREATERTHANOREQUAL: case OP_WITHIN: case OP_CHECKSIG: case OP_CHECKMULTISIG:
+		facts[r] = number_of(1);
+		break;
+	case OP_1ADD: case OP_1SUB: case OP_NEGATE: case OP_ABS:
+		facts[r] = number_of(arg(0).max_size + (instr.op == OP_NEGATE || instr.op == OP_ABS ? 0 : 1));
+		break;
+	case OP_ADD: case OP_SUB:
+		facts[r] = number_of(max(arg(0).max_size, arg(1).max_size) + 1);
+		break;
+	case OP_MUL:
+		facts[r] = number_of(arg(0).max_size + arg(1).max_size);
+		break;
+	case OP_DIV: case OP_MOD: case OP_MIN: case OP_MAX:
+		facts[r] = number_of(max(arg(0).max_size, arg(1).max_size));
+		break;
+	case OP_BIN2NUM:
+		facts[r] = number_of(min(arg(0).max_size, size_t(CScriptNum::MAXIMUM_ELEMENT_SIZE)));
+		break;
+	case OP_CAT:
+		facts[r] = {min(arg(0).max_size + arg(1).max_size, size_t(MAX_SCRIPT_ELEMENT_SIZE)),
+			arg(0).exact && arg(1).exact, false};
+		break;
+	case OP_SPLIT:
+		if(arg(0).exact && is_constant_number(args[1]) && size_t(constant_number(args[1])) <= arg(0).max_size)
+		{
+			size_t at = size_t(constant_number(args[1]));
+			facts[r] = bytes_of(at);
+			facts[r + 1] = bytes_of(arg(0).max_size - at);
+		}
+		else
+			facts[r] = facts[r + 1] = {arg(0).max_size, false, false};
+		break;
+	case OP_NUM2BIN:
+		if(is_constant_number(args[1]) && constant_number(args[1]) >= 0)
+			facts[r] = bytes_of(min(size_t(constant_number(args[1])), size_t(MAX_SCRIPT_ELEMENT_SIZE)));
+		break;
+	case OP_AND: case OP_OR: case OP_XOR: case OP_INVERT:
+		facts[r] = {arg(0).max_size, arg(0).exact, false};
+		break;
+	default:
+		break;	// nothing is known.
+	}
+}
+
+// Mark and sweep. An instruction is live if it has side effects or could fail, or a live instruction uses one of
+// its results.
+// An if is live if anything in it, or one of its phis, is.
+bool dead_code_eliminator::run(ir_function& fn, const big_integer_lowering& big_integers,
+	const vector<ir_value>& live_out)
+{
+	auto& instrs = fn.instrs;
+	const uint32_t none = numeric_limits<uint32_t>::max();
+
+	// The innermost if around each instruction. The phis after an _endif belong to its if.
+	vector<uint32_t> enclosing(instrs.size(), none);
+	vector<uint32_t> open;
+	for(uint32_t i = 0, merging = none; i < instrs.size(); i++)
+	{
+		uint16_t op = instrs[i].op;
+		if(op != ir_instr::_phi && op != ir_instr::_const && op != ir_instr::_nop)
+			merging = none;
+		enclosing[i] = merging != none ? merging : open.empty() ? none : open.back();
+		if(op == ir_instr::_if)
+			open.push_back(i);
+		else if(op == ir_instr::_endif)
+		{
+			merging = open.back();
+			open.pop_back();
+		}
+	}
+
+	failure_analysis failures(fn, big_integers);
+	vector<bool> live(instrs.size(), false);
+	vector<uint32_t> work;
+	auto mark = [&](uint32_t i) { if(!live[i]) { live[i] = true; work.push_back(i); } };
+	for(uint32_t i = 0; i < instrs.size(); i++)
+	{
+		if(has_side_effects(instrs[i]) || failures.can_fail[i])
+			mark(i);
+	}
+	for(auto v : live_out)
+	{
+		if(!fn.is_constant(v))
+			mark(fn.values[v].def);
+	}
+	while(!work.empty())
+	{
+		uint32_t i = work.back();
+		work.pop_back();
+		const ir_instr& instr = instrs[i];
+		const ir_value* args = fn.operands_of(instr);
+		for(uint32_t k = 0; k < instr.no_of_operands; k++)
+		{
+			if(!fn.is_constant(args[k]))	// a constant doesn't keep the if it was made in alive.
+				mark(fn.values[args[k]].def);
+		}
+		if(enclosing[i] != none)
+			mark(enclosing[i]);
+		if(instr.op == ir_instr::_if || instr.op == ir_instr::_else)
+			mark(fn.matching[i]);
+	}
+
+	bool removed = false;
+	for(uint32_t i = 0; i < instrs.size(); i++)
+	{
+		ir_instr& instr = instrs[i];
+		if(live[i] || instr.op == ir_instr::_const || instr.op == ir_instr::_nop)
+			continue;
+		const ir_value* args = fn.operands_of(instr);
+		size_t bytes = 0, opcodes = 0;
+		switch(instr.op)
+		{
+		case ir_instr::_phi:
+			break;	// its operands are staged at the end of each branch, which are stack moves.
+		case ir_instr::_if: case ir_instr::_else: case ir_instr::_endif:
+			bytes = opcodes = 1;
+			break;
+		default:
+			if(instr.info && instr.info->body)
+			{
+				bytes = instr.info->body->size();
+				opcodetype opcode;
+				for(auto pc = instr.info->body->begin(); instr.info->body->GetOp(pc, opcode); )
+					opcodes++;
+			}
+			else
+				bytes = opcodes = 1;
+			for(uint32_t k = 0; k < instr.no_of_operands; k++)
+			{
+				if(fn.is_constant(args[k]))
+				{
+					bytes += push_size(fn.constant(args[k]));
+					opcodes++;
+				}
+			}
+			// Results that nothing used were dropped straight away.
+			for(uint16_t r = 0; r < instr.no_of_results; r++)
+			{
+				if(fn.no_of_uses(instr.result + r) == 0)
+				{
+					bytes++;
+					opcodes++;
+				}
+			}
+			break;
+		}
+		if(opcodes)
+			record(instr.stmt, bytes, opcodes);
+		instr.op = ir_instr::_nop;
+		removed = true;
+	}
+	return removed;
+}
+
+void dead_code_eliminator::record(uint32_t stmt, size_t bytes, size_t opcodes)
+{
+	if(savings.size() == located || savings.back().stmt != stmt)
+		savings.push_back({stmt});
+	savings.back().bytes += bytes;
+	savings.back().opcodes += opcodes;
+}
+
+string dead_code_eliminator::statistics() const
+{
+	// Statements on the same line are reported together.
+	map<size_t, pair<size_t, size_t>> lines;
+	size_t bytes = 0, opcodes = 0;
+	for(size_t k = 0; k < located; k++)
+	{
+		auto& line = lines[savings[k].line];
+		line.first += savings[k].bytes;
+		line.second += savings[k].opcodes;
+		bytes += savings[k].bytes;
+		opcodes += savings[k].opcodes;
+	}
+	stringstream s;
+	for(auto& [line, saved] : lines)
+		s << "\tline " << line + 1 << ": " << saved.first << " bytes, " << saved.second << " opcodes\n";
+	if(!lines.empty())
+		s << "\ttotal: " << bytes << " bytes, " << opcodes << " opcodes\n";
+	return s.str();
+}
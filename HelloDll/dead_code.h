@@ -0,0 +1,48 @@
+#pragma once
+// Copyright (c) Shaun O'Kane, 2010, 2018
+
+#include <string>
+#include <vector>
+#include "Internals.h"
+#include "ir.h"
+
+using namespace std;
+
+// Removes the instructions of an ir_function whose results are never used, i.e. dead stores, variables that are
+// never read and the code that only computes them. Ifs that are left with nothing to do go too.
+//
+// Only instructions without side effects are removed: operators, pure intrinsics and depth(). One that could fail at
+// run time, e.g. arithmetic on a value that might not be a number, or a division by one that might be zero, stays,
+// as removing it could make a script that fails succeed.
+class dead_code_eliminator
+{
+public:
+	// fn must have been analysed, and is left needing analyse() again if anything was removed. The values in
+	// live_out are used by a later chunk. big_integers tells its uintN operations apart. Returns whether anything
+	// was removed.
+	bool run(ir_function& fn, const class big_integer_lowering& big_integers, const vector<ir_value>& live_out = {});
+
+	// Works out the line of each statement with code removed since the last call. lines has line(streampoint),
+	// e.g. a line_table over the source, or the statement_reader while the statements are still in its window.
+	template<typename line_source> void locate(const stmt_table& stmts, const line_source& lines)
+	{
+		for(; located < savings.size(); located++)
+			savings[located].line = lines.line(stmts[savings[located].stmt].start);
+	}
+
+	void reset() { savings.clear(); located = 0; }
+	string statistics() const;	// the bytes and opcodes saved, by source line.
+
+private:
+	// What the removed code would have cost. Not counting the stack moves, which depend on the rest of the code.
+	struct saving
+	{
+		uint32_t stmt;
+		size_t line = 0;
+		size_t bytes = 0, opcodes = 0;
+	};
+	vector<saving> savings;		// in statement order.
+	size_t located = 0;			// savings[0, located) have their line.
+
+	void record(uint32_t stmt, size_t bytes, size_t opcodes);
+};
@@ -0,0 +1,106 @@
+#pragma once
+// Copyright (c) Shaun O'Kane, 2010, 2018
+
+#include <deque>
+#include <vector>
+#include "tokeniser.h"
+#include "script/script.h"
+
+// Describes a native function (intrinsic). The builtin ones are known at compile time and are found through the
+// token_kind the tokeniser's perfect hash has already assigned. User intrinsics are registered at run time.
+struct intrinsic
+{
+	string_view name;
+	token_kind kind;		// token_kind::_none for user intrinsics.
+	int no_of_args;			// -1 for a variable no. of args.
+	int no_of_results;		// values left on the stack.
+	opcodetype opcode;
+	uint16_t cost;			// rough relative execution cost.
+	bool is_void;			// can only be used as a statement. Any results are dropped.
+	bool is_pure;			// no side effects and the result only depends on the args.
+	const CScript* body = nullptr;	// user intrinsics expand to body instead of opcode.
+
+	constexpr int stack_effect() const { return no_of_results - no_of_args; }	// only meaningful if no_of_args >= 0.
+};
+
+// Indexed by token_kind - token_kind::_first_special_function.
+inline constexpr intrinsic builtin_intrinsics[] =
+{
+	// Special functions. These are void.
+	{"Verify", token_kind::_Verify, 1, 0, OP_VERIFY, 1, true, false},
+	{"CheckSequenceVerify", token_kind::_CheckSequenceVerify, 1, 1, OP_CHECKSEQUENCEVERIFY, 1, true, false},
+	{"CheckLocktimeVerify", token_kind::_CheckLocktimeVerify, 1, 1, OP_CHECKLOCKTIMEVERIFY, 1, true, false},
+	{"CheckSigVerify", token_kind::_CheckSigVerify, 2, 0, OP_CHECKSIGVERIFY, 1000, true, false},
+	{"CheckMultiSigVerify", token_kind::_CheckMultiSigVerify, -1, 0, OP_CHECKMULTISIGVERIFY, 1000, true, false},
+	{"Return", token_kind::_Return, 1, 0, OP_RETURN, 1, true, false},
+	// Crypto
+	{"RIPEMD160", token_kind::_RIPEMD160, 1, 1, OP_RIPEMD160, 20, false, true},
+	{"SHA1", token_kind::_SHA1, 1, 1, OP_SHA1, 20, false, true},
+	{"SHA256", token_kind::_SHA256, 1, 1, OP_SHA256, 25, false, true},
+	{"HASH160", token_kind::_HASH160, 1, 1, OP_HASH160, 45, false, true},
+	{"HASH256", token_kind::_HASH256, 1, 1, OP_HASH256, 50, false, true},
+	{"CheckSig", token_kind::_CheckSig, 2, 1, OP_CHECKSIG, 1000, false, true},
+	{"CheckMultiSig", token_kind::_CheckMultiSig, -1, 1, OP_CHECKMULTISIG, 1000, false, true},
+	// byte array. split returns 2 values. The other value is accessable as tos. TODO: revise.
+	{"split", token_kind::_split, 2, 2, OP_SPLIT, 2, false, true},
+	{"cat", token_kind::_cat, 2, 1, OP_CAT, 2, false, true},
+	{"xor", token_kind::_xor, 2, 1, OP_XOR, 2, false, true},
+	{"Bin2Num", token_kind::_Bin2Num, 1, 1, OP_BIN2NUM, 1, false, true},
+	{"Num2Bin", token_kind::_Num2Bin, 1, 1, OP_NUM2BIN, 1, false, true},
+	// numeric
+	{"abs", token_kind::_abs, 1, 1, OP_ABS, 1, false, true},
+	{"max", token_kind::_max, 2, 1, OP_MAX, 1, false, true},
+	{"min", token_kind::_min, 2, 1, OP_MIN, 1, false, true},
+	{"within", token_kind::_within, 3, 1, OP_WITHIN, 1, false, true},
+	// misc
+	{"depth", token_kind::_depth, 0, 1, OP_DEPTH, 1, false, false},
+	{"size", token_kind::_size, 1, 2, OP_SIZE, 1, false, true},	// OP_SIZE leaves its arg in place.
+};
+
+constexpr bool builtin_intrinsics_in_step()
+{
+	size_t first = size_t(token_kind::_first_special_function);
+	if(size(builtin_intrinsics) != size_t(token_kind::_last_native_function) + 1 - first)
+		return false;
+	for(size_t k = 0; k < size(builtin_intrinsics); k++)
+	{
+		const intrinsic& f = builtin_intrinsics[k];
+		if(size_t(f.kind) != first + k || spelling(f.kind) != f.name || f.is_void != is_special_function(f.kind))
+			return false;
+	}
+	return true;
+}
+static_assert(builtin_intrinsics_in_step(), "builtin_intrinsics out of step with token_kind");
+
+constexpr const intrinsic* builtin_intrinsic(token_kind kind)
+{
+	return (is_special_function(kind) || is_native_function(kind))
+		? &builtin_intrinsics[size_t(kind) - size_t(token_kind::_first_special_function)]
+		: nullptr;
+}
+
+// The builtin intrinsics plus any user intrinsics. Lookups never allocate.
+class intrinsic_registry
+{
+	deque<string> names;					// owns the names of user intrinsics.
+	deque<CScript> bodies;
+	deque<intrinsic> user_intrinsics;		// deque so that pointers stay valid as intrinsics are added.
+	vector<const intrinsic*> sorted;		// user intrinsics, sorted by name.
+	uint32_t changes = 0;
+
+	const intrinsic* find_user(string_view name) const;
+public:
+	// Registers an intrinsic that expands to body. Fails if name is already taken (by a keyword or another intrinsic).
+	bool add(string_view name, int no_of_args, int no_of_results, const CScript& body, uint16_t cost = 1, bool is_void = false, bool is_pure = true);
+	void clear_user_intrinsics();
+	uint32_t version() const { return changes; }	// changes whenever the user intrinsics do.
+
+	const intrinsic* find(const token& t) const
+	{
+		if(auto f = builtin_intrinsic(t.kind))
+			return f;
+		return (t.type == token::_name && t.kind == token_kind::_none) ? find_user(t.value) : nullptr;
+	}
+
+	const intrinsic* find(string_view name) const { return find(token(name, token::_name, keywords.find(name))); }
+};
@@ -0,0 +1,550 @@
+// Copyright (c) Shaun O'Kane, 2010, 2018
+#include "ir.h"
+#include "constant_folding.h"
+#include "intrinsics.h"
+#include "utilstrencodings.h"
+
+using namespace std;
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  ir_function
+//
+///////////////////////////////////////////////////////////////////////////////
+
+void ir_function::clear()
+{
+	instrs.clear(); values.clear(); operands.clear(); constants.clear();
+	blocks.clear(); block_of.clear(); matching.clear();
+	use_offsets.clear(); use_list.clear();
+}
+
+ir_value ir_function::add(ir_instr instr, const ir_value* args, size_t no_of_args, value_type type)
+{
+	instr.first_operand = uint32_t(operands.size());
+	instr.no_of_operands = uint32_t(no_of_args);
+	operands.insert(operands.end(), args, args + no_of_args);
+
+	vector<value_type> operand_types;
+	for(size_t k = 0; k < no_of_args; k++)
+		operand_types.push_back(values[args[k]].type);
+
+	uint32_t def = uint32_t(instrs.size());
+	instr.result = instr.no_of_results ? ir_value(values.size()) : no_value;
+	for(uint16_t r = 0; r < instr.no_of_results; r++)
+		values.push_back({def, r, type != _undefined ? type : result_type(instr.op, r, operand_types.data())});
+	instrs.push_back(instr);
+	return instr.result;
+}
+
+ir_value ir_function::add_constant(const valtype& v, value_type type, uint32_t stmt)
+{
+	ir_instr instr{ir_instr::_const};
+	instr.no_of_results = 1;
+	instr.stmt = stmt;
+	instr.data = uint32_t(constants.size());
+	constants.push_back(v);
+	return add(instr, nullptr, 0, type);
+}
+
+ir_value ir_function::add_input(value_type type, uint32_t stmt)
+{
+	ir_instr instr{ir_instr::_input};
+	instr.no_of_results = 1;
+	instr.stmt = stmt;
+	return add(instr, nullptr, 0, type);
+}
+
+void ir_function::replace_all_uses(ir_value from, ir_value to)
+{
+	for(auto& instr : instrs)
+	{
+		if(instr.op == ir_instr::_nop)
+			continue;
+		ir_value* args = operands_of(instr);
+		replace(args, args + instr.no_of_operands, from, to);
+	}
+}
+
+// A new block starts after each marker. The _if dominates everything up to its _endif, so the block after any of
+// the markers of an if is dominated by the block that holds the _if.
+void ir_function::analyse()
+{
+	blocks.clear();
+	block_of.assign(instrs.size(), 0);
+	matching.assign(instrs.size(), 0);
+
+	vector<uint32_t> open;		// the _if, then the _else, of each enclosing if.
+	vector<uint32_t> ifs;
+	blocks.push_back({0, 0, 0});
+	for(uint32_t i = 0; i < instrs.size(); i++)
+	{
+		block_of[i] = uint32_t(blocks.size() - 1);
+		const ir_instr& instr = instrs[i];
+		if(!instr.is_marker())
+			continue;
+
+		uint32_t if_instr = i;
+		switch(instr.op)
+		{
+		case ir_instr::_if:
+			ifs.push_back(i);
+			open.push_back(i);
+			break;
+		case ir_instr::_else:
+			if_instr = ifs.back();
+			matching[open.back()] = i;
+			open.back() = i;
+			break;
+		case ir_instr::_endif:
+			if_instr = ifs.back();
+			matching[open.back()] = i;
+			matching[i] = if_instr;
+			open.pop_back();
+			ifs.pop_back();
+			break;
+		}
+		blocks.back().last = i + 1;
+		blocks.push_back({i + 1, i + 1, block_of[if_instr]});
+	}
+	blocks.back().last = uint32_t(instrs.size());
+	assert(open.empty());
+
+	// Def-use chains, as compressed rows.
+	use_offsets.assign(values.size() + 1, 0);
+	for(auto& instr : instrs)
+	{
+		if(instr.op == ir_instr::_nop)
+			continue;
+		for(uint32_t k = 0; k < instr.no_of_operands; k++)
+			use_offsets[operands[instr.first_operand + k] + 1]++;
+	}
+	for(size_t v = 0; v < values.size(); v++)
+		use_offsets[v + 1] += use_offsets[v];
+	use_list.resize(use_offsets.back());
+	vector<uint32_t> next(use_offsets.begin(), use_offsets.end() - 1);
+	for(uint32_t i = 0; i < instrs.size(); i++)
+	{
+		const ir_instr& instr = instrs[i];
+		if(instr.op == ir_instr::_nop)
+			continue;
+		for(uint32_t k = 0; k < instr.no_of_operands; k++)
+			use_list[next[operands[instr.first_operand + k]]++] = i;
+	}
+}
+
+bool ir_function::dominates(uint32_t def_instr, uint32_t use_instr) const
+{
+	uint32_t b = block_of[use_instr], d = block_of[def_instr];
+	if(b == d)
+		return def_instr < use_instr;
+	while(b != d && b != blocks[b].idom)
+		b = blocks[b].idom;
+	return b == d;
+}
+
+static const char* ir_op_name(uint16_t op)
+{
+	switch(op)
+	{
+	case ir_instr::_const:	return "const";
+	case ir_instr::_input:	return "input";
+	case ir_instr::_extern:	return "extern";
+	case ir_instr::_phi:	return "phi";
+	case ir_instr::_if:		return "if";
+	case ir_instr::_else:	return "else";
+	case ir_instr::_endif:	return "endif";
+	case ir_instr::_assert:	return "assert";
+	case ir_instr::_depth:	return "depth";
+	case ir_instr::_return:	return "return";
+	case ir_instr::_exit:	return "exit";
+	case ir_instr::_nop:	return "nop";
+	default:				return GetOpName(opcodetype(op));
+	}
+}
+
+void ir_function::dump(ostream& out) const
+{
+	for(uint32_t i = 0; i < instrs.size(); i++)
+	{
+		const ir_instr& instr = instrs[i];
+		if(instr.op == ir_instr::_nop)
+			continue;
+		if(instr.op == ir_instr::_if || instr.op == ir_instr::_else || instr.op == ir_instr::_endif)
+			out << "b" << (blocks.empty() ? 0 : block_of[i]) << ":\t";
+		else
+			out << "\t";
+		for(uint16_t r = 0; r < instr.no_of_results; r++)
+			out << (r ? ", %" : "%") << instr.result + r;
+		if(instr.no_of_results)
+			out << " = ";
+		out << ir_op_name(instr.op);
+		if(instr.info && instr.info->body)
+			out << " " << instr.info->name;
+		if(instr.op == ir_instr::_const)
+			out << " 0x" << HexStr(constants[instr.data].begin(), constants[instr.data].end());
+		for(uint32_t k = 0; k < instr.no_of_operands; k++)
+			out << " %" << operands[instr.first_operand + k];
+		out << "\t; stmt " << instr.stmt << "\n";
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  ir_builder
+//
+///////////////////////////////////////////////////////////////////////////////
+
+ir_builder::ir_builder(const stmt_table& _stmts) : stmts(_stmts)
+{
+}
+
+ir_value ir_builder::pop()
+{
+	assert(!vstack.empty());
+	ir_value v = vstack.back();
+	vstack.pop_back();
+	return v;
+}
+
+void ir_builder::push_constant(const valtype& v, value_type type)
+{
+	vstack.push_back(fn.add_constant(v, type, current_stmt()));
+}
+
+void ir_builder::push_extern(uint32_t parameter)
+{
+	ir_instr instr{ir_instr::_extern};
+	instr.no_of_results = 1;
+	instr.stmt = current_stmt();
+	instr.data = parameter;
+	vstack.push_back(fn.add(instr, nullptr, 0, _hex));
+}
+
+void ir_builder::push_variable(const string& name)
+{
+	auto p = variables.find(name);
+	if(p == variables.end())
+		throw runtime_error("Uninitialised variable: '" + name + "'");
+	if(record_reads)
+		variables_read.push_back(name);
+	vstack.push_back(p->second);
+}
+
+// With nothing on the stack, tos is the item below, which stays there as the AST code generator's OP_DUP would leave
+// it. So it becomes the bottom of the stack the source sees, in any enclosing branches too.
+void ir_builder::push_tos()
+{
+	if(vstack.empty())
+	{
+		ir_value v = fn.add_input(_undefined, current_stmt());
+		stack_inputs.push_back(v);
+		vstack.push_back(v);
+		for(auto& b : branches)
+			b.vstack.insert(b.vstack.begin(), v);
+	}
+	vstack.push_back(vstack.back());
+}
+
+void ir_builder::assign(const string& name)
+{
+	ir_value v = pop();
+	auto p = variables.find(name);
+	if(p == variables.end())
+		variables.emplace(name, v);
+	else
+		p->second = v;
+}
+
+void ir_builder::apply(opcodetype opcode, size_t no_of_args, size_t no_of_results, const intrinsic* info)
+{
+	assert(no_of_args <= vstack.size());
+	vector<ir_value> args(vstack.end() - no_of_args, vstack.end());
+	vstack.resize(vstack.size() - no_of_args);
+
+	// Operators are pure. User intrinsics are left alone, the interpreter might not agree with evaluate_opcode().
+	bool is_pure = info ? (info->is_pure && !info->body) : true;
+	if(is_pure && all_of(args.begin(), args.end(), [this](ir_value v) { return fn.is_constant(v); }))
+	{
+		vector<valtype> stack;
+		vector<value_type> types;
+		for(auto v : args)
+		{
+			stack.push_back(fn.constant(v));
+			types.push_back(fn.values[v].type);
+		}
+		if(evaluate_opcode(opcode, stack) && stack.size() == no_of_results)
+		{
+			for(size_t k = 0; k < no_of_results; k++)
+				push_constant(stack[k], result_type(opcode, k, types.data()));
+			return;
+		}
+	}
+
+	ir_instr instr{uint16_t(opcode)};
+	instr.no_of_results = uint16_t(no_of_results);
+	instr.stmt = current_stmt();
+	instr.info = info;
+	ir_value result = fn.add(instr, args.data(), args.size());
+	for(size_t k = 0; k < no_of_results; k++)
+		vstack.push_back(ir_value(result + k));
+}
+
+void ir_builder::depth()
+{
+	ir_instr instr{ir_instr::_depth};
+	instr.no_of_results = 1;
+	instr.stmt = current_stmt();
+	instr.data = uint32_t(vstack.size());
+	vstack.push_back(fn.add(instr, nullptr, 0, _integer));
+}
+
+void ir_builder::discard(size_t no_of_results)
+{
+	assert(no_of_results <= vstack.size());
+	vstack.resize(vstack.size() - no_of_results);
+}
+
+void ir_builder::assert_true()
+{
+	ir_value cond = pop();
+	if(fn.is_constant(cond) && to_bool(fn.constant(cond)))
+		return;
+	ir_instr instr{ir_instr::_assert};
+	instr.stmt = current_stmt();
+	fn.add(instr, &cond, 1);
+}
+
+void ir_builder::return_data(size_t no_of_args)
+{
+	assert(no_of_args <= vstack.size());
+	vector<ir_value> args(vstack.end() - no_of_args, vstack.end());
+	vstack.resize(vstack.size() - no_of_args);
+	for(auto v : args)
+	{
+		if(!fn.is_constant(v))
+			throw runtime_error("The data for Return must be known at compile time.");
+	}
+	ir_instr instr{ir_instr::_return};
+	instr.stmt = current_stmt();
+	fn.add(instr, args.data(), args.size());
+}
+
+void ir_builder::marker(uint16_t op, ir_value cond)
+{
+	ir_instr instr{op};
+	instr.stmt = current_stmt();
+	fn.add(instr, &cond, cond == no_value ? 0 : 1);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  Branches
+//
+///////////////////////////////////////////////////////////////////////////////
+
+ir_builder::branch ir_builder::begin_if()
+{
+	ir_value cond = pop();
+	if(fn.is_constant(cond))
+		return to_bool(fn.constant(cond)) ? _then_branch : _else_branch;
+	marker(ir_instr::_if, cond);
+	branches.push_back({variables, vstack});
+	return _both_branches;
+}
+
+// The state at the end of the then branch is kept, and the else branch starts where the then branch did.
+void ir_builder::begin_else()
+{
+	marker(ir_instr::_else);
+	swap(variables, branches.back().variables);
+	swap(vstack, branches.back().vstack);
+}
+
+void ir_builder::end_if()
+{
+	branch_state& then_state = branches.back();
+	if(then_state.vstack.size() != vstack.size())
+		throw runtime_error("The branches of an if leave different numbers of values on the stack.");
+
+	// A variable that is only assigned in one branch has its default value in the other.
+	ir_value default_value = no_value;
+	auto value_in = [&](const map<string, ir_value, less<>>& vars, const string& name)
+	{
+		auto p = vars.find(name);
+		if(p != vars.end())
+			return p->second;
+		if(default_value == no_value)
+			default_value = fn.add_constant(valtype(), _integer, current_stmt());
+		return default_value;
+	};
+	vector<tuple<string, ir_value, ir_value>> merges;
+	for(auto& [name, v] : then_state.variables)
+		merges.emplace_back(name, v, value_in(variables, name));
+	for(auto& [name, v] : variables)
+	{
+		if(then_state.variables.find(name) == then_state.variables.end())
+			merges.emplace_back(name, value_in(then_state.variables, name), v);
+	}
+
+	marker(ir_instr::_endif);
+	for(size_t k = 0; k < vstack.size(); k++)
+		vstack[k] = phi(then_state.vstack[k], vstack[k]);
+	for(auto& [name, a, b] : merges)
+	{
+		if(record_reads && a != b)
+			variables_read.push_back(name);	// the value before the if, in the branch that didn't assign it.
+		variables[name] = phi(a, b);
+	}
+	branches.pop_back();
+}
+
+ir_value ir_builder::phi(ir_value a, ir_value b)
+{
+	if(a == b)
+		return a;
+	if(fn.is_constant(a) && fn.is_constant(b) && fn.constant(a) == fn.constant(b))
+		return a;
+	ir_instr instr{ir_instr::_phi};
+	instr.no_of_results = 1;
+	instr.stmt = current_stmt();
+	ir_value args[] = {a, b};
+	return fn.add(instr, args, 2);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  Chunks
+//
+///////////////////////////////////////////////////////////////////////////////
+
+void ir_builder::finish()
+{
+	ir_instr instr{ir_instr::_exit};
+	instr.stmt = no_stmt;
+	fn.add(instr, vstack.data(), vstack.size());
+}
+
+vector<ir_value> ir_builder::live_values() const
+{
+	vector<ir_value> live(vstack);
+	for(auto& [name, v] : variables)
+		live.push_back(v);
+	sort(live.begin(), live.end());
+	live.erase(unique(live.begin(), live.end()), live.end());
+	return live;
+}
+
+void ir_builder::rename(const vector<ir_value>& replacements)
+{
+	for(auto& [name, v] : variables)
+		v = replacements[v];
+	for(auto& v : vstack)
+		v = replacements[v];
+}
+
+void ir_builder::next_chunk(vector<ir_value>& stack)
+{
+	assert(branches.empty());
+	ir_function old = move(fn);
+	fn.clear();
+
+	uint32_t next_stmt = uint32_t(stmts.size());
+	first_stmt = next_stmt;
+	map<ir_value, ir_value> renumbered;
+	for(auto& v : stack)
+	{
+		auto p = renumbered.find(v);
+		if(p == renumbered.end())
+			p = renumbered.emplace(v, fn.add_input(old.values[v].type, next_stmt)).first;
+		v = p->second;
+	}
+	auto carry = [&](ir_value& v)
+	{
+		auto p = renumbered.find(v);
+		if(p == renumbered.end())
+		{
+			assert(old.is_constant(v));
+			ir_value c = fn.add_constant(old.constant(v), old.values[v].type, old.def(v).stmt);
+			p = renumbered.emplace(v, c).first;
+		}
+		v = p->second;
+	};
+	for(auto& [name, v] : variables)
+		carry(v);
+	for(auto& v : vstack)
+		carry(v);
+}
+
+void ir_builder::reset()
+{
+	fn.clear();
+	variables.clear();
+	vstack.clear();
+	stack_inputs.clear();
+	record_reads = false;
+	variables_read.clear();
+	branches.clear();
+	first_stmt = 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  Types
+//
+///////////////////////////////////////////////////////////////////////////////
+
+value_type result_type(uint16_t op, size_t result, const value_type* operand_types)
+{
+	switch(op)
+	{
+	case OP_ADD: case OP_SUB: case OP_MUL: case OP_DIV: case OP_MOD: case OP_NEGATE: case OP_ABS:
+	case OP_MIN: case OP_MAX: case OP_1ADD: case OP_1SUB: case OP_BIN2NUM: case OP_DEPTH: case ir_instr::_depth:
+		return _integer;
+	case OP_NOT: case OP_0NOTEQUAL: case OP_BOOLAND: case OP_BOOLOR: case OP_NUMEQUAL: case OP_NUMNOTEQUAL:
+	case OP_LESSTHAN: case OP_GREATERTHAN: case OP_LESSTHANOREQUAL: case OP_GREATERTHANOREQUAL: case OP_WITHIN:
+	case OP_EQUAL: case OP_CHECKSIG: case OP_CHECKMULTISIG:
+		return _bool;
+	case OP_RIPEMD160: case OP_SHA1: case OP_SHA256: case OP_HASH160: case OP_HASH256:
+	case OP_CAT: case OP_SPLIT: case OP_NUM2BIN: case OP_AND: case OP_OR: case OP_XOR:
+		return _hex;
+	case OP_SIZE:
+		return result == 0 ? operand_types[0] : _integer;
+	case ir_instr::_phi:
+		return operand_types[0] == operand_types[1] ? operand_types[0] : _undefined;
+	default:
+		return _undefined;
+	}
+}
+
+bool is_commutative(uint16_t op)
+{
+	switch(op)
+	{
+	case OP_ADD: case OP_MUL: case OP_MIN: case OP_MAX: case OP_BOOLAND: case OP_BOOLOR: case OP_NUMEQUAL:
+	case OP_NUMNOTEQUAL: case OP_EQUAL: case OP_AND: case OP_OR: case OP_XOR:
+		return true;
+	default:
+		return false;
+	}
+}
+
+uint16_t swapped_op(uint16_t op)
+{
+	switch(op)
+	{
+	case OP_LESSTHAN: return OP_GREATERTHAN;
+	case OP_GREATERTHAN: return OP_LESSTHAN;
+	case OP_LESSTHANOREQUAL: return OP_GREATERTHANOREQUAL;
+	case OP_GREATERTHANOREQUAL: return OP_LESSTHANOREQUAL;
+	default: return is_commutative(op) ? op : uint16_t(ir_instr::_nop);
+	}
+}
+
+size_t push_size(const valtype& v)
+{
+	size_t n = v.size();
+	if(n == 0 || (n == 1 && (v[0] == 0x81 || (v[0] >= 1 && v[0] <= 16))))
+		return 1;
+	return n + (n < OP_PUSHDATA1 ? 1 : n <= 0xff ? 2 : n <= 0xffff ? 3 : 5);
+}
@@ -0,0 +1,171 @@
+#pragma once
+// Copyright (c) Shaun O'Kane, 2010, 2018
+
+#include <map>
+#include <ostream>
+#include <string>
+#include <vector>
+#include "Internals.h"
+#include "tokeniser.h"
+
+using namespace std;
+
+// SSA intermediate representation, between the AST and the instruction pipeline. Used with OPTIMISER_ON.
+//
+// A function is a single list of instructions in script order. Control flow is structured: _if, _else and _endif
+// markers split the list into basic blocks, and the _phi instructions that follow an _endif merge the values that
+// differ between the branches. Each value is defined by exactly one instruction. Constants are values too, but only
+// reach the stack when an instruction uses them.
+
+typedef uint32_t ir_value;
+constexpr ir_value no_value = numeric_limits<ir_value>::max();
+constexpr uint32_t no_stmt = numeric_limits<uint32_t>::max();	// code that no statement generated.
+
+struct ir_instr
+{
+	// op is a script opcode, or one of these.
+	enum : uint16_t
+	{
+		_const = 0x100,	// data: index into constants.
+		_input,			// already on the stack when the function starts, i.e. carried over from an earlier chunk.
+		_extern,		// a placeholder for a script_template parameter. data: the parameter.
+		_phi,			// operands: the value from the then branch, then from the else branch.
+		_if,			// operands: the condition.
+		_else,
+		_endif,
+		_assert,		// operands: the condition. OP_NOTIF OP_NOP4 OP_ENDIF.
+		_depth,			// OP_DEPTH, less the values that the source can't see. data: the no. it can see.
+		_return,		// OP_RETURN followed by the operands, which must be constants.
+		_exit,			// operands: the values left on the stack at the end, bottom first. Has no_stmt.
+		_nop			// removed by an optimisation.
+	};
+
+	uint16_t op;
+	uint16_t no_of_results = 0;
+	uint32_t first_operand = 0, no_of_operands = 0;	// into ir_function::operands.
+	ir_value result = no_value;		// the first result. The results of an instruction are numbered consecutively.
+	uint32_t stmt = 0;				// generating statement.
+	uint32_t data = 0;
+	const struct intrinsic* info = nullptr;	// native functions.
+
+	bool is_marker() const { return op == _if || op == _else || op == _endif; }
+};
+
+struct ir_value_info
+{
+	uint32_t def;		// the defining instruction.
+	uint16_t result;	// which of its results.
+	value_type type;
+};
+
+struct ir_block
+{
+	uint32_t first, last;	// instrs [first, last).
+	uint32_t idom;			// immediate dominator. The entry block is its own.
+};
+
+class ir_function
+{
+public:
+	vector<ir_instr> instrs;
+	vector<ir_value_info> values;
+	vector<ir_value> operands;
+	vector<valtype> constants;
+
+	// Derived by analyse(). Invalidated by any change to the instructions.
+	vector<ir_block> blocks;
+	vector<uint32_t> block_of;		// instr -> block.
+	vector<uint32_t> matching;		// _if -> its _else or _endif, _else -> its _endif, _endif -> its _if.
+
+	void clear();
+	ir_value add(ir_instr instr, const ir_value* args, size_t no_of_args, value_type type = _undefined);
+	ir_value add_constant(const valtype& v, value_type type, uint32_t stmt);
+	ir_value add_input(value_type type, uint32_t stmt);
+
+	const ir_value* operands_of(const ir_instr& instr) const { return operands.data() + instr.first_operand; }
+	ir_value* operands_of(ir_instr& instr) { return operands.data() + instr.first_operand; }
+	const ir_instr& def(ir_value v) const { return instrs[values[v].def]; }
+	bool is_constant(ir_value v) const { return def(v).op == ir_instr::_const; }
+	const valtype& constant(ir_value v) const { return constants[def(v).data]; }
+
+	// Def-use chains. The instructions that use v, in order, once per operand.
+	pair<const uint32_t*, const uint32_t*> uses(ir_value v) const
+	{
+		return pair(use_list.data() + use_offsets[v], use_list.data() + use_offsets[v+1]);
+	}
+	size_t no_of_uses(ir_value v) const { return use_offsets[v+1] - use_offsets[v]; }
+	void replace_all_uses(ir_value from, ir_value to);
+
+	// Rebuilds the blocks, dominators and def-use chains.
+	void analyse();
+	bool dominates(uint32_t def_instr, uint32_t use_instr) const;
+
+	void dump(ostream& out) const;
+
+private:
+	vector<uint32_t> use_offsets, use_list;
+};
+
+// Lowers the AST into an ir_function, folding constants as it goes. The builder mirrors the stack the source sees,
+// as the AST code generator would leave it, so that tos, depth() and any results left on the stack keep their meaning.
+class ir_builder
+{
+public:
+	ir_function fn;
+	map<string, ir_value, less<>> variables;	// the current value of each variable.
+	vector<ir_value> vstack;	// the values the source can see on the stack, bottom first.
+	uint32_t first_stmt = 0;	// the first statement lowered into fn.
+	// _inputs for the items that were on the stack before the script, e.g. its unlocking data, read by tos when
+	// the source has nothing on the stack. Each is below all the others, and they are added to the bottom of the
+	// scheduler's stack, then cleared, when fn is scheduled.
+	vector<ir_value> stack_inputs;
+	// With record_reads, the variables whose values the lowering reads, e.g. while an imported module is lowered.
+	// See compiled_module::reads.
+	bool record_reads = false;
+	vector<string> variables_read;
+
+	ir_builder(const stmt_table& stmts);
+
+	void push_constant(const valtype& v, value_type type);
+	void push_extern(uint32_t parameter);
+	void push_variable(const string& name);
+	void push_tos();
+	void assign(const string& name);	// pops the value.
+
+	// Pops no_of_args operands and pushes the results. Folds builtins that have constant operands.
+	void apply(opcodetype opcode, size_t no_of_args, size_t no_of_results, const struct intrinsic* info = nullptr);
+	void depth();
+	void discard(size_t no_of_results);	// pops the results of a void function, which are dropped.
+	void assert_true();					// pops the condition.
+	void return_data(size_t no_of_args);
+
+	// The branch taken if the condition (popped) is a constant, otherwise an _if is added and both are lowered.
+	enum branch { _both_branches, _then_branch, _else_branch };
+	branch begin_if();
+	void begin_else();
+	void end_if();
+
+	void finish();			// the values the source left on the stack stay there.
+	vector<ir_value> live_values() const;	// at the end of a chunk, i.e. the variables and vstack.
+	void rename(const vector<ir_value>& replacements);	// after an optimisation has replaced values.
+	// Starts a new function for the next chunk. The values on the stack become _inputs, attributed to the chunk's
+	// first statement, and constants are copied. stack is renumbered to match.
+	void next_chunk(vector<ir_value>& stack);
+
+	void reset();
+
+private:
+	const stmt_table& stmts;
+	struct branch_state { map<string, ir_value, less<>> variables; vector<ir_value> vstack; };
+	vector<branch_state> branches;	// at the start of each enclosing if, then at the end of its then branch.
+
+	uint32_t current_stmt() const { return uint32_t(stmts.size() - 1); }
+	ir_value pop();
+	ir_value phi(ir_value a, ir_value b);
+	void marker(uint16_t op, ir_value cond = no_value);
+};
+
+value_type result_type(uint16_t op, size_t result, const value_type* operand_types);
+bool is_commutative(uint16_t op);	// the two operands of op can be swapped.
+uint16_t swapped_op(uint16_t op);	// gives the result of op with its two operands swapped, or _nop if none does.
+size_t push_size(const valtype& v);	// script bytes to push v, once the peephole optimiser has shrunk small ints.
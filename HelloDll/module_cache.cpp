@@ -0,0 +1,440 @@
+// Copyright (c) Shaun O'Kane, 2010, 2018
+#include "module_cache.h"
+#include "big_integer.h"
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <sstream>
+#include <thread>
+
+using namespace std;
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  compiled_module
+//
+///////////////////////////////////////////////////////////////////////////////
+
+// The file is a header, "HLLM" and the format version, then the fields in the order declared, then the hash of all
+// that. Integers are little endian, and strings, byte arrays and vectors are preceded by their size.
+static const char magic[4] = {'H', 'L', 'L', 'M'};
+
+static void put(string& out, uint64_t n, size_t size)
+{
+	for(size_t k = 0; k < size; k++)
+		out.push_back(char(n >> (8 * k)));
+}
+
+static void put(string& out, string_view bytes)
+{
+	put(out, bytes.size(), 4);
+	out.append(bytes);
+}
+
+static void put(string& out, const valtype& bytes) { put(out, string_view((const char*)bytes.data(), bytes.size())); }
+static void put(string& out, const inferred_type& type)
+{
+	put(out, type.kind, 1);
+	put(out, type.width, 4);
+	put(out, type.is_uint, 1);
+}
+
+// Reads what put() wrote. After reading past the end, or a size that can't be right, ok is false.
+struct module_reader
+{
+	string_view in;
+	bool ok = true;
+
+	uint64_t get(size_t size)
+	{
+		if(in.size() < size)
+		{
+			ok = false;
+			return 0;
+		}
+		uint64_t n = 0;
+		for(size_t k = 0; k < size; k++)
+			n |= uint64_t(uint8_t(in[k])) << (8 * k);
+		in.remove_prefix(size);
+		return n;
+	}
+
+	size_t count()
+	{
+		size_t n = get(4);
+		ok = ok && n <= in.size();	// everything takes at least a byte.
+		return ok ? n : 0;
+	}
+
+	string_view bytes()
+	{
+		size_t n = count();
+		string_view s = in.substr(0, n);
+		in.remove_prefix(n);
+		return s;
+	}
+
+	valtype data() { auto s = bytes(); return valtype(s.begin(), s.end()); }
+	inferred_type type()
+	{
+		inferred_type t;
+		t.kind = value_type(get(1));
+		t.width = uint32_t(get(4));
+		t.is_uint = get(1) != 0;
+		return t;
+	}
+};
+
+string compiled_module::serialise() const
+{
+	string out(magic, sizeof(magic));
+	put(out, module_cache::format_version, 4);
+	put(out, text);
+	put(out, state, 8);
+	put(out, imports.size(), 4);
+	for(auto& [path, hash] : imports)
+	{
+		put(out, path);
+		put(out, hash, 8);
+	}
+
+	put(out, variables.size(), 4);
+	for(auto& name : variables)
+		put(out, name);
+	put(out, types.size(), 4);
+	for(auto& [name, type] : types)
+	{
+		put(out, name);
+		put(out, type);
+	}
+	put(out, big_variables.size(), 4);
+	for(auto& [name, size] : big_variables)
+	{
+		put(out, name);
+		put(out, size, 4);
+	}
+	put(out, template_parameters.size(), 4);
+	for(auto& p : template_parameters)
+	{
+		put(out, p.name);
+		put(out, p.size, 4);
+	}
+
+	put(out, string_view((const char*)code.data(), code.size()));
+	put(out, placeholders.size(), 4);
+	for(auto [k, p] : placeholders)
+	{
+		put(out, k, 4);
+		put(out, p, 4);
+	}
+
+	put(out, first_instr, 4);
+	put(out, first_value, 4);
+	put(out, first_operand, 4);
+	put(out, first_constant, 4);
+	put(out, reads.size(), 4);
+	for(auto& name : reads)
+		put(out, name);
+	put(out, reads_hash, 8);
+	put(out, inputs.size(), 4);
+	for(auto& input : inputs)
+	{
+		put(out, input.value, 4);
+		put(out, input.variable);
+		put(out, input.stack_index, 4);
+	}
+	put(out, instrs.size(), 4);
+	for(size_t k = 0; k < instrs.size(); k++)
+	{
+		auto& instr = instrs[k];
+		put(out, instr.op, 2);
+		put(out, instr.no_of_results, 2);
+		put(out, instr.first_operand, 4);
+		put(out, instr.no_of_operands, 4);
+		put(out, instr.result, 4);
+		put(out, instr.data, 4);
+		put(out, uint8_t(infos[k].kind), 1);
+		put(out, uint8_t(infos[k].big_op), 1);
+		put(out, infos[k].big_size, 4);
+	}
+	put(out, values.size(), 4);
+	for(auto& v : values)
+	{
+		put(out, v.def, 4);
+		put(out, v.result, 2);
+		put(out, v.type, 1);
+	}
+	put(out, operands.size(), 4);
+	for(auto v : operands)
+		put(out, v, 4);
+	put(out, constants.size(), 4);
+	for(auto& c : constants)
+		put(out, c);
+	put(out, ir_variables.size(), 4);
+	for(auto& [name, v] : ir_variables)
+	{
+		put(out, name);
+		put(out, v, 4);
+	}
+	put(out, vstack.size(), 4);
+	for(auto v : vstack)
+		put(out, v, 4);
+	put(out, statement_cache::hash(out), 8);
+	return out;
+}
+
+bool compiled_module::deserialise(string_view bytes)
+{
+	if(bytes.size() < sizeof(magic) + 8 || bytes.substr(0, sizeof(magic)) != string_view(magic, sizeof(magic)))
+		return false;
+	module_reader check {bytes.substr(bytes.size() - 8)};
+	bytes.remove_suffix(8);
+	if(check.get(8) != statement_cache::hash(bytes))
+		return false;	// e.g. a file damaged on disk, which could still be well formed.
+	module_reader in {bytes.substr(sizeof(magic))};
+	if(in.get(4) != module_cache::format_version)
+		return false;
+	text = in.bytes();
+	state = in.get(8);
+	imports.resize(in.count());
+	for(auto& [path, hash] : imports)
+	{
+		path = in.bytes();
+		hash = in.get(8);
+	}
+
+	variables.resize(in.count());
+	for(auto& name : variables)
+		name = in.bytes();
+	types.resize(in.count());
+	for(auto& [name, type] : types)
+	{
+		name = in.bytes();
+		type = in.type();
+	}
+	big_variables.resize(in.count());
+	for(auto& [name, size] : big_variables)
+	{
+		name = in.bytes();
+		size = in.get(4);
+	}
+	template_parameters.resize(in.count());
+	for(auto& p : template_parameters)
+	{
+		p.name = in.bytes();
+		p.size = in.get(4);
+	}
+
+	auto script = in.bytes();
+	code = CScript((const uint8_t*)script.data(), (const uint8_t*)script.data() + script.size());
+	placeholders.resize(in.count());
+	for(auto& [k, p] : placeholders)
+	{
+		k = uint32_t(in.get(4));
+		p = uint32_t(in.get(4));
+	}
+
+	first_instr = uint32_t(in.get(4));
+	first_value = uint32_t(in.get(4));
+	first_operand = uint32_t(in.get(4));
+	first_constant = uint32_t(in.get(4));
+	reads.resize(in.count());
+	for(auto& name : reads)
+		name = in.bytes();
+	reads_hash = in.get(8);
+	inputs.resize(in.count());
+	for(auto& input : inputs)
+	{
+		input.value = ir_value(in.get(4));
+		input.variable = in.bytes();
+		input.stack_index = uint32_t(in.get(4));
+	}
+	instrs.resize(in.count());
+	infos.resize(instrs.size());
+	for(size_t k = 0; k < instrs.size(); k++)
+	{
+		auto& instr = instrs[k];
+		instr.op = uint16_t(in.get(2));
+		instr.no_of_results = uint16_t(in.get(2));
+		instr.first_operand = uint32_t(in.get(4));
+		instr.no_of_operands = uint32_t(in.get(4));
+		instr.result = ir_value(in.get(4));
+		instr.data = uint32_t(in.get(4));
+		infos[k].kind = token_kind(in.get(1));
+		infos[k].big_op = token_kind(in.get(1));
+		infos[k].big_size = uint32_t(in.get(4));
+	}
+	values.resize(in.count());
+	for(auto& v : values)
+	{
+		v.def = uint32_t(in.get(4));
+		v.result = uint16_t(in.get(2));
+		v.type = value_type(in.get(1));
+	}
+	operands.resize(in.count());
+	for(auto& v : operands)
+		v = ir_value(in.get(4));
+	constants.resize(in.count());
+	for(auto& c : constants)
+		c = in.data();
+	ir_variables.resize(in.count());
+	for(auto& [name, v] : ir_variables)
+	{
+		name = in.bytes();
+		v = ir_value(in.get(4));
+	}
+	vstack.resize(in.count());
+	for(auto& v : vstack)
+		v = ir_value(in.get(4));
+	return in.ok && in.in.empty() && is_well_formed();
+}
+
+// Against the function the module was lowered into, i.e. its sizes before plus the module's own. Linking shifts the
+// module's indices to follow the function it is linked into, and maps its inputs, so they stay in range. The
+// template parameters, which are only known then, are left to link_module().
+bool compiled_module::is_well_formed() const
+{
+	auto is_input = [&](ir_value v)
+	{
+		return any_of(inputs.begin(), inputs.end(), [&](const input& i) { return i.value == v; });
+	};
+	for(auto& i : inputs)
+		if(i.value >= first_value)
+			return false;
+	for(auto& [name, type] : types)
+		if(type.kind > _bool)
+			return false;
+	opcodetype op;
+	for(auto p = code.begin(); p < code.end(); )
+		if(!code.GetOp(p, op))
+			return false;
+	for(size_t k = 0; k < placeholders.size(); k++)
+		if(k > 0 && placeholders[k].first <= placeholders[k - 1].first)
+			return false;
+
+	uint64_t no_of_instrs = uint64_t(first_instr) + instrs.size(), no_of_values = uint64_t(first_value) + values.size();
+	uint64_t no_of_operands = uint64_t(first_operand) + operands.size();
+	uint64_t no_of_constants = uint64_t(first_constant) + constants.size();
+	if(infos.size() != instrs.size() || max({no_of_instrs, no_of_values, no_of_operands, no_of_constants}) >= no_value)
+		return false;
+	int depth = 0;	// of nested ifs.
+	for(size_t k = 0; k < instrs.size(); k++)
+	{
+		const ir_instr& instr = instrs[k];
+		if(instr.op > 0xff && (instr.op < ir_instr::_const || instr.op > ir_instr::_nop))
+			return false;
+		if(instr.first_operand < first_operand || instr.first_operand + uint64_t(instr.no_of_operands) > no_of_operands)
+			return false;
+		for(uint32_t j = 0; j < instr.no_of_operands; j++)	// defined before they are used.
+		{
+			ir_value v = operands[instr.first_operand - first_operand + j];
+			if(v < first_value ? !is_input(v) : v >= no_of_values || values[v - first_value].def >= first_instr + k)
+				return false;
+		}
+		if(instr.no_of_results && (instr.result < first_value || instr.result + uint64_t(instr.no_of_results) > no_of_values))
+			return false;
+		if(instr.op == ir_instr::_const && instr.data >= no_of_constants)
+			return false;
+		if(instr.op == ir_instr::_if)
+			depth++;
+		else if((instr.op == ir_instr::_else || instr.op == ir_instr::_endif) && depth == 0)
+			return false;
+		else if(instr.op == ir_instr::_endif)
+			depth--;
+
+		auto& ref = infos[k];
+		if(ref.kind != token_kind::_none && !builtin_intrinsic(ref.kind))
+			return false;
+		if(ref.big_op != token_kind::_none && (!big_integer_lowering::is_supported(ref.big_op) || ref.big_size < 8
+			|| ref.big_size > 64 || (ref.big_size & (ref.big_size - 1))))
+			return false;
+	}
+	if(depth != 0)
+		return false;
+	for(size_t k = 0; k < values.size(); k++)
+	{
+		const ir_value_info& v = values[k];
+		if(v.def < first_instr || v.def >= no_of_instrs || v.type > _bool)
+			return false;
+		const ir_instr& def = instrs[v.def - first_instr];
+		if(v.result >= def.no_of_results || def.result + v.result != first_value + k)
+			return false;
+	}
+	for(auto v : operands)
+		if(v < first_value ? !is_input(v) : v >= no_of_values)
+			return false;
+	for(auto& [name, v] : ir_variables)
+		if(v < first_value ? !is_input(v) : v >= no_of_values)
+			return false;
+	for(auto v : vstack)
+		if(v < first_value ? !is_input(v) : v >= no_of_values)
+			return false;
+	return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  module_cache
+//
+///////////////////////////////////////////////////////////////////////////////
+
+string module_cache::file_name(const string& path, uint64_t text_hash, uint64_t state)
+{
+	filesystem::path p(path);
+	uint64_t key = statement_cache::hash(to_string(text_hash) + ' ' + to_string(state));
+	char hex[17];
+	snprintf(hex, sizeof(hex), "%016llx", (unsigned long long)key);
+	return (p.parent_path() / ".hll_cache" / (p.filename().string() + "." + hex + ".hllm")).string();
+}
+
+const compiled_module* module_cache::find(const string& path, string_view text, uint64_t state)
+{
+	auto key = pair(statement_cache::hash(text), state);
+	auto p = modules.find(key);
+	if(p == modules.end() && use_disk)
+	{
+		ifstream f(file_name(path, key.first, key.second), ios::in | ios::binary);
+		compiled_module m;
+		if(f.is_open() && m.deserialise(string(istreambuf_iterator<char>(f), {})))
+			p = modules.insert_or_assign(key, move(m)).first;
+	}
+	if(p == modules.end() || p->second.text != text || p->second.state != state)
+		return nullptr;
+	return &p->second;
+}
+
+void module_cache::add(const string& path, compiled_module&& module)
+{
+	auto key = pair(statement_cache::hash(module.text), module.state);
+	auto& m = modules.insert_or_assign(key, move(module)).first->second;
+	if(!use_disk)
+		return;
+
+	// Written under a name of its own, then renamed, so that a compiler reading it never sees part of a file.
+	error_code ec;
+	filesystem::path name = file_name(path, key.first, key.second);
+	filesystem::create_directories(name.parent_path(), ec);
+	stringstream unique;
+	unique << hash<thread::id>()(this_thread::get_id()) << '.' << chrono::steady_clock::now().time_since_epoch().count();
+	filesystem::path temp = name.string() + "." + unique.str() + ".tmp";
+	{
+		ofstream f(temp, ios::out | ios::binary);
+		string bytes = m.serialise();
+		if(!f.is_open() || !f.write(bytes.data(), bytes.size()))
+			ec = make_error_code(errc::io_error);
+	}
+	if(!ec)
+		filesystem::rename(temp, name, ec);
+	if(ec)
+		filesystem::remove(temp, ec);
+}
+
+string module_cache::statistics() const
+{
+	if(linked + compiled == 0)
+		return string();
+	stringstream s;
+	s << "\tlinked from the cache: " << linked << "\n\tcompiled: " << compiled << "\n";
+	return s.str();
+}
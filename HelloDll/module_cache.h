@@ -0,0 +1,96 @@
+#pragma once
+// Copyright (c) Shaun O'Kane, 2010, 2018
+
+#include <map>
+#include <string>
+#include <vector>
+#include "Internals.h"
+#include "ir.h"
+#include "statement_cache.h"
+
+using namespace std;
+
+// A module, compiled for the state that the compiler was in when its import was reached: what linking it adds to
+// that state. Linking it into any compilation that reaches an import of the same text in the same state has the
+// same effect as compiling it there, without parsing, checking or lowering it again.
+struct compiled_module : state_delta
+{
+	string text;	// the source, to tell apart modules with the same hash.
+	uint64_t state = 0;	// the compiler's, before the module.
+	// The modules it imports, directly or not, and the hashes of their text. It is stale if any has changed.
+	vector<pair<string, uint64_t>> imports;
+
+	// Without OPTIMISER_ON, the code, and the template parameter pushed by each placeholder.
+	CScript code;
+	vector<pair<uint32_t, uint32_t>> placeholders;	// (instruction, parameter).
+
+	// With OPTIMISER_ON, the IR it was lowered to, with its constants folded. It is appended to the function so far,
+	// renumbered to follow it, and optimised and scheduled together with the code around it, so that e.g. dead code
+	// in a library is removed. Besides the state, the IR depends on the values before it that it reads, so they
+	// are checked before it is linked: see reads.
+	struct intrinsic_ref
+	{
+		token_kind kind = token_kind::_none;	// a builtin, or
+		token_kind big_op = token_kind::_none;	// a uintN operation on big_size bytes. See big_integer_lowering.
+		uint32_t big_size = 0;
+	};
+	uint32_t first_instr = 0, first_value = 0, first_operand = 0, first_constant = 0;	// the function's sizes before.
+	// The variables it read the values of. Those values, and the ones the source could see on the stack, are what
+	// folding, and the phis of its ifs, depended on: whether each is a constant, and which, or else its type and
+	// which of the others it is the same value as. reads_hash is of that, before the module.
+	vector<string> reads;
+	uint64_t reads_hash = 0;
+	// The values before it that its IR refers to, and where each was found: in a variable, or if that is empty, in
+	// vstack. Linking refers to whatever value is there instead.
+	struct input
+	{
+		ir_value value = 0;
+		string variable;
+		uint32_t stack_index = 0;
+	};
+	vector<input> inputs;
+	vector<ir_instr> instrs;		// info is null, and stmt is the import.
+	vector<intrinsic_ref> infos;	// the info of each of instrs.
+	vector<ir_value_info> values;
+	vector<ir_value> operands;
+	vector<valtype> constants;
+	vector<pair<string, ir_value>> ir_variables;	// only those it assigned.
+	vector<ir_value> vstack;		// the values the source can see on the stack after it.
+
+	string serialise() const;
+	bool deserialise(string_view bytes);	// false if bytes aren't a compiled module in this format.
+	// Whether every index in the module is in range, and every kind is one this compiler knows, so that a corrupt
+	// or foreign file is compiled again rather than linked.
+	bool is_well_formed() const;
+};
+
+// The modules compiled so far, by their text and the state they were compiled for. With use_disk, each is also
+// written to .hll_cache/<file name>.<hash>.hllm, next to the module, so that later compilations, e.g. of other
+// contracts that import the same library at their start, only link it. With OPTIMISER_ON, one is only linked if the
+// values it reads are as they were when it was compiled. Only the latest is kept for a given text and state. The files are written whole and renamed into place, so any
+// no. of compilers can share them. Any that can't be read or written are ignored, as the module can always be
+// compiled again.
+class module_cache
+{
+public:
+	// Bumped whenever the compiled code or IR for a given source can change, which makes the files on disk stale.
+	static constexpr uint32_t format_version = 3;
+
+	bool use_disk = false;	// MODULE_CACHE_ON_DISK.
+
+	const compiled_module* find(const string& path, string_view text, uint64_t state);	// nullptr if not cached.
+	void add(const string& path, compiled_module&& module);
+
+	void clear() { modules.clear(); }
+	void reset() { linked = compiled = 0; }
+	void count_linked() { linked++; }
+	void count_compiled() { compiled++; }
+
+	string statistics() const;	// modules linked and compiled since reset().
+
+private:
+	map<pair<uint64_t, uint64_t>, compiled_module> modules;	// (hash of the text, state) ->
+	size_t linked = 0, compiled = 0;
+
+	static string file_name(const string& path, uint64_t text_hash, uint64_t state);
+};
@@ -4,45 +4,32 @@
 
 ///////////////////////////////////////////////////////////////////////////////
 //
-// function_info tables
+// intrinsic_registry
 //
 ///////////////////////////////////////////////////////////////////////////////
 
-// These are void functions.
-const function_info_table_type special_functions =
+static bool by_name(const intrinsic* f, string_view name) { return f->name < name; }
+
+const intrinsic* intrinsic_registry::find_user(string_view name) const
+{
+	auto p = lower_bound(sorted.begin(), sorted.end(), name, by_name);
+	return (p != sorted.end() && (*p)->name == name) ? *p : nullptr;
+}
+
+bool intrinsic_registry::add(string_view name, int no_of_args, int no_of_results, const CScript& body, uint16_t cost, bool is_void, bool is_pure)
 {
-	{"Verify", {1, OP_VERIFY}},
-	{"CheckSequenceVerify", {1, OP_CHECKSEQUENCEVERIFY}},
-	{"CheckLocktimeVerify", {1, OP_CHECKLOCKTIMEVERIFY}},
-	{"CheckSigVerify", {2, OP_CHECKSIGVERIFY}},
-	{"CheckMultiSigVerify", {-1, OP_CHECKMULTISIGVERIFY}},
-	{"Return", {1, OP_RETURN}}
-};
+	if(name.empty() || keywords.find(name) != token_kind::_none || find_user(name) != nullptr)
+		return false;
+	names.emplace_back(name);
+	bodies.push_back(body);
+	user_intrinsics.push_back({names.back(), token_kind::_none, no_of_args, no_of_results, OP_INVALIDOPCODE, cost, is_void, is_pure, &bodies.back()});
+	sorted.insert(lower_bound(sorted.begin(), sorted.end(), name, by_name), &user_intrinsics.back());
+	changes++;
+	return true;
+}
 
-// These return a single value (except split - which returns 2 values. The other value is accessable as tos).
-// Treatment of split not good. TODO: revise.
-const function_info_table_type native_functions =
+void intrinsic_registry::clear_user_intrinsics()
 {
-	// Crypto
-	{"RIPEMD160", {1, OP_RIPEMD160}},
-	{"SHA1", {1, OP_SHA1}},
-	{"SHA256", {1, OP_SHA256}},
-	{"HASH160", {1, OP_HASH160}},
-	{"HASH256", {1, OP_HASH256}},
-	{"CheckSig", {2, OP_CHECKSIG}},
-	{"CheckMultiSig", {-1, OP_CHECKMULTISIG}},
-	// byte array
-	{"split", {2, OP_SPLIT}},
-	{"cat", {2, OP_CAT}},
-	{"xor", {2, OP_XOR}},
-	{"Bin2Num", {1, OP_BIN2NUM}},
-	{"Num2Bin", {1, OP_NUM2BIN}},
-	// numeric
-	{"abs", {1, OP_ABS}},
-	{"max", {2, OP_MAX}},
-	{"min", {2, OP_MIN}},
-	{"within", {3, OP_WITHIN}},
-	// misc
-	{"depth", {0, OP_DEPTH}},
-	{"size", {1, OP_SIZE}},
-};
+	sorted.clear(); user_intrinsics.clear(); bodies.clear(); names.clear();
+	changes++;
+}
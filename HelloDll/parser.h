@@ -2,19 +2,14 @@
 // Copyright (c) Shaun O'Kane, 2010, 2018
 
 #include "AST.h"
-#include <unordered_map>
-
-struct function_info
-{
-	int no_of_args; opcodetype opcode;
-};
-typedef unordered_map<string, function_info> function_info_table_type;
-
-extern const function_info_table_type special_functions;
-extern const function_info_table_type native_functions;
+#include "intrinsics.h"
+#include <charconv>
 
 class Hello_parser : public tokeniser
 {
+	arena& nodes;
+	const intrinsic_registry& intrinsics;
+	vector<AST_node_ptr> pending_items;  // scratch stack for building sequences without per-block allocations.
 	vector<streampoint> streampoints;
 	streampoint declare_streampoint() 
 	{ 
@@ -22,42 +17,70 @@ class Hello_parser : public tokeniser
 		streampoints.push_back(cp); 
 		return cp; 
 	}
+
+	template<typename T, typename... Args> T* make(Args&&... args) { return nodes.make<T>(forward<Args>(args)...); }
+
+	// Moves pending_items[first..] into a flat sequence in the arena.
+	sequence* make_sequence(size_t first)
+	{
+		size_t n = pending_items.size() - first;
+		auto seq = make<sequence>(nodes.copy(pending_items.data() + first, n), n);
+		pending_items.resize(first);
+		return seq;
+	}
+
+	int to_int(const token& t) const
+	{
+		int n = 0;
+		from_chars(t.value.data(), t.value.data() + t.value.size(), n);
+		return n;
+	}
 public:
 	AST_node_ptr eat_value()
 	{
 		const token t = peek();
 		if (t.type == token::_integer || t.type == token::_hex)
 			eat(t);
-		return make_shared<const_node>(t.value, value_type((int)t.type));
+		return make<const_node>(string(t.value), value_type((int)t.type));
 	}
 
 	//////////////////////// Native Functions ///////////////////////
 	
-	bool is_special_function(const token& t) { return special_functions.find(t.value) != special_functions.end(); }
-	bool is_native_function(const token& t) { return native_functions.find(t.value) != native_functions.end(); }
+	bool is_special_function(const token& t) { auto f = intrinsics.find(t); return f && f->is_void; }
+	bool is_native_function(const token& t) { auto f = intrinsics.find(t); return f && !f->is_void; }
 
-	AST_node_ptr eat_native_function(function_info_table_type function_info_table)
+	// An expression, or a comparison (e.g. Verify(x == y)).
+	AST_node_ptr eat_argument()
+	{
+		auto v = eat_expression();
+		token_kind op = peek().kind;
+		if(!is_comparison(op))
+			return v;
+		eat();
+		return make<binary_op>(op, v, eat_expression());
+	}
+
+	native_function* eat_native_function()
 	{
 		const token t = eat_name();
-		auto p = function_info_table.find(t.value);
-		assert(p != function_info_table.end());
-		size_t no_of_args = (size_t)p->second.no_of_args;
-		opcodetype opcode = p->second.opcode;
-
-		auto func = make_shared<native_function>(t.value, opcode);
-		auto args = make_shared<sequence>();
-		eat("(");
+		const intrinsic* info = intrinsics.find(t);
+		assert(info != nullptr);
+		size_t no_of_args = (size_t)info->no_of_args;
+
+		auto func = make<native_function>(*info);
+		size_t first = pending_items.size();
+		eat(token_kind::_lparen);
 		for(size_t i=0; i<no_of_args; i++)
 		{
-			if(peek() == ")" && no_of_args == ((size_t)-1))  // handle variable args case.
+			if(peek() == token_kind::_rparen && no_of_args == ((size_t)-1))  // handle variable args case.
 				break;
 			// process arg.
 			if(i != 0)
-				eat(",");
-			args->append(eat_expression());
+				eat(token_kind::_comma);
+			pending_items.push_back(eat_argument());
 		}
-		eat(")");
-		func->args = args;
+		eat(token_kind::_rparen);
+		func->args = make_sequence(first);
 		return func;
 	}
 	/////////////////// End of Native Functions /////////////////////
@@ -67,25 +90,26 @@ public:
 	AST_node_ptr eat_factor()
 	{
 		const token t = peek();
-		if (t == "(")
+		if (t == token_kind::_lparen)
 		{
-			eat("(");
+			eat(token_kind::_lparen);
 			auto expr = eat_expression(); 
-			eat(")");
+			eat(token_kind::_rparen);
 			return expr;
 		}
-		else if (t == "-") 
+		else if (t == token_kind::_minus) 
 		{
-			eat("-"); 
-			return make_shared<unary_op>("-", eat_factor());
+			eat(token_kind::_minus); 
+			return make<unary_op>(token_kind::_minus, eat_factor());
 		} 
-		else if(is_native_function(t.value))
+		else if(is_native_function(t))
 		{
-			return eat_native_function(native_functions);
+			return eat_native_function();
 		}
 		else if (t.type == token::_name || t.type == token::_extern)
 		{
-			return make_shared<rvalue_node>(eat_name().value, t.type == token::_extern);
+			eat();
+			return make<rvalue_node>(string(t.value), t.type == token::_extern);
 		}
 		else
 			return eat_value();
@@ -95,11 +119,11 @@ public:
 	{
 		auto a = eat_factor();
 		AST_node_ptr p = a;
-		for (string op = peek().value; op == "*" || op == "/" || op == "%" || op == "||"; op = peek().value)
+		for (token_kind op = peek().kind; op == token_kind::_star || op == token_kind::_slash || op == token_kind::_percent || op == token_kind::_concat; op = peek().kind)
 		{
-			eat(op);
+			eat();
 			auto f = eat_factor();
-			p = make_shared<binary_op>(op, p, f);
+			p = make<binary_op>(op, p, f);
 		}
 		return p;
 	}
@@ -108,11 +132,11 @@ public:
 	{
 		auto a = eat_term();		
 		AST_node_ptr p = a;
-		for (string op = peek().value; op == "+" || op == "-"; op = peek().value)
+		for (token_kind op = peek().kind; op == token_kind::_plus || op == token_kind::_minus; op = peek().kind)
 		{
-			eat(op);
+			eat();
 			auto b = eat_term();
-			p = make_shared<binary_op>(op, p, b);
+			p = make<binary_op>(op, p, b);
 		}
 		return p;
 	}
@@ -142,11 +166,11 @@ public:
 	{
 		auto a = eat_logical_value();
 		AST_node_ptr p = a;
-		for (string op = peek().value; op == "or" || op == "and"; op = peek().value)
+		for (token_kind op = peek().kind; op == token_kind::_or || op == token_kind::_and; op = peek().kind)
 		{
-			eat(op);
+			eat();
 			auto b =  eat_logical_value();
-			return make_shared<binary_op>(op, p, b);
+			return make<binary_op>(op, p, b);
 		}
 		return p;
 	}
@@ -154,18 +178,18 @@ public:
 	AST_node_ptr eat_logical_value()
 	{
 		const token t = peek();
-		if (t == "(")	
+		if (t == token_kind::_lparen)	
 		{
-			eat("("); 
+			eat(token_kind::_lparen); 
 			auto v = eat_logical_expression(); 
-			eat(")");
+			eat(token_kind::_rparen);
 			return v;
 		}
-		else if (t == "!") 
+		else if (t == token_kind::_not) 
 		{
-			eat("!"); 
+			eat(token_kind::_not); 
 			auto v = eat_logical_value();
-			return make_shared<unary_op>("!", v);
+			return make<unary_op>(token_kind::_not, v);
 		}
 		else
 			return eat_comparison();
@@ -174,107 +198,180 @@ public:
 	AST_node_ptr eat_comparison()
 	{
 		auto v = eat_expression();
-		string comps[]{ "<", "<=", "==", "!=", ">=", ">" };
-		auto op = find(begin(comps), end(comps), peek().value);
-		if(op == end(comps))
+		token_kind op = peek().kind;
+		if(!is_comparison(op))
 		{
 			stringstream ss; ss << "Unexpected token: " << peek().value; 
 			throw parse_error(ss.str(), tellg());
 		}
-		eat(*op);
+		eat();
 		auto w = eat_expression();
-		return make_shared<binary_op>(*op, v, w);
+		return make<binary_op>(op, v, w);
 	}
 
 	/////////////////// End of Logical Expressions //////////////////
 
 	AST_node_ptr eat_block()
 	{
-		eat("{");
-		auto stmts = make_shared<sequence>();
-		while (peek() != "}")
+		eat(token_kind::_lbrace);
+		size_t first = pending_items.size();
+		while (peek() != token_kind::_rbrace)
 		{
-			stmts->append(eat_statement());
+			if(peek() == token_kind::_import)
+				throw parse_error("Imports must be top-level statements.", tellg());
+			if(auto stmt = eat_statement())
+				pending_items.push_back(stmt);
+		}
+		eat(token_kind::_rbrace);
+		switch(pending_items.size() - first)
+		{
+		case 0:
+			return nullptr;
+		case 1:
+		{
+			auto stmt = pending_items.back();  // Only one statement in brackets
+			pending_items.pop_back();
+			return stmt;
+		}
+		default:
+			return make_sequence(first);
 		}
-		eat("}");
-		if(!stmts->a)
-			return AST_node_ptr();
-		if(!stmts->b)
-			return stmts->a;  // Only one statement in brackets
-		else
-			return stmts;
 	}
 
 	AST_node_ptr eat_conditional()
 	{
 		auto p1 = declare_streampoint();
-		eat("if"); 
-		eat("("); 
+		eat(token_kind::_if); 
+		eat(token_kind::_lparen); 
 		AST_node_ptr cond = eat_logical_expression(); 
-		eat(")");
+		eat(token_kind::_rparen);
 		auto p2 = declare_streampoint();
 		AST_node_ptr a = eat_block();
-		AST_node_ptr b;
+		AST_node_ptr b = nullptr;
 		ws();
-		if (!eof() && peek().value == "else")
+		if (!eof() && peek() == token_kind::_else)
 		{
-			eat("else");
+			eat(token_kind::_else);
 			b = eat_block();
 		}
-		return make_shared<if_then_else>(cond, a, b, p1, p2);
+		return make<if_then_else>(cond, a, b, p1, p2);
 	}
 
 	AST_node_ptr eat_loop()
 	{
 		auto p1 = declare_streampoint();
-		eat("for"); auto loop_var_name = eat_name(); eat("in"); eat("["); auto& a = eat_integer(); eat(".."); auto& b = eat_integer(); eat("]");
+		eat(token_kind::_for); auto loop_var_name = eat_name(); eat(token_kind::_in); eat(token_kind::_lbracket); 
+		auto a = eat_integer(); eat(token_kind::_range); auto b = eat_integer(); eat(token_kind::_rbracket);
 		auto p2 = declare_streampoint();
-		int an = atoi(a.value.c_str()); int bn = atoi(b.value.c_str());
-		return make_shared<for_loop>(loop_var_name.value, an, bn, eat_block(), p1, p2);
+		int an = to_int(a); int bn = to_int(b);
+		return make<for_loop>(string(loop_var_name.value), an, bn, eat_block(), p1, p2);
 	}
 
 	AST_node_ptr eat_assignment()
 	{
 		auto streampos1 = declare_streampoint();
 		token name = eat_name();
-		eat("=");
+		eat(token_kind::_assign);
 		AST_node_ptr v = eat_expression();		
-		eat(";"); 
+		eat(token_kind::_semicolon); 
 		auto streampos2 = declare_streampoint();
-		return make_shared<assign_op>(name.value, v, streampos1, streampos2);
+		return make<assign_op>(string(name.value), v, streampos1, streampos2);
+	}
+
+	// uint256 x = expr; or uint256 x; for 0.
+	AST_node_ptr eat_declaration()
+	{
+		auto streampos1 = declare_streampoint();
+		size_t size = type_size(peek().kind);
+		eat();
+		token name = eat_name();
+		AST_node_ptr v = nullptr;
+		if(peek() == token_kind::_semicolon)
+			v = make<const_node>("0", _integer);
+		else
+		{
+			eat(token_kind::_assign);
+			v = eat_expression();
+		}
+		eat(token_kind::_semicolon);
+		auto streampos2 = declare_streampoint();
+		auto declaration = make<assign_op>(string(name.value), v, streampos1, streampos2);
+		declaration->declared_size = size;
+		return declaration;
 	}
 
 	AST_node_ptr eat_assert()
 	{
 		auto streampos1 = declare_streampoint();
-		eat("Assert");
-		eat("(");
+		eat(token_kind::_Assert);
+		eat(token_kind::_lparen);
 		AST_node_ptr cond = eat_logical_expression(); 
-		eat(")");
-		eat(";"); 
+		eat(token_kind::_rparen);
+		eat(token_kind::_semicolon); 
 		auto streampos2 = declare_streampoint();
-		return make_shared<assertion>(cond, streampos1, streampos2);
+		return make<assertion>(cond, streampos1, streampos2);
+	}
+
+	AST_node_ptr eat_special_function()
+	{
+		auto streampos1 = declare_streampoint();
+		native_function* func = eat_native_function();
+		eat(token_kind::_semicolon); 
+		auto streampos2 = declare_streampoint();
+		func->declare_stmt(streampos1, streampos2);
+		return func;
+	}
+
+	// import "path";
+	AST_node_ptr eat_import()
+	{
+		auto streampos1 = declare_streampoint();
+		eat(token_kind::_import);
+		token path = eat_string();
+		eat(token_kind::_semicolon);
+		auto streampos2 = declare_streampoint();
+		return make<import_stmt>(string(path.value), streampos1, streampos2);
 	}
 
 	AST_node_ptr eat_statement()
 	{
-		AST_node_ptr v; bool ok;
-		if(peek() == "Assert")
+		AST_node_ptr v = nullptr;
+		const token t = peek();
+		if(t == token_kind::_Assert)
 			v = eat_assert();
-		else if(is_native_function(peek()))
-			eat_native_function(special_functions); 
-		else if(peek() == "if")
+		else if(is_special_function(t))
+			v = eat_special_function();
+		else if(t == token_kind::_if)
 			v = eat_conditional();
-		else if (peek() == "for")
+		else if (t == token_kind::_for)
 			v = eat_loop();
+		else if(t == token_kind::_import)
+			v = eat_import();
+		else if(is_type(t.kind))
+			v = eat_declaration();
 		else
 			v = eat_assignment();
 		ws();
 		return v;
 	}
 
-	Hello_parser(istream& f)
-		: tokeniser(f)
+	void reset(string_view source, streampoint base)
+	{
+		tokeniser::reset(source, base);
+		pending_items.clear();
+		streampoints.clear();
+	}
+
+	Hello_parser(string_view source, arena& _nodes, const intrinsic_registry& _intrinsics)
+		: tokeniser(source),
+		  nodes(_nodes),
+		  intrinsics(_intrinsics)
+	{}
+
+	Hello_parser(istream& f, arena& _nodes, const intrinsic_registry& _intrinsics)
+		: tokeniser(f),
+		  nodes(_nodes),
+		  intrinsics(_intrinsics)
 	{}
 
 	map<string, int> symbol_table;
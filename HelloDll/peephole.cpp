@@ -0,0 +1,136 @@
+// Copyright (c) Shaun O'Kane, 2010, 2018
+#include "peephole.h"
+#include <sstream>
+
+using namespace std;
+
+static constexpr auto last_element_masks = peephole_optimiser::rules_ending_with();
+
+bool peephole_optimiser::matches(const instruction_pipeline& pipe, size_t k, uint16_t element)
+{
+	if(!may_match(element, pipe.opcode(k)))
+		return false;
+	if(element == _small_int_push)
+	{
+		uint8_t v = *pipe.data(k).first;
+		return v == 0x81 || (v >= 1 && v <= 16);
+	}
+	return true;
+}
+
+// Applies the first rule that matches the code ending at end.
+bool peephole_optimiser::rewrite_tail(instruction_pipeline& pipe, size_t& end)
+{
+	if(end == 0)
+		return false;
+	uint32_t mask = last_element_masks[pipe.opcode(end-1)] & enabled;
+	for(size_t r = 0; (mask >> r) != 0; r++)
+	{
+		if(((mask >> r) & 1) == 0)
+			continue;
+		auto& rule = rules[r];
+		size_t n = rule.size();
+		if(n > end)
+			continue;
+		size_t first = end - n;
+		size_t k = 0;
+		while(k < n && matches(pipe, first + k, rule.pattern[k]))
+			k++;
+		if(k < n)
+			continue;
+
+		counts[r]++;
+		switch(rule.replacement)
+		{
+		case _none:
+			end = first;
+			break;
+		case _small_int_op:
+		{
+			uint8_t v = *pipe.data(first).first;
+			pipe.replace(first, v == 0x81 ? OP_1NEGATE : CScript::EncodeOP_N(v));
+			end = first + 1;
+			break;
+		}
+		default:
+			pipe.replace(first, opcodetype(rule.replacement));  // keeps the generating stmt of the first instruction.
+			end = first + 1;
+			break;
+		}
+		return true;
+	}
+	return false;
+}
+
+// A push in a pattern is taken to be the cheapest that it could match.
+static code_cost cost_of(uint16_t element)
+{
+	switch(element)
+	{
+	case peephole_optimiser::_none: return {};
+	case peephole_optimiser::_any_push: return {1, 1, 1};
+	case peephole_optimiser::_small_int_push: return {2, 1, 1};
+	case peephole_optimiser::_small_int_op: return {1, 1, 1};
+	default: return cost_model::opcode(opcodetype(element));
+	}
+}
+
+void peephole_optimiser::set_objective(const cost_model& costs)
+{
+	enabled = 0;
+	for(size_t r = 0; r < size(rules); r++)
+	{
+		code_cost pattern;
+		for(auto element : rules[r].pattern)
+			pattern += cost_of(element);
+		if(costs.weigh(cost_of(rules[r].replacement)) < costs.weigh(pattern))
+			enabled |= uint32_t(1) << r;
+	}
+}
+
+void peephole_optimiser::run(instruction_pipeline& pipe, size_t first)
+{
+	size_t end = first;  // pipe[0, end) is the rewritten code.
+	for(size_t k = first; k < pipe.size(); k++)
+	{
+		pipe.move(k, end++);
+		while(rewrite_tail(pipe, end))
+			;
+	}
+	pipe.truncate(end);
+}
+
+// A rule can only ever reach back to pipe[n-1] if some suffix of pipe[0, n) matches the start of its pattern.
+size_t peephole_optimiser::final_prefix(const instruction_pipeline& pipe) const
+{
+	auto open_ended = [&pipe](size_t n)
+	{
+		for(auto& rule : rules)
+		{
+			for(size_t len = 1; len < rule.size() && len <= n; len++)
+			{
+				size_t k = 0;
+				while(k < len && matches(pipe, n - len + k, rule.pattern[k]))
+					k++;
+				if(k == len)
+					return true;
+			}
+		}
+		return false;
+	};
+	size_t n = pipe.size();
+	while(n > 0 && open_ended(n))
+		n--;
+	return n;
+}
+
+string peephole_optimiser::statistics() const
+{
+	stringstream s;
+	for(size_t r = 0; r < size(rules); r++)
+	{
+		if(counts[r])
+			s << "\t" << rules[r].name << ": " << counts[r] << "\n";
+	}
+	return s.str();
+}
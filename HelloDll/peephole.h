@@ -0,0 +1,100 @@
+#pragma once
+// Copyright (c) Shaun O'Kane, 2010, 2018
+
+#include <array>
+#include <string>
+#include "Internals.h"
+#include "cost_model.h"
+
+using namespace std;
+
+class peephole_optimiser
+{
+public:
+	// Pattern elements are opcodes, or one of these classes.
+	enum element : uint16_t
+	{
+		_none = 0x100,
+		_any_push,			// OP_0, OP_1NEGATE, OP_1..OP_16 or a data push.
+		_small_int_push,	// a one byte data push of -1 or 1..16.
+		_small_int_op		// replacement only. The OP_1NEGATE, OP_1..OP_16 for the _small_int_push matched.
+	};
+
+	// Rewrites a short run of instructions into at most one instruction.
+	struct rule
+	{
+		const char* name;
+		uint16_t pattern[3];	// padded with _none.
+		uint16_t replacement;	// _none to delete the pattern.
+
+		constexpr size_t size() const { return pattern[1] == _none ? 1 : pattern[2] == _none ? 2 : 3; }
+	};
+
+	// Rules are tried in order. Each instruction is matched against the tail of the rewritten code as it is 
+	// appended, so a rewrite can enable another one further back and a single pass reaches a fixed point.
+	static constexpr rule rules[] =
+	{
+		{"small int push",			{_small_int_push, _none, _none},			_small_int_op},
+		{"TOALTSTACK FROMALTSTACK",	{OP_TOALTSTACK, OP_FROMALTSTACK, _none},	_none},
+		{"FROMALTSTACK TOALTSTACK",	{OP_FROMALTSTACK, OP_TOALTSTACK, _none},	_none},
+		{"DUP DROP",				{OP_DUP, OP_DROP, _none},					_none},
+		{"SWAP SWAP",				{OP_SWAP, OP_SWAP, _none},					_none},
+		{"DUP SWAP",				{OP_DUP, OP_SWAP, _none},					OP_DUP},
+		{"SWAP OVER",				{OP_SWAP, OP_OVER, _none},					OP_TUCK},
+		{"push DROP",				{_any_push, OP_DROP, _none},				_none},
+		{"0 PICK",					{OP_0, OP_PICK, _none},						OP_DUP},
+		{"1 PICK",					{OP_1, OP_PICK, _none},						OP_OVER},
+		{"0 ROLL",					{OP_0, OP_ROLL, _none},						_none},
+		{"1 ROLL",					{OP_1, OP_ROLL, _none},						OP_SWAP},
+		{"DROP DROP",				{OP_DROP, OP_DROP, _none},					OP_2DROP},
+		{"OVER OVER",				{OP_OVER, OP_OVER, _none},					OP_2DUP},
+		{"NOTIF NOP4 ENDIF",		{OP_NOTIF, OP_NOP4, OP_ENDIF},				OP_VERIFY},	// Assert()
+		{"EQUAL VERIFY",			{OP_EQUAL, OP_VERIFY, _none},				OP_EQUALVERIFY},
+		{"NUMEQUAL VERIFY",			{OP_NUMEQUAL, OP_VERIFY, _none},			OP_NUMEQUALVERIFY},
+		{"0NOTEQUAL VERIFY",		{OP_0NOTEQUAL, OP_VERIFY, _none},			OP_VERIFY},	// x != 0, on a number.
+		{"CHECKSIG VERIFY",			{OP_CHECKSIG, OP_VERIFY, _none},			OP_CHECKSIGVERIFY},
+		{"CHECKMULTISIG VERIFY",	{OP_CHECKMULTISIG, OP_VERIFY, _none},		OP_CHECKMULTISIGVERIFY},
+	};
+
+	// Whether element can match an instruction with opcode byte op. Exact except for _small_int_push.
+	static constexpr bool may_match(uint16_t element, uint8_t op)
+	{
+		switch(element)
+		{
+		case _any_push: return op <= OP_1NEGATE || (op >= OP_1 && op <= OP_16);
+		case _small_int_push: return op == 1;
+		default: return op == element;
+		}
+	}
+
+	// For each opcode byte, the rules whose last element may match it.
+	static constexpr array<uint32_t, 256> rules_ending_with()
+	{
+		static_assert(size(rules) <= 32, "rule masks are 32 bits");
+		array<uint32_t, 256> masks {};
+		for(size_t op = 0; op < 256; op++)
+			for(size_t r = 0; r < size(rules); r++)
+				if(may_match(rules[r].pattern[rules[r].size()-1], uint8_t(op)))
+					masks[op] |= uint32_t(1) << r;
+		return masks;
+	}
+
+	// Only the rules that make the code cheaper under costs' objective are applied.
+	void set_objective(const cost_model& costs);
+
+	// Rewrites pipe[first, size()). pipe[0, first) must already have been optimised.
+	void run(instruction_pipeline& pipe, size_t first = 0);
+
+	// pipe[0, n) can no longer be rewritten, whatever is appended to pipe. pipe must have been optimised.
+	size_t final_prefix(const instruction_pipeline& pipe) const;
+
+	void reset() { counts.fill(0); }
+	string statistics() const;	// how many times each rule fired since reset().
+
+private:
+	array<size_t, size(rules)> counts {};
+	uint32_t enabled = ~uint32_t(0);	// mask of the rules applied.
+
+	static bool matches(const instruction_pipeline& pipe, size_t k, uint16_t element);
+	bool rewrite_tail(instruction_pipeline& pipe, size_t& end);
+};
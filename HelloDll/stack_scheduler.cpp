@@ -0,0 +1,362 @@
+// Copyright (c) Shaun O'Kane, 2010, 2018
+#include "stack_scheduler.h"
+#include "intrinsics.h"
+
+using namespace std;
+
+static constexpr uint32_t _live_out = numeric_limits<uint32_t>::max();
+
+stack_scheduler::stack_scheduler(instruction_pipeline& _pipe, const cost_model& _costs)
+	: stack(_pipe),
+	  pipe(_pipe),
+	  costs(_costs)
+{
+}
+
+// fn must have been analysed. Its _inputs are the values in stack.slots.
+void stack_scheduler::run(const ir_function& _fn, const vector<ir_value>& live_out)
+{
+	fn = &_fn;
+	last_use.resize(fn->values.size());
+	for(ir_value v = 0; v < fn->values.size(); v++)
+		last_use[v] = fn->values[v].def;
+	for(uint32_t i = 0; i < fn->instrs.size(); i++)
+	{
+		const ir_instr& instr = fn->instrs[i];
+		if(instr.op == ir_instr::_nop)
+			continue;
+		const ir_value* args = fn->operands_of(instr);
+		for(uint32_t k = 0; k < instr.no_of_operands; k++)
+			last_use[args[k]] = max(last_use[args[k]], i);
+	}
+	for(auto v : live_out)
+		last_use[v] = _live_out;
+
+	// Inputs that are never used again.
+	for(size_t k = stack.size(); k-- > 0; )
+	{
+		ir_value v = stack.slots[k];
+		if(last_use[v] == fn->values[v].def)
+		{
+			at_stmt(fn->def(v).stmt);
+			stack.drop(v);
+		}
+	}
+	schedule(0, uint32_t(fn->instrs.size()), 0);
+}
+
+// Schedules instrs [first, last). region is the first instruction of the innermost enclosing branch, or 0. Only
+// values defined in the region can be consumed, as the branches of an if must leave the same layout.
+void stack_scheduler::schedule(uint32_t first, uint32_t last, uint32_t region)
+{
+	for(uint32_t i = first; i < last; i++)
+	{
+		switch(fn->instrs[i].op)
+		{
+		case ir_instr::_const: case ir_instr::_input: case ir_instr::_phi: case ir_instr::_nop:
+			break;	// constants are pushed by their uses, phis by their if.
+		case ir_instr::_if:
+			i = schedule_if(i, region);
+			break;
+		case ir_instr::_exit:
+			exit(i, region);
+			break;
+		default:
+			emit(i, region);
+			break;
+		}
+	}
+}
+
+// Code is attributed to statements in source order, as the AST code generator would. e.g. an OP_ENDIF belongs to the
+// last statement in the if, not to the if itself.
+void stack_scheduler::at_stmt(uint32_t stmt_id)
+{
+	stmt = max(stmt, stmt_id);
+	pipe.set_stmt(stmt);
+}
+
+bool stack_scheduler::is_last_use(ir_value v, uint32_t i, uint32_t region) const
+{
+	if(last_use[v] == i && fn->values[v].def >= region)
+		return true;
+	auto p = branch_last_use.find(v);
+	return p != branch_last_use.end() && p->second == pair(i, region);
+}
+
+// Whether instruction i can consume args[k], i.e. it is the last use and args doesn't need it again.
+bool stack_scheduler::consumes(const ir_value* args, size_t n, size_t k, uint32_t i, uint32_t region) const
+{
+	return !fn->is_constant(args[k]) && is_last_use(args[k], i, region) && find(args + k + 1, args + n, args[k]) == args + n;
+}
+
+// The no. of args, from the first, that are already on top of the stack in order and can be left there.
+size_t stack_scheduler::in_place(const ir_value* args, size_t n, uint32_t i, uint32_t region) const
+{
+	for(size_t m = min(n, stack.size()); m > 0; m--)
+	{
+		size_t k = 0;
+		while(k < m && stack.slots[stack.size() - m + k] == args[k] && consumes(args, n, k, i, region))
+			k++;
+		if(k == m)
+			return m;
+	}
+	return 0;
+}
+
+// Puts copies of args on top of the stack, or moves the ones that are last used by instruction i.
+void stack_scheduler::stage(const ir_value* args, size_t n, uint32_t i, uint32_t region)
+{
+	for(size_t k = in_place(args, n, i, region); k < n; k++)
+	{
+		ir_value v = args[k];
+		if(fn->is_constant(v) && stack.contains(v) && copies_constant(v, stack.depth_of(v)))
+			stack.copy(v);
+		else if(fn->is_constant(v))
+		{
+			pipe << fn->constant(v);
+			stack.push(v);
+		}
+		else if(consumes(args, n, k, i, region))
+			stack.move(v, k);
+		else
+			stack.copy(v);
+	}
+}
+
+// Whether a constant that is already on the stack at depth, e.g. the first operand of h * h, is copied rather than
+// pushed again.
+bool stack_scheduler::copies_constant(ir_value v, size_t depth) const
+{
+	return costs.weigh(cost_model::copy(depth)) < costs.weigh(cost_model::push(fn->constant(v)));
+}
+
+// The cost of the code that stage() would emit.
+code_cost stack_scheduler::staging_cost(const ir_value* args, size_t n, uint32_t i, uint32_t region) const
+{
+	vector<ir_value> slots = stack.slots;
+	auto depth_of = [&](ir_value v, size_t skip) { return size_t(find(slots.rbegin() + skip, slots.rend(), v) - slots.rbegin()); };
+	code_cost cost;
+	for(size_t k = in_place(args, n, i, region); k < n; k++)
+	{
+		ir_value v = args[k];
+		if(fn->is_constant(v) && depth_of(v, 0) < slots.size() && copies_constant(v, depth_of(v, 0)))
+			cost += cost_model::copy(depth_of(v, 0));
+		else if(fn->is_constant(v))
+			cost += cost_model::push(fn->constant(v));
+		else if(consumes(args, n, k, i, region))
+		{
+			size_t depth = depth_of(v, k);
+			cost += cost_model::move(depth);
+			slots.erase(slots.end() - 1 - depth);
+		}
+		else
+			cost += cost_model::copy(depth_of(v, 0));
+		slots.push_back(v);
+	}
+	return cost;
+}
+
+void stack_scheduler::emit(uint32_t i, uint32_t region)
+{
+	const ir_instr& instr = fn->instrs[i];
+	const ir_value* args = fn->operands_of(instr);
+	at_stmt(instr.stmt);
+	switch(instr.op)
+	{
+	case ir_instr::_depth:
+	{
+		// The values on the stack that the source can't see are the variables. A value that the source sees twice,
+		// e.g. after tos = tos, or a constant that has not been pushed yet, goes the other way.
+		int hidden = int(stack.size()) - int(instr.data);
+		pipe << OP_DEPTH;
+		if(hidden > 0)
+			pipe << hidden << OP_SUB;
+		else if(hidden < 0)
+			pipe << -hidden << OP_ADD;
+		break;
+	}
+	case ir_instr::_extern:
+		pipe.placeholder(instr.data);
+		break;
+	case ir_instr::_assert:
+		stage(args, 1, i, region);
+		// If the SCRIPT_VERIFY_DISCOUNRAGE_UPGRADABLE_NOPS is set, OP_NOP4 will cause a detectable error.
+		pipe << OP_NOTIF << OP_NOP4 << OP_ENDIF;
+		stack.pop();
+		return;
+	case ir_instr::_return:
+		pipe << OP_RETURN;
+		for(uint32_t k = 0; k < instr.no_of_operands; k++)
+			pipe << fn->constant(args[k]);
+		return;
+	default:
+	{
+		// The operands of a commutative op, or a comparison that can be turned round, are staged in whichever order
+		// takes less stack manipulation.
+		uint16_t op = instr.op;
+		bool is_user_intrinsic = instr.info && instr.info->body;
+		ir_value swapped[2];
+		if(instr.no_of_operands == 2 && !is_user_intrinsic && swapped_op(op) != ir_instr::_nop)
+		{
+			swapped[0] = args[1];
+			swapped[1] = args[0];
+			if(costs.weigh(staging_cost(swapped, 2, i, region)) < costs.weigh(staging_cost(args, 2, i, region)))
+			{
+				op = swapped_op(op);
+				args = swapped;
+			}
+		}
+		stage(args, instr.no_of_operands, i, region);
+		if(is_user_intrinsic)
+		{
+			// User intrinsic.
+			opcodetype opcode;
+			valtype data;
+			for(auto pc = instr.info->body->begin(); instr.info->body->GetOp(pc, opcode, data); )
+			{
+				if(opcode == OP_0 || opcode > OP_PUSHDATA4)
+					pipe << opcode;
+				else
+					pipe << data;
+			}
+		}
+		else
+			pipe << opcodetype(op);
+		stack.pop(instr.no_of_operands);
+		break;
+	}
+	}
+
+	for(uint16_t r = 0; r < instr.no_of_results; r++)
+		stack.push(instr.result + r);
+	for(uint16_t r = instr.no_of_results; r-- > 0; )
+	{
+		if(last_use[instr.result + r] == i)
+			stack.drop(instr.result + r);	// never used.
+	}
+}
+
+// Everything but the values the source left on the stack is dropped.
+void stack_scheduler::exit(uint32_t i, uint32_t region)
+{
+	const ir_instr& instr = fn->instrs[i];
+	at_stmt(instr.stmt);
+	size_t n = instr.no_of_operands;
+	stage(fn->operands_of(instr), n, i, region);
+	while(stack.size() > n)
+		stack.drop(stack.slots[stack.size() - n - 1], n);
+}
+
+// Drops the values defined in region that are dead after instruction i.
+void stack_scheduler::drop_dead(uint32_t i, uint32_t region)
+{
+	for(size_t k = stack.size(); k-- > 0; )
+	{
+		ir_value v = stack.slots[k];
+		if(last_use[v] <= i && fn->values[v].def >= region)
+			stack.drop(v);
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  if
+//
+///////////////////////////////////////////////////////////////////////////////
+
+// Both branches leave the stack as it was before the if, less the values that die in the if, with the values of its
+// phis on top. Returns the last instruction of the if, i.e. its last phi.
+uint32_t stack_scheduler::schedule_if(uint32_t i, uint32_t region)
+{
+	const auto& instrs = fn->instrs;
+	uint32_t else_i = fn->matching[i];
+	uint32_t endif_i = instrs[else_i].op == ir_instr::_else ? fn->matching[else_i] : else_i;
+	uint32_t end = endif_i + 1;
+	vector<uint32_t> phis;		// the ones that are used.
+	for(; end < instrs.size() && (instrs[end].op == ir_instr::_phi || instrs[end].op == ir_instr::_const
+		|| instrs[end].op == ir_instr::_nop); end++)
+	{
+		if(instrs[end].op == ir_instr::_phi && last_use[instrs[end].result] != end)
+			phis.push_back(end);
+	}
+
+	at_stmt(instrs[i].stmt);
+	stage(fn->operands_of(instrs[i]), 1, i, region);
+	pipe << OP_IF;
+	stack.pop();
+	vector<ir_value> layout = stack.slots;
+	vector<ir_value> dying;
+	for(auto v : layout)
+	{
+		if(fn->values[v].def >= region && last_use[v] < end)
+			dying.push_back(v);
+	}
+
+	schedule_branch(i + 1, else_i, phis, 0, dying);
+	vector<ir_value> merged = stack.slots;
+
+	bool has_code = false;
+	for(uint32_t k = else_i + 1; k < endif_i && !has_code; k++)
+		has_code = (instrs[k].op != ir_instr::_const && instrs[k].op != ir_instr::_nop);
+	if(has_code || merged != layout)
+	{
+		at_stmt(instrs[else_i].stmt);
+		pipe << OP_ELSE;
+		stack.slots = layout;
+		schedule_branch(else_i + 1, endif_i, phis, 1, dying);
+		assert(stack.slots == merged);
+	}
+	pipe << OP_ENDIF;
+	drop_dead(end - 1, region);
+	return end - 1;
+}
+
+// A value that dies in the if can be consumed by its last use in each branch, as long as that isn't in a nested if.
+// Otherwise it is moved into a phi, or dropped, at the end of the branch.
+void stack_scheduler::schedule_branch(uint32_t first, uint32_t last, const vector<uint32_t>& phis, int side,
+	const vector<ir_value>& dying)
+{
+	auto incoming = [&](uint32_t phi) { return fn->operands_of(fn->instrs[phi])[side]; };
+	for(auto v : dying)
+	{
+		bool is_incoming = any_of(phis.begin(), phis.end(), [&](uint32_t phi) { return incoming(phi) == v; });
+		auto [p, q] = fn->uses(v);
+		auto u = lower_bound(p, q, last);
+		if(!is_incoming && u != p && *(u - 1) >= first)
+			branch_last_use[v] = {*(u - 1), first};
+	}
+	schedule(first, last, first);
+
+	// The values of the phis, in order.
+	size_t n = 0;
+	for(size_t k = 0; k < phis.size(); k++)
+	{
+		ir_value v = incoming(phis[k]);
+		at_stmt(fn->instrs[phis[k]].stmt);
+		bool dies = fn->values[v].def >= first || find(dying.begin(), dying.end(), v) != dying.end();
+		bool is_used_again = any_of(phis.begin() + k + 1, phis.end(), [&](uint32_t phi) { return incoming(phi) == v; });
+		if(fn->is_constant(v))
+		{
+			pipe << fn->constant(v);
+			stack.push(v);
+		}
+		else if(dies && !is_used_again)
+			stack.move(v, n);
+		else
+			stack.copy(v);
+		n++;
+	}
+	for(size_t k = 0; k < n; k++)
+		stack.slots[stack.size() - n + k] = fn->instrs[phis[k]].result;
+
+	// Anything else that dies in the if, and what is left of the branch, e.g. the value of an unused phi.
+	for(size_t k = stack.size() - n; k-- > 0; )
+	{
+		ir_value v = stack.slots[k];
+		if(fn->values[v].def >= first || find(dying.begin(), dying.end(), v) != dying.end())
+			stack.drop(v, n);
+	}
+	for(auto v : dying)
+		branch_last_use.erase(v);
+}
@@ -0,0 +1,50 @@
+#pragma once
+// Copyright (c) Shaun O'Kane, 2010, 2018
+
+#include <map>
+#include <vector>
+#include "Internals.h"
+#include "ir.h"
+#include "variable_allocator.h"
+#include "cost_model.h"
+
+using namespace std;
+
+// Generates the script for an ir_function. Values live on the main stack from their definition to their last use,
+// which consumes them if it can. Constants are pushed where they are used. The branches of an if leave the values
+// that its phis merge in the same slots.
+class stack_scheduler
+{
+public:
+	variable_allocator stack;	// carried from one chunk to the next when streaming.
+
+	stack_scheduler(instruction_pipeline& pipe, const cost_model& costs);
+
+	// The values in live_out are left on the stack (unless they are constants) for the next chunk.
+	void run(const ir_function& fn, const vector<ir_value>& live_out = {});
+	void reset() { stack.clear(); stmt = 0; }
+
+private:
+	instruction_pipeline& pipe;
+	const cost_model& costs;
+	const ir_function* fn = nullptr;
+	vector<uint32_t> last_use;	// value -> the last instruction that uses it, or its def if none.
+	uint32_t stmt = 0;			// the statement the code is attributed to.
+	// Values from outside a branch that can be consumed in it: value -> (instr, the branch's first instr).
+	map<ir_value, pair<uint32_t, uint32_t>> branch_last_use;
+
+	void schedule(uint32_t first, uint32_t last, uint32_t region);
+	uint32_t schedule_if(uint32_t i, uint32_t region);
+	void schedule_branch(uint32_t first, uint32_t last, const vector<uint32_t>& phis, int side,
+		const vector<ir_value>& dying);
+	void emit(uint32_t i, uint32_t region);
+	void stage(const ir_value* args, size_t n, uint32_t i, uint32_t region);
+	code_cost staging_cost(const ir_value* args, size_t n, uint32_t i, uint32_t region) const;
+	bool copies_constant(ir_value v, size_t depth) const;
+	size_t in_place(const ir_value* args, size_t n, uint32_t i, uint32_t region) const;
+	bool consumes(const ir_value* args, size_t n, size_t k, uint32_t i, uint32_t region) const;
+	void exit(uint32_t i, uint32_t region);
+	void drop_dead(uint32_t i, uint32_t region);
+	bool is_last_use(ir_value v, uint32_t i, uint32_t region) const;
+	void at_stmt(uint32_t stmt_id);
+};
@@ -0,0 +1,52 @@
+// Copyright (c) Shaun O'Kane, 2010, 2018
+#include "statement_cache.h"
+#include <sstream>
+
+using namespace std;
+
+// FNV-1a.
+uint64_t statement_cache::hash(string_view s)
+{
+	uint64_t h = 14695981039346656037ull;
+	for(char ch : s)
+		h = (h ^ uint8_t(ch)) * 1099511628211ull;
+	return h;
+}
+
+const statement_cache::entry* statement_cache::find(string_view text, uint64_t state)
+{
+	auto p = entries.find(pair(hash(text), state));
+	if(p == entries.end() || p->second.text != text)
+	{
+		generated++;
+		return nullptr;
+	}
+	p->second.last_used = compilation;
+	reused++;
+	return &p->second;
+}
+
+statement_cache::entry& statement_cache::add(string_view text, uint64_t state)
+{
+	auto key = pair(hash(text), state);
+	entries.erase(key);		// text with the same hash.
+	entry& e = entries.try_emplace(key).first->second;
+	e.text = text;
+	e.last_used = compilation;
+	return e;
+}
+
+void statement_cache::end()
+{
+	for(auto p = entries.begin(); p != entries.end(); )
+		p = p->second.last_used == compilation ? next(p) : entries.erase(p);
+}
+
+string statement_cache::statistics() const
+{
+	if(reused + generated == 0)
+		return string();
+	stringstream s;
+	s << "\treused: " << reused << "\n\tgenerated: " << generated << "\n";
+	return s.str();
+}
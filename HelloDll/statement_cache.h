@@ -0,0 +1,56 @@
+#pragma once
+// Copyright (c) Shaun O'Kane, 2010, 2018
+
+#include <map>
+#include <string>
+#include <vector>
+#include "Internals.h"
+#include "tokeniser.h"
+
+using namespace std;
+
+// What some code added to the compiler's state, besides the code itself.
+struct state_delta
+{
+	vector<string> variables;	// in symbol table order.
+	vector<pair<string, inferred_type>> types;	// only those it changed.
+	vector<pair<string, size_t>> big_variables;
+	vector<script_template::parameter> template_parameters;
+};
+
+// With INCREMENTAL_COMPILE, the code generated for each top-level statement, keyed by its text and the state of the
+// compiler before it: the options, the variables and their types, and the template parameters. A statement that is
+// compiled again in the same state has its code appended and its effect on the state replayed, instead of being
+// parsed, checked and generated. So an edit only regenerates the statements it changes, and those after it that
+// start in a different state, e.g. because it declared a new variable. Only the statements' text is still read in
+// full, to split and hash it.
+class statement_cache
+{
+public:
+	struct entry : state_delta
+	{
+		string text;
+		uint64_t state_after = 0;
+		stmt_table stmts;			// positions are relative to the start of text.
+		uint32_t options = 0;
+		instruction_pipeline code {stmts, options};
+		uint32_t last_used = 0;		// the compilation.
+	};
+
+	static uint64_t hash(string_view s);
+
+	void begin() { compilation++; }
+	const entry* find(string_view text, uint64_t state);	// nullptr if it must be generated.
+	entry& add(string_view text, uint64_t state);
+	void end();		// drops the entries that this compilation didn't use, e.g. for text that was edited.
+	void clear() { entries.clear(); }
+
+	void reset() { reused = generated = 0; }
+
+	string statistics() const;	// statements reused and generated since reset().
+
+private:
+	map<pair<uint64_t, uint64_t>, entry> entries;	// (hash of the text, state before) ->
+	uint32_t compilation = 0;
+	size_t reused = 0, generated = 0;
+};
@@ -2,20 +2,148 @@
 // Copyright (c) Shaun O'Kane, 2010, 2018
 
 #include <string>
-#include <functional>
+#include <string_view>
+#include <cstdint>
+#include <iterator>
 #include <istream>
 #include <sstream>
 #include <cassert>
 #include <cctype>
-#include <tuple>
+#include <limits>
+#include <algorithm>
 #include <memory>
 
 using namespace std;  // naughty.
 
 typedef enum { _undefined, _integer, _hex, _bool } value_type;
 
-typedef tuple<streampos, size_t, size_t> streampoint;
+// What the type inference knows about a value. _bool is 0 or 1, so is also a number. A byte array can have a
+// known width, e.g. a hash or a constant, and a uintN is a byte array of its width that arithmetic treats as a
+// number. A number can have a known most bytes it takes, e.g. 5 for the sum of two 4 byte numbers. _undefined is a
+// value that could be anything, e.g. an input.
+struct inferred_type
+{
+	value_type kind = _undefined;
+	uint32_t width = 0;		// of a _hex value, or at most of an _integer, in bytes, or 0 if not known.
+	bool is_uint = false;
+
+	bool is_number() const { return kind == _integer || kind == _bool; }
+	// A minimally encoded number of at most 4 bytes, which the number opcodes take without failing. Every number
+	// the script computes is minimally encoded.
+	bool is_small_number() const { return kind == _bool || (kind == _integer && width && width <= 4); }
+	uint32_t number_width() const { return kind == _bool ? 1 : kind == _integer ? width : 0; }
+	bool operator==(const inferred_type& other) const
+	{
+		return kind == other.kind && width == other.width && is_uint == other.is_uint;
+	}
+	bool operator!=(const inferred_type& other) const { return !(*this == other); }
+};
+
+typedef uint32_t streampoint;	// byte offset into the source.
+
+// Interned token kinds. Operators, keywords and native function names are classified once by the tokeniser,
+// so the parser and code generator switch on (or index tables by) the kind rather than comparing strings.
+enum class token_kind : uint8_t
+{
+	_none,
+	// Punctuation
+	_assign, _range, _comma, _colon, _semicolon, _lparen, _rparen, _lbracket, _rbracket, _lbrace, _rbrace,
+	// Operators
+	_plus, _minus, _star, _slash, _percent, _concat, _not, _tilde, _bitand, _bitor, _andand,
+	// Comparisons
+	_lt, _le, _eq, _ne, _ge, _gt,
+	// Keywords
+	_and, _or, _if, _else, _for, _in, _true, _false, _Assert, _import,
+	// Types
+	_uint64, _uint128, _uint256, _uint512,
+	// Special functions (void)
+	_Verify, _CheckSequenceVerify, _CheckLocktimeVerify, _CheckSigVerify, _CheckMultiSigVerify, _Return,
+	// Native functions
+	_RIPEMD160, _SHA1, _SHA256, _HASH160, _HASH256, _CheckSig, _CheckMultiSig,
+	_split, _cat, _xor, _Bin2Num, _Num2Bin,
+	_abs, _max, _min, _within,
+	_depth, _size,
+	_count,
+
+	_first_keyword = _and, _last_keyword = _uint512,
+	_first_type = _uint64, _last_type = _uint512,
+	_first_special_function = _Verify, _last_special_function = _Return,
+	_first_native_function = _RIPEMD160, _last_native_function = _size
+};
+
+inline constexpr string_view token_spellings[] =
+{
+	"",
+	"=", "..", ",", ":", ";", "(", ")", "[", "]", "{", "}",
+	"+", "-", "*", "/", "%", "||", "!", "~", "&", "|", "&&",
+	"<", "<=", "==", "!=", ">=", ">",
+	"and", "or", "if", "else", "for", "in", "true", "false", "Assert", "import",
+	"uint64", "uint128", "uint256", "uint512",
+	"Verify", "CheckSequenceVerify", "CheckLocktimeVerify", "CheckSigVerify", "CheckMultiSigVerify", "Return",
+	"RIPEMD160", "SHA1", "SHA256", "HASH160", "HASH256", "CheckSig", "CheckMultiSig",
+	"split", "cat", "xor", "Bin2Num", "Num2Bin",
+	"abs", "max", "min", "within",
+	"depth", "size"
+};
+static_assert(size(token_spellings) == size_t(token_kind::_count), "token_spellings out of step with token_kind");
+
+constexpr string_view spelling(token_kind k) { return token_spellings[size_t(k)]; }
+constexpr bool in_range(token_kind k, token_kind first, token_kind last) { return k >= first && k <= last; }
+constexpr bool is_keyword(token_kind k) { return in_range(k, token_kind::_first_keyword, token_kind::_last_keyword); }
+constexpr bool is_comparison(token_kind k) { return in_range(k, token_kind::_lt, token_kind::_gt); }
+constexpr bool is_type(token_kind k) { return in_range(k, token_kind::_first_type, token_kind::_last_type); }
+constexpr size_t type_size(token_kind k) { return size_t(8) << (size_t(k) - size_t(token_kind::_first_type)); }	// in bytes.
+constexpr bool is_special_function(token_kind k) { return in_range(k, token_kind::_first_special_function, token_kind::_last_special_function); }
+constexpr bool is_native_function(token_kind k) { return in_range(k, token_kind::_first_native_function, token_kind::_last_native_function); }
+
+// Perfect hash over the names of keywords and functions. The seed is searched for at compile time,
+// so adding a name can never introduce a collision - at worst it changes the seed.
+struct keyword_hash_table
+{
+	static constexpr size_t size = 128;   // power of 2, roughly 4x the number of names.
+
+	static constexpr uint32_t hash(string_view name, uint32_t seed)
+	{
+		uint32_t h = seed;
+		for(char ch : name)
+			h = (h ^ uint8_t(ch)) * 16777619u;  // FNV-1a
+		// The low bits of the product only depend on the low bits of the seed, so fold the high bits in. Otherwise
+		// there are only size seeds to try.
+		return (h ^ (h >> 16)) & (size - 1);
+	}
 
+	uint32_t seed;
+	token_kind slots[size];
+
+	static constexpr keyword_hash_table build()
+	{
+		for(uint32_t seed = 2166136261u; ; seed++)
+		{
+			keyword_hash_table table{seed, {}};
+			bool ok = true;
+			for(size_t k = size_t(token_kind::_first_keyword); ok && k <= size_t(token_kind::_last_native_function); k++)
+			{
+				token_kind& slot = table.slots[hash(token_spellings[k], seed)];
+				ok = (slot == token_kind::_none);
+				slot = token_kind(k);
+			}
+			if(ok)
+				return table;
+		}
+	}
+
+	constexpr token_kind find(string_view name) const
+	{
+		token_kind k = slots[hash(name, seed)];
+		return (k != token_kind::_none && spelling(k) == name) ? k : token_kind::_none;
+	}
+};
+
+inline constexpr keyword_hash_table keywords = keyword_hash_table::build();
+static_assert(keywords.find("Assert") == token_kind::_Assert && keywords.find("size") == token_kind::_size
+	&& keywords.find("sizes") == token_kind::_none, "keyword_hash_table is broken");
+
+// Tokens are views into the source buffer owned by the tokeniser (or its caller). No per-token allocation.
 struct token
 {
 	typedef enum 
@@ -26,34 +154,39 @@ struct token
 		_bool = value_type::_bool,  // not currently used.
 		_std,
 		_extern,
-		_name
+		_name,
+		_string		// "...", e.g. the path of an import. The value is without the quotes.
 	} token_type;
 
-	token() : type(token::_undefined) {}
-	token(const string& val, token_type _type = _std) : value(val), type(_type) {}
-	token(char ch) : value(1, ch), type(_std) {}
+	token() : type(token::_undefined), kind(token_kind::_none) {}
+	token(string_view val, token_type _type = _std, token_kind _kind = token_kind::_none) : value(val), type(_type), kind(_kind) {}
+	token(token_kind _kind) : value(spelling(_kind)), type(_std), kind(_kind) {}
 
 	bool operator==(const token& other) const
 	{
 		return (type == other.type && type != _undefined);
 	}
-	bool operator==(const string& t) const { return (type == _std && t == value); }
-	bool operator!=(const string& t) const { return !operator==(t); }
+	bool operator==(string_view t) const { return (type == _std && t == value); }
+	bool operator!=(string_view t) const { return !operator==(t); }
 	bool operator!=(const token& other) const { return !operator==(other); }
+	bool operator==(token_kind k) const { return kind == k; }
+	bool operator!=(token_kind k) const { return kind != k; }
 	void reset()
 	{
 		type = _undefined;
-		value.clear();
+		kind = token_kind::_none;
+		value = string_view();
 	}
 	bool is_valid() const { return (type != _undefined); }
 
-	string value;
+	string_view value;
 	token_type type;
+	token_kind kind;
 
 	const string& type_name(token_type _type) const
 	{
 #define STR(x) #x
-		static string token_type_names[] ={STR(_undefined), STR(_integer), STR(_hex), STR(_bool), STR(_std), STR(_name)};
+		static string token_type_names[] ={STR(_undefined), STR(_integer), STR(_hex), STR(_bool), STR(_std), STR(_extern), STR(_name), STR(_string)};
 		return token_type_names[_type];
 	}
 };
@@ -68,33 +201,52 @@ inline ostream& operator<<(ostream& str, const token& t)
 
 struct AST_node
 { 
-	virtual bool generate(class Hello_compiler& compiler, istream& f) = 0;
+	virtual bool generate(class Hello_compiler& compiler) = 0;
+	// Adds the node to the compiler's IR, for OPTIMISER_ON.
+	virtual void lower(class Hello_compiler& compiler) = 0;
+	// The size in bytes of the uintN value the node gives, or 0 for a script number or byte array.
+	virtual size_t big_size(const class Hello_compiler&) const { return 0; }
+	// As generate() and lower(), but the value is converted to a uintN of size bytes if need be.
+	virtual bool generate_as(class Hello_compiler& compiler, size_t size);
+	virtual void lower_as(class Hello_compiler& compiler, size_t size);
+	// Whether the node is the number 0.
+	virtual bool is_zero() const { return false; }
+	// Works out the type of the node and its children, before it is generated. Statements give _undefined.
+	virtual inferred_type infer(class type_checker& checker) = 0;
+	inferred_type inferred;	// as last inferred.
 };
-typedef shared_ptr<AST_node> AST_node_ptr;
+typedef AST_node* AST_node_ptr;  // nodes are owned by the compiler's ast_arena.
 
 class parse_error : public runtime_error  // localised error condition
 {
 public:
-	parse_error(const string& what, const tuple<streampos, size_t, size_t>& _pos)
+	parse_error(const string& what, streampoint _pos)
 		: runtime_error(what),
 	      pos(_pos)
 	{}
-	const tuple<streampos, size_t, size_t> pos;
+	const streampoint pos;
+};
+
+class type_error : public parse_error
+{
+public:
+	using parse_error::parse_error;
 };
 
 //static const char* separators = " \t\n\r\v";
 
+// Works over a contiguous source buffer. Tokens are string_views into that buffer and positions are byte offsets,
+// so the buffer must outlive any token (or AST built from it) that still refers to it.
 class tokeniser 
 {
 	char getch()
 	{
-		char ch = f.get();
-		if (!f.good())
+		if (pos >= src.size())
 			throw parse_error("Unexpected EOF.", tellg());  // Should already know what is on the stream before calling getch()
-		return ch;
+		return src[pos++];
 	}
 
-	char fpeek() const { return f.peek(); }
+	char fpeek() const { return (pos < src.size()) ? src[pos] : '\0'; }
 
 	static bool is_name_char(char ch) { return isalnum(ch) || (ch == '_'); }
 	static bool is_digit(char ch) { return isdigit(ch) != 0; }
@@ -113,24 +265,39 @@ class tokeniser
 	}
 
 	// Expects at least 1 char to match.
-	const token f_eat(function<bool(char)> accept, token::token_type _type)
+	const token f_eat(bool (*accept)(char), token::token_type _type)
+	{
+		size_t first = pos;
+		while (pos < src.size() && accept(src[pos]))
+			pos++;
+		if (pos == first)
+			throw parse_error("Unexpected character.", tellg());
+		return token(src.substr(first, pos - first), _type);
+	}
+
+	// A string runs to the next '"' on the same line. There are no escapes.
+	const token f_eat_string()	// the opening '"' should already be consumed.
+	{
+		size_t first = pos;
+		while(pos < src.size() && src[pos] != '"' && src[pos] != '\n')
+			pos++;
+		if(pos == src.size() || src[pos] != '"')
+			throw parse_error("Missing closing '\"'.", tellg());
+		return token(src.substr(first, pos++ - first), token::_string);
+	}
+
+	// The last n chars read as a single token.
+	const token last(size_t n, token_kind kind) const { return token(src.substr(pos - n, n), token::_std, kind); }
+
+	// Reads a one or two char operator, e.g. '<' or "<=".
+	const token f_eat_op(char second, token_kind one_char, token_kind two_chars)
 	{
-		stringstream ss;
-		for (;;)
+		if (fpeek() == second)
 		{
-			if(f.eof())
-				break;
-			char ch = f.get();
-			if (accept(ch))
-				ss << ch;
-			else
-			{
-				f.putback(ch);
-				break;
-			}
-		};
-		assert(!ss.str().empty());
-		return token(ss.str(), _type);
+			pos++;
+			return last(2, two_chars);
+		}
+		return last(1, one_char);
 	}
 
 	const token get_ftoken()
@@ -139,97 +306,57 @@ class tokeniser
 		char ch = getch();
 		switch (ch)
 		{
-		case '=':
-			if (fpeek() == '=') 
-			{ 
-				f.get(); 
-				return token("=="); 
-			}
-			else 
-				return token("=");
-		case '<':
-			if (fpeek() == '=')
-			{
-				f.get();
-				return token("<=");
-			}
-			else
-				return token("<");
-		case '>':
-			if (fpeek() == '=')
-			{
-				f.get();
-				return token(">=");
-			}
-			else
-				return token(">");
-		case '|':
-			if (fpeek() == '|')
-			{
-				f.get();
-				return token("||");
-			}
-			else
-				return token("|");
-		case '&':
-			if (fpeek() == '&')
-			{
-				f.get();
-				return token("&&");
-			}
-			else
-				return token("&");
+		case '=': return f_eat_op('=', token_kind::_assign, token_kind::_eq);
+		case '<': return f_eat_op('=', token_kind::_lt, token_kind::_le);
+		case '>': return f_eat_op('=', token_kind::_gt, token_kind::_ge);
+		case '!': return f_eat_op('=', token_kind::_not, token_kind::_ne);
+		case '|': return f_eat_op('|', token_kind::_bitor, token_kind::_concat);
+		case '&': return f_eat_op('&', token_kind::_bitand, token_kind::_andand);
 		case '.':
 			if (fpeek() == '.')
 			{
-				f.get();
-				return token("..");
+				pos++;
+				return last(2, token_kind::_range);
 			}
 			else
 				throw parse_error("Unexpected character '.'", tellg());
-		case '!':
-			if (fpeek() == '=')
-			{
-				f.get();
-				return token("!=");
-			}
-			else
-				return token("!");
-		case ',':
-		case '~':
-		case '+':
-		case '-':
-		case '%':
-		case '(':
-		case ')':
-		case '[':
-		case ']':
-		case '{':
-		case '}':
-		case ':':
-		case ';':
-			return token(ch);		
+		case ',': return last(1, token_kind::_comma);
+		case '~': return last(1, token_kind::_tilde);
+		case '+': return last(1, token_kind::_plus);
+		case '-': return last(1, token_kind::_minus);
+		case '*': return last(1, token_kind::_star);
+		case '/': return last(1, token_kind::_slash);
+		case '%': return last(1, token_kind::_percent);
+		case '(': return last(1, token_kind::_lparen);
+		case ')': return last(1, token_kind::_rparen);
+		case '[': return last(1, token_kind::_lbracket);
+		case ']': return last(1, token_kind::_rbracket);
+		case '{': return last(1, token_kind::_lbrace);
+		case '}': return last(1, token_kind::_rbrace);
+		case ':': return last(1, token_kind::_colon);
+		case ';': return last(1, token_kind::_semicolon);
+		case '"': return f_eat_string();
 		default:
 			if (isdigit(ch))
 			{
 				if ((ch == '0') && (fpeek() == 'x'))
 					return f_eat_Hex();
-				f.putback(ch);
+				pos--;
 				return f_eat_integer();  // used for for loops
 			}
 			else if (isalpha(ch) || ch == '$')
 			{
 				if(ch != '$')
-					f.putback(ch);
+					pos--;
 				token t = f_eat_name();
-				if (   t.value == "if" || t.value == "else" 
-					|| t.value == "for" || t.value == "in"
-					|| t.value == "true" || t.value == "false"
-					|| t.value == "and" || t.value == "or"
-					|| t.value == "Assert") // keywords not names
-					t.type = token::_std;
 				if(ch == '$')
 					t.type = token::_extern; 
+				else
+				{
+					t.kind = keywords.find(t.value);
+					if(is_keyword(t.kind)) // keywords not names
+						t.type = token::_std;
+				}
 				return t;
 			}
 			else
@@ -253,11 +380,33 @@ class tokeniser
 	}
 
 public:
+	// Zero-copy mode. source may be a memory-mapped file or any other buffer that outlives the tokeniser.
+	tokeniser(string_view source)
+		: src(source),
+		pos(0)
+	{
+		assert(src.size() <= numeric_limits<streampoint>::max());
+	}
+
+	// Stream mode. Slurps _f into a buffer owned by the tokeniser.
 	tokeniser(istream& _f)
-		: f(_f),
-		lineno(0),
-		pos_line_start(0)
+		: owned_src(istreambuf_iterator<char>(_f), istreambuf_iterator<char>()),
+		src(owned_src),
+		pos(0)
 	{
+		assert(src.size() <= numeric_limits<streampoint>::max());
+	}
+
+	tokeniser(const tokeniser&) = delete;
+	tokeniser& operator=(const tokeniser&) = delete;
+
+	// Re-points the tokeniser at the next chunk of source, which starts at offset _base in the whole source.
+	void reset(string_view source, streampoint _base)
+	{
+		src = source;
+		pos = 0;
+		base = _base;
+		stored_token.reset();
 	}
 
 	const token peek()
@@ -290,13 +439,14 @@ public:
 
 	const token eat_name() { return eat_token_type(token::_name); }
 	const token eat_integer() { return eat_token_type(token::_integer); }
+	const token eat_string() { return eat_token_type(token::_string); }
 
 	void eat() { get_token(); } // gobble up next token.
 
 	void eat(const token& expected)
 	{
 		const token t = get_token();
-		if (t != expected)
+		if (expected.kind != token_kind::_none ? t.kind != expected.kind : t != expected)
 		{
 			stringstream ss;
 			ss << "Expected: '" << expected.value << "', got '" << t.value << "'";  // TODO - bug if not std.
@@ -304,30 +454,20 @@ public:
 		}
 	}
 
-	void eat(const string& expected) { eat(token(expected)); }
+	void eat(string_view expected) { eat(token(expected)); }
+	void eat(token_kind expected) { eat(token(expected)); }
 
 	void ws()	// Eats whitespace and comments
 	{ 
 		bool in_comment = false;
-		for(;;)
+		for(; pos < src.size(); pos++)
 		{
-			char ch = fpeek(); 
-			if(f.eof())
-				break;
+			char ch = src[pos]; 
 			if(ch == '\n')
-			{
-				pos_line_start = f.tellg();
-				lineno++;
-			}
-			if(in_comment || isspace(ch) || ch == '#')
-			{
-				getch();
-				if(ch == '\n')
-					in_comment = false;
-				else if(ch == '#')
-					in_comment = true;
-			}
-			else
+				in_comment = false;
+			else if(ch == '#')
+				in_comment = true;
+			else if(!in_comment && !isspace(ch))
 				break;
 		}
 	}
@@ -336,25 +476,139 @@ public:
 	{
 		if(stored_token.is_valid())
 			return false;
-		f.peek(); 
-		return f.eof(); 
+		return pos >= src.size(); 
 	}
 
-	tuple<streampos, size_t, size_t> tellg() const
+	// Line and column are only worked out (by a line_table) if an error or annotation needs them.
+	streampoint tellg() const
 	{
 		if(stored_token.is_valid())
 			return stored_token_fpos;
-		long long pos = f.tellg();
-		if(pos < 0)	pos = 0;
-		size_t offset = pos - pos_line_start;
-		return tuple(pos, lineno, offset);
+		return base + streampoint(pos);
 	}
+
+	// The whole source buffer. Token values and positions refer into this.
+	string_view source() const { return src; }
 private:
-	istream& f;
-	tuple<streampos, size_t, size_t> stored_token_fpos;
-	streampos pos_line_start;
-	size_t lineno;
+	string owned_src;	// only used in stream mode.
+	string_view src;
+	size_t pos;
+	streampoint base = 0;	// offset of src in the whole source.
+	streampoint stored_token_fpos;
 
 	token stored_token;
 };
 
+// Reads a source stream one top-level statement at a time. Only the text of the current statement, and of any
+// earlier statements that have not been released yet, is held in memory. Or splits a source already in memory,
+// without copying it.
+// Statements are split lexically: a statement ends at a ';' or a closing '}' that is not inside brackets,
+// unless the '}' is followed by "else".
+class statement_reader
+{
+	istream* f = nullptr;		// null if the whole source is in buf.
+	string owned;				// the text read from f, which buf views.
+	string_view buf;			// buf[0] is at offset base in the source.
+	streampoint base = 0;
+	size_t stmt_start = 0, stmt_end = 0;	// the current statement, relative to buf.
+	size_t lines_released = 0;	// newlines in text that has been released.
+
+	static bool is_name_char(char ch) { return isalnum(ch) || (ch == '_'); }
+
+	// Makes sure buf[i] exists if there is any more source.
+	bool fill(size_t i)
+	{
+		char chunk[4096];
+		while(f && i >= owned.size() && f->good())
+		{
+			f->read(chunk, sizeof(chunk));
+			owned.append(chunk, (size_t)f->gcount());
+			buf = owned;
+		}
+		return i < buf.size();
+	}
+
+	// Skips whitespace and comments from buf[i]. Returns the index of the first char after them.
+	size_t skip_ws(size_t i)
+	{
+		bool in_comment = false;
+		for(; fill(i); i++)
+		{
+			char ch = buf[i];
+			if(ch == '\n')
+				in_comment = false;
+			else if(ch == '#')
+				in_comment = true;
+			else if(!in_comment && !isspace(ch))
+				break;
+		}
+		return i;
+	}
+
+public:
+	statement_reader(istream& _f) : f(&_f) {}
+	statement_reader(string_view source) : buf(source) {}
+
+	// Moves on to the next top-level statement. Returns false at the end of the source.
+	bool next()
+	{
+		stmt_start = stmt_end;
+		if(!fill(stmt_start))
+			return false;
+		int depth = 0;
+		size_t i = stmt_start;
+		while(fill(i))
+		{
+			char ch = buf[i++];
+			if(ch == '#')
+				i = skip_ws(i - 1);
+			else if(ch == '(' || ch == '[' || ch == '{')
+				depth++;
+			else if(ch == ')' || ch == ']')
+				depth--;
+			else if(ch == ';' && depth <= 0)
+				break;
+			else if(ch == '}' && --depth <= 0)
+			{
+				size_t j = skip_ws(i);
+				if(!(fill(j + 3) && buf.compare(j, 4, "else") == 0 && !(fill(j + 4) && is_name_char(buf[j + 4]))))
+					break;
+				i = j + 4;
+			}
+		}
+		stmt_end = min(i, buf.size());
+		if(base + stmt_end > numeric_limits<streampoint>::max())
+			throw parse_error("Source is too large. The limit is 4GB.", streampoint(base + stmt_start));
+		return true;
+	}
+
+	string_view text() const { return buf.substr(stmt_start, stmt_end - stmt_start); }
+	streampoint offset() const { return base + streampoint(stmt_start); }
+
+	// All the text held, i.e. from window_offset() up to the end of the current statement.
+	string_view window() const { return buf.substr(0, stmt_end); }
+	streampoint window_offset() const { return base; }
+
+	// Text before offset upto is no longer needed.
+	void release(streampoint upto)
+	{
+		size_t n = min(size_t(upto - base), stmt_start);
+		lines_released += count(buf.begin(), buf.begin() + n, '\n');
+		buf.remove_prefix(n);
+		if(f)
+		{
+			owned.erase(0, n);
+			buf = owned;
+		}
+		base += streampoint(n);
+		stmt_start -= n;
+		stmt_end -= n;
+	}
+
+	// Zero based line number of pos, which must not have been released.
+	size_t line(streampoint pos) const
+	{
+		size_t n = min(size_t(pos - base), buf.size());
+		return lines_released + count(buf.begin(), buf.begin() + n, '\n');
+	}
+};
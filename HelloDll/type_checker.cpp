@@ -0,0 +1,62 @@
+// Copyright (c) Shaun O'Kane, 2010, 2018
+#include "type_checker.h"
+#include "Hello_compiler.h"
+
+using namespace std;
+
+void type_checker::check(AST_node_ptr stmt)
+{
+	stmt->infer(*this);
+}
+
+inferred_type type_checker::variable(string_view name) const
+{
+	auto p = env.find(name);
+	return p != env.end() ? p->second : inferred_type();
+}
+
+void type_checker::assign(const string& name, const inferred_type& type)
+{
+	env[name] = type;
+}
+
+// A variable that is only assigned on one side keeps the type it has there.
+void type_checker::merge(const environment& other)
+{
+	for(auto& [name, type] : other)
+	{
+		auto p = env.emplace(name, type);
+		if(!p.second)
+			p.first->second = join(p.first->second, type);
+	}
+}
+
+inferred_type type_checker::join(const inferred_type& a, const inferred_type& b)
+{
+	if(a == b)
+		return a;
+	if(a.is_number() && b.is_number())
+		return {_integer, a.number_width() == b.number_width() ? a.number_width() : 0};
+	if(a.kind == _hex && b.kind == _hex && a.is_uint == b.is_uint)
+		return {_hex, a.width == b.width ? a.width : 0, a.is_uint};
+	return {};
+}
+
+void type_checker::expect_number(const inferred_type& type, token_kind op) const
+{
+	if(type.is_uint)
+		error("Operator '" + string(spelling(op)) + "' is not supported for uint" + to_string(type.width * 8) + ".");
+	if(type.kind == _hex && type.width > 4)
+		error("'" + string(spelling(op)) + "' takes numbers, not a " + to_string(type.width) + " byte value.");
+}
+
+void type_checker::error(const string& what) const
+{
+	throw type_error(what, stmt_pos);
+}
+
+void type_checker::reset()
+{
+	env.clear();
+	stmt_pos = 0;
+}
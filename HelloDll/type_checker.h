@@ -0,0 +1,45 @@
+#pragma once
+// Copyright (c) Shaun O'Kane, 2010, 2018
+
+#include <map>
+#include <string>
+#include "tokeniser.h"
+
+using namespace std;
+
+// Type inference. Each top-level statement is checked just before it is generated, so it works the same when
+// streaming. The types of the variables follow the flow of the source: after an if, a variable has the type both
+// branches agree on, and a loop body is checked until the types at the start of an iteration stop changing. The
+// code generators use the types to pick cheaper opcodes and skip conversions. Misuse that would fail when the
+// script runs, e.g. arithmetic on a hash, is a type_error.
+class type_checker
+{
+public:
+	typedef map<string, inferred_type, less<>> environment;	// variable -> its type at this point.
+
+	explicit type_checker(class Hello_compiler& compiler) : compiler(compiler) {}
+
+	void check(AST_node_ptr stmt);
+
+	class Hello_compiler& compiler;
+
+	// For the nodes' infer(). Errors are reported at the statement being checked.
+	void begin_stmt(streampoint pos) { stmt_pos = pos; }
+	inferred_type variable(string_view name) const;
+	void assign(const string& name, const inferred_type& type);
+	const environment& variables() const { return env; }
+	void restore(const environment& saved) { env = saved; }
+	void merge(const environment& other);	// each variable gets the join of its types here and in other.
+
+	static inferred_type join(const inferred_type& a, const inferred_type& b);
+	// Throws a type_error unless a value of type can be an operand of op, an operator or function that takes
+	// script numbers.
+	void expect_number(const inferred_type& type, token_kind op) const;
+	[[noreturn]] void error(const string& what) const;
+
+	void reset();
+
+private:
+	environment env;
+	streampoint stmt_pos = 0;
+};
@@ -0,0 +1,76 @@
+// Copyright (c) Shaun O'Kane, 2010, 2018
+#include "variable_allocator.h"
+
+using namespace std;
+
+variable_allocator::variable_allocator(instruction_pipeline& _pipe)
+	: pipe(_pipe)
+{
+}
+
+void variable_allocator::pop(size_t n)
+{
+	assert(n <= slots.size());
+	slots.resize(slots.size() - n);
+}
+
+size_t variable_allocator::depth_of(ir_value v, size_t skip) const
+{
+	assert(skip <= slots.size());
+	auto p = std::find(slots.rbegin() + skip, slots.rend(), v);
+	assert(p != slots.rend());
+	return p - slots.rbegin();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  Code generation. The cheapest sequence for each depth.
+//
+///////////////////////////////////////////////////////////////////////////////
+
+void variable_allocator::copy(ir_value v)
+{
+	size_t depth = depth_of(v);
+	switch(depth)
+	{
+	case 0: pipe << OP_DUP; break;
+	case 1: pipe << OP_OVER; break;
+	default: pipe << int(depth) << OP_PICK; break;
+	}
+	push(v);
+}
+
+void variable_allocator::move(ir_value v, size_t skip)
+{
+	size_t depth = depth_of(v, skip);
+	roll(depth);
+	slots.erase(slots.end() - 1 - depth);
+	push(v);
+}
+
+void variable_allocator::drop(ir_value v, size_t skip)
+{
+	remove(depth_of(v, skip));
+}
+
+void variable_allocator::roll(size_t depth)
+{
+	switch(depth)
+	{
+	case 0: break;
+	case 1: pipe << OP_SWAP; break;
+	case 2: pipe << OP_ROT; break;
+	default: pipe << int(depth) << OP_ROLL; break;
+	}
+}
+
+void variable_allocator::remove(size_t depth)
+{
+	switch(depth)
+	{
+	case 0: pipe << OP_DROP; break;
+	case 1: pipe << OP_NIP; break;
+	default: pipe << int(depth) << OP_ROLL << OP_DROP; break;
+	}
+	slots.erase(slots.end() - 1 - depth);
+}
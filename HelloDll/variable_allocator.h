@@ -0,0 +1,40 @@
+#pragma once
+// Copyright (c) Shaun O'Kane, 2010, 2018
+
+#include <vector>
+#include "Internals.h"
+#include "ir.h"
+
+using namespace std;
+
+// The main stack as the generated code leaves it: the IR value in each slot. Values are addressed by depth with
+// OP_PICK/OP_ROLL, and each operation emits the cheapest sequence for the depth.
+//
+// Used with OPTIMISER_ON, by the stack_scheduler. Otherwise variables live on the alt-stack.
+class variable_allocator
+{
+public:
+	vector<ir_value> slots;	// bottom first.
+
+	variable_allocator(instruction_pipeline& pipe);
+
+	// Values pushed or popped by the generated code.
+	void push(ir_value v) { slots.push_back(v); }
+	void pop(size_t n = 1);
+
+	size_t size() const { return slots.size(); }
+	bool contains(ir_value v) const { return find(slots.begin(), slots.end(), v) != slots.end(); }
+	size_t depth_of(ir_value v, size_t skip = 0) const;	// no. of values above v, ignoring the top skip.
+
+	void copy(ir_value v);					// to the top.
+	void move(ir_value v, size_t skip = 0);	// to the top. The top skip values aren't candidates.
+	void drop(ir_value v, size_t skip = 0);
+
+	void clear() { slots.clear(); }
+
+private:
+	instruction_pipeline& pipe;
+
+	void roll(size_t depth);		// emits the code to bring the value at depth to the top.
+	void remove(size_t depth);		// emits the code to drop the value at depth.
+};